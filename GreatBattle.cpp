@@ -1,47 +1,304 @@
 #include <iostream>
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include <vector>
 #include <string>
+#include <string_view>
 #include <time.h>
 #include <sstream>
 #include <algorithm>
+#include <thread>
+#include <chrono>
+#include <bit>
+#include <type_traits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <iterator>
+#include <fstream>
+#include <charconv>
+#include <memory>
+#include <unordered_map>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <csignal>
+#include <memory_resource>
+#include <coroutine>
+#include <utility>
+#include <functional>
+#include <exception>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <cerrno>
+#endif
 
 // Версия игры.
 const std::string version = "v1.0.0";
 
+// Типы событий битвы. Правила игры сами ничего не печатают, а только пишут события в журнал битвы.
+enum class EventType : unsigned char { CardPlayed, Damage, Heal, ExtraMoves, CardDrawn, GameOver };
+
+// Исход битвы (значение события GameOver).
+enum class BattleOutcome : unsigned char { YouLost, YouWon, BothLost };
+
+// Событие битвы. Значение - ID карты, единицы урона/здоровья, число ходов или исход битвы.
+struct BattleEvent
+{
+	EventType type;
+	bool isBotbder;
+	unsigned short value;
+};
+
+// Журнал событий одной битвы - кольцевой буфер фиксированного размера.
+// Читателей может быть несколько (отрисовка, статистика, повторы), каждый хранит свою позицию.
+class EventLog
+{
+public:
+	static const unsigned int capacity = 512;
+
+	EventLog();
+
+	void push(EventType type, bool isBotbder, unsigned int value);
+	void clear();
+
+	unsigned long long getBegin() const;
+	unsigned long long getEnd() const;
+	const BattleEvent& get(unsigned long long pos) const;
+private:
+	BattleEvent _events[capacity];
+	unsigned long long _end;
+};
+
+// Читатель журнала событий. Если читатель отстал больше чем на размер буфера, старые события пропускаются.
+class EventReader
+{
+public:
+	EventReader(const EventLog& log);
+
+	bool next(BattleEvent& event);
+	void skipAll();
+private:
+	const EventLog* _log;
+	unsigned long long _pos;
+};
+
+// Сценарий случайности для точного перебора исходов. Пока сценарий установлен в Random, случайные выборы
+// не бросаются, а берутся по очереди из сценария, и запоминается, сколько вариантов было у каждого выбора.
+// advance переходит к следующему сочетанию выборов, как одометр, пока все исходы не будут перебраны.
+// Обычный ход делает не больше трёх выборов (эффект карты, срабатывающие эффекты, добор). Длиннее бывает только
+// цепочка Непонятной ерунды, выпавшей самой себе: каждое звено - ещё один выбор с вероятностью 1 к числу карт игрока,
+// так что до maxChoices выборов доходят исходы с вероятностью меньше 25^-28. Сверх maxChoices выборы не бросаются:
+// исход помечается обрезанным (isTruncated), и доигрывать его нельзя.
+class ChanceScript
+{
+public:
+	static const unsigned int maxChoices = 32;
+
+	ChanceScript();
+
+	void start(bool isDrawCollapsed);
+	bool advance();
+	unsigned int next(unsigned int n);
+	unsigned int choose(const unsigned int* weights, unsigned int n);
+	double getProbability() const;
+	bool isDrawCollapsed() const;
+	bool isTruncated() const;
+private:
+	unsigned int _choices[maxChoices], _options[maxChoices];
+	double _probabilities[maxChoices];
+	const unsigned int* _weights[maxChoices];
+	unsigned int _count, _pos;
+	bool _isDrawCollapsed, _isTruncated;
+};
+
+// Состояние генератора xoshiro256**.
+struct RandomState
+{
+	unsigned long long s[4];
+};
+
+// Генератор случайных чисел (xoshiro256**). У каждого потока своё состояние, так что симуляция на нескольких ядрах не делит общий rand().
+// Состояние потока можно временно обменять на своё (RandomScope) - так у каждой битвы свой генератор.
+class Random
+{
+public:
+	static void seed(unsigned long long seed);
+	static RandomState makeState(unsigned long long seed);
+	static unsigned long long nextSeed();
+	static unsigned int next(unsigned int n);
+	static unsigned int choose(const unsigned int* weights, unsigned int n);
+
+	static ChanceScript* getScript();
+	static void setScript(ChanceScript* script);
+	static void swapState(RandomState& state);
+private:
+	static thread_local RandomState _state;
+	static thread_local ChanceScript* _script;
+
+	static unsigned long long nextRaw();
+};
+
+// Обменивает состояние генератора потока на state на время своей жизни. Пока обмен действует, в state лежит
+// прежнее состояние потока, так что вложенный RandomScope с тем же state временно возвращает генератор потока.
+class RandomScope
+{
+public:
+	RandomScope(RandomState& state);
+	~RandomScope();
+private:
+	RandomState& _state;
+};
+
+// Колода одной битвы. Обычные карты не кончаются, поэтому колода хранит лишь маски ещё не выпавших эпических карт
+// для каждой из сторон (бит на ID карты). Вытягивание карты - O(1) и без выделения памяти.
+class Deck
+{
+public:
+	Deck(bool isDuel = false);
+
+	void restoreEpicCards();
+	unsigned int getNewID(bool isBotbder);
+	unsigned int getRandomID(bool isBotbder) const;
+	unsigned long long getEpicMask(bool isBotbder) const;
+	void setEpicMask(bool isBotbder, unsigned long long mask);
+private:
+	unsigned long long _epicMask[2];
+	// В битве двух зрителей обе стороны тянут карты игрока.
+	bool _isDuel;
+
+	unsigned int pickID(bool isBotbder, bool& isEpic) const;
+	unsigned int getNewIDScripted(bool isBotbder);
+};
+
+// Рука игрока: ID карт во встроенном массиве фиксированного размера, без выделения памяти.
+// Если рука заполнена, новая карта сгорает - add возвращает false.
+class Hand
+{
+public:
+	static const unsigned int capacity = 15;
+
+	Hand();
+
+	bool add(unsigned int id);
+	void remove(unsigned int ind);
+	void swapRemove(unsigned int ind);
+	void set(unsigned int ind, unsigned int id);
+	void clear();
+
+	unsigned int get(unsigned int ind) const;
+	unsigned int size() const;
+	bool isFull() const;
+private:
+	unsigned char _size;
+	unsigned char _ids[capacity];
+};
+
+// Колесо отложенных эффектов игрока (timing wheel) на size его ходов вперёд. Ячейка колеса - ход игрока:
+// ID карт, чьи отложенные эффекты (nextMove) сработают в конце этого хода, в порядке регистрации,
+// и сколько ходов подряд каждый из них ещё будет срабатывать. Регистрация и срабатывание - O(1),
+// без просмотра всех эффектов. Колесо тривиально копируется вместе с игроком.
+class EffectWheel
+{
+public:
+	static const unsigned int size = 4;
+	static const unsigned int slotCapacity = 3;
+
+	struct Effect
+	{
+		unsigned char cardID, turns;
+	};
+
+	EffectWheel();
+
+	bool schedule(unsigned int cardID, unsigned int delay, unsigned int turns);
+	void advance();
+	void clear();
+
+	unsigned int getCount(unsigned int delay) const;
+	Effect get(unsigned int delay, unsigned int ind) const;
+private:
+	// Ячейка текущего хода.
+	unsigned char _now;
+	unsigned char _counts[size];
+	Effect _effects[size][slotCapacity];
+};
+
+struct PlayerRecord;
+
 // В игре принимают участие два игрока: вы и Botbder. Для них отдельный класс.
+// Игрок - простая тривиально копируемая структура, так что состояние битвы можно дёшево клонировать.
+// Никнеймы хранит GreatBattle.
 class Player
 {
 public:
-	Player(bool isBotbder);
+	Player(bool isBotbder, EventLog& events, Deck& deck);
 
-	std::string getName() const;
 	bool isBotbder() const;
 	unsigned int getHealth() const;
 	bool isDead() const;
 	unsigned int getExtraMovesCount() const;
+	unsigned int getPendingCardID() const;
+	const EffectWheel& getEffects() const;
 
-	void setName(std::string name);
+	void bind(EventLog& events, Deck& deck);
 	void setHealth(unsigned int hp);
+	void setExtraMovesCount(unsigned int moves);
+	void setPendingCardID(unsigned int id);
+	void clearEffects();
 	void damage(unsigned int hp);
 	void heal(unsigned int hp);
 	void addExtraMoves(unsigned int moves);
 	void generateIDConflict();
 
 	void retakeCards();
+	void drawCard();
 	void addNewCard(unsigned int id);
+	void applyCard(Player& enemy, unsigned int id);
+	void fireEffects(Player& enemy);
 	void useCard(Player& enemy, unsigned int id);
 	void move(Player& enemy, unsigned int ind);
 
 	unsigned int getCardID(unsigned int ind) const;
 	unsigned int getCardCount() const;
 	void removeAllCards();
+
+	void save(PlayerRecord& record) const;
+	void load(const PlayerRecord& record);
+
+	Deck& getDeck() const;
+	EventLog& getEvents() const;
 private:
-	std::string _name;
 	bool _isBotbder;
 	unsigned int _health, _extraMoves;
-	std::vector<unsigned int> _cardIDs;
-	unsigned int _prevCardID;
+	Hand _hand;
+	EffectWheel _effects;
+	EventLog* _events;
+	Deck* _deck;
+};
+
+static_assert(std::is_trivially_copyable_v<Player>, "Игрок должен копироваться простым копированием памяти");
+
+// Игрок в сохранении сессии: фиксированная раскладка без указателей. Отложенные эффекты - по ячейкам колеса начиная
+// с текущей: сколько их в ячейке (по 2 бита на ячейку в effectCounts) и сами эффекты по байту - ID карты в младших
+// 6 битах, сколько ходов ещё срабатывать - в старших двух.
+struct PlayerRecord
+{
+	unsigned short health;
+	unsigned char extraMoves, cardCount;
+	unsigned char cards[Hand::capacity];
+	unsigned char effectCounts;
+	unsigned char effects[EffectWheel::size * EffectWheel::slotCapacity];
 };
 
 typedef void (*MoveFunc)(Player&, Player&);
@@ -52,41 +309,193 @@ enum class CardType { Common, Epic, Player, Botbder };
 class Card
 {
 public:
-	Card();
-	Card(CardType type, std::string name, std::string description, MoveFunc move, MoveFunc nextMove);
+	constexpr Card();
+	constexpr Card(CardType type, std::string_view name, std::string_view description, MoveFunc move, MoveFunc nextMove,
+		unsigned int delay = 1, unsigned int duration = 1);
 
-	CardType getType() const;
-	std::string getName() const;
-	std::string getDescription() const;
+	constexpr CardType getType() const;
+	constexpr std::string_view getName() const;
+	constexpr std::string_view getDescription() const;
+	constexpr bool hasNextMove() const;
+	constexpr unsigned int getDelay() const;
+	constexpr unsigned int getDuration() const;
 
 	void move(Player& player, Player& enemy) const;
 	void nextMove(Player& player, Player& enemy) const;
 private:
 	CardType _type;
-	std::string _name, _description;
+	std::string_view _name, _description;
 	MoveFunc _move, _nextMove;
+	// Отложенный эффект срабатывает впервые через _delay своих ходов после хода картой и затем _duration ходов подряд.
+	unsigned char _delay, _duration;
+};
+
+// Таблица для вытягивания карт: неэпические карты, доступные одной из сторон.
+struct DrawTable
+{
+	unsigned char ids[63];
+	unsigned int size;
 };
 
-// Менеджер карт. Хранит в себе все карты Великой битвы.
+// Менеджер карт. Хранит в себе все карты Великой битвы - неизменяемую таблицу, собранную ещё при компиляции.
 class CardManager
 {
 public:
-	static void initCards();
-	static Card getCardByID(unsigned int id);
-	static unsigned int getAllCardsCount();
-	static unsigned int getNewID(bool isBotbder);
-	static unsigned int getRandomID(bool isBotbder);
-	static void restoreEpicCards();
+	// ID карт, которые выдаются другими картами.
+	static constexpr unsigned int boomerangID = 18;
+	static constexpr unsigned int potionIDs[5] = { 13, 14, 29, 31, 32 };
+
+	static constexpr const Card& getCardByID(unsigned int id);
+	static constexpr unsigned int getAllCardsCount();
+	static const DrawTable& getDrawTable(bool isBotbder);
+	static constexpr unsigned long long getEpicMask();
+private:
+	static const Card _availableCards[];
+	static const Card _unknownCard;
+	// Неэпические карты, доступные каждой из сторон (0 - игрок, 1 - Botbder).
+	static const DrawTable _drawTables[2];
+
+	static constexpr DrawTable makeDrawTable(bool isBotbder);
+};
+
+// Счётчики одной карты в одном потоке: сколько раз сыграна, сколько раз сработал её отложенный эффект (nextMove),
+// сколько урона она нанесла противнику и своему игроку, сколько вылечила и дала ходов, и в руке какой стороны
+// была к концу битвы. Ровно одна строка кэша, чтобы соседние карты и потоки не делили строки.
+struct alignas(64) CardCounters
+{
+	std::atomic<unsigned long long> plays, delayed, damage, selfDamage, heal, extraMoves, winningHands, losingHands;
+};
+
+static_assert(sizeof(CardCounters) == 64, "Счётчики карты должны занимать одну строку кэша");
+
+// Счётчики одного потока. Пишет в них только этот поток, читает кто угодно.
+// outcomes - исходы битв с Botbder'ом, duels - законченные битвы зрителей между собой.
+struct CardStatsBlock
+{
+	CardCounters cards[64];
+	alignas(64) std::atomic<unsigned long long> outcomes[3];
+	std::atomic<unsigned long long> duels;
+};
+
+// Сумма счётчиков всех потоков.
+struct CardTotals
+{
+	unsigned long long plays, delayed, damage, selfDamage, heal, extraMoves, winningHands, losingHands;
+};
+
+struct CardStatsTotals
+{
+	CardTotals cards[64];
+	unsigned long long outcomes[3];
+	unsigned long long duels;
+};
+
+// Статистика карт по всем битвам. Каждый поток считает в свой блок без блокировок и атомарных сложений
+// (поток один пишет в свои счётчики), а блоки складываются только по запросу. Блоки не удаляются с концом потока,
+// так что насчитанное не теряется. Ходы поиска Botbder'а не считаются: счёт включается только на ходы битвы.
+class CardStats
+{
+public:
+	static bool isEnabled();
+	static void setEnabled(bool isEnabled);
+	static void startTurn(const Player& player, const Player& enemy);
+	static void countEffect(unsigned int id, bool isDelayed, const Player& player, const Player& enemy);
+	static void countOutcome(BattleOutcome outcome, const Player& you, const Player& botbder);
+	static void countDuelOutcome(BattleOutcome outcome, const Player& first, const Player& second);
+
+	static void collect(CardStatsTotals& totals);
+	static bool writePrometheus(const std::string& path);
+private:
+	static std::mutex _mutex;
+	static std::vector<std::unique_ptr<CardStatsBlock>> _blocks;
+	static thread_local CardStatsBlock* _block;
+	static thread_local bool _isEnabled;
+	// Жизни и ходы игроков после прошлого посчитанного действия в текущем ходе.
+	static thread_local unsigned int _health, _enemyHealth, _extraMoves;
+
+	static CardStatsBlock& getBlock();
+	static void add(std::atomic<unsigned long long>& counter, unsigned long long value);
+	static void countHands(CardStatsBlock& block, BattleOutcome outcome, const Player& you, const Player& enemy);
+};
+
+// Участки пути от строки ввода до ответа, время которых меряется: разбор команды, ход игрока, ход Botbder'а,
+// весь ответ Botbder'а (с выбором ходов и дополнительными ходами), отрисовка событий, вся обработка строки
+// битвой и ожидание ответа в очереди чата до отправки.
+enum class LatencyPoint : unsigned char { Command, PlayerMove, BotbderMove, BotbderTurn, Render, Input, Reply, Count };
+
+// Гистограмма задержек в наносекундах с логарифмическими корзинами, как в HdrHistogram: значения до 32 нс
+// точные, дальше каждая степень двойки делится на 32 корзины (погрешность не больше 1/32).
+struct LatencyHistogram
+{
+	static const unsigned int subBucketBits = 5;
+	static const unsigned int bucketCount = (35 - subBucketBits + 1) << subBucketBits;
+
+	unsigned long long counts[bucketCount];
+	unsigned long long count, total;
+
+	static unsigned int getBucket(unsigned long long ns);
+	static unsigned long long getBucketValue(unsigned int bucket);
+	unsigned long long getPercentile(double percentile) const;
+	unsigned long long getMax() const;
+};
+
+// Гистограммы одного потока. Пишет в них только этот поток.
+struct LatencyBlock
+{
+	struct alignas(64) Point
+	{
+		std::atomic<unsigned long long> counts[LatencyHistogram::bucketCount];
+		std::atomic<unsigned long long> total;
+	};
+
+	Point points[(unsigned int)LatencyPoint::Count];
+};
+
+// Сумма гистограмм всех потоков. Разность двух сумм - гистограммы за интервал между ними.
+struct LatencyTotals
+{
+	LatencyHistogram points[(unsigned int)LatencyPoint::Count];
+
+	LatencyTotals operator-(const LatencyTotals& other) const;
+};
+
+// Замеры задержек на пути хода. Устроены как CardStats: у потока свой блок, сумма собирается по запросу.
+// Замеры включаются в режимах игры и чат-сервера; в симуляции и замерах производительности часы не читаются.
+// По сигналу SIGUSR1 чат-сервер выводит накопленные гистограммы в stderr.
+class LatencyStats
+{
+public:
+	static bool isEnabled();
+	static void setEnabled(bool isEnabled);
+	static void record(LatencyPoint point, std::chrono::steady_clock::duration duration);
+
+	static void collect(LatencyTotals& totals);
+	static void show(const LatencyTotals& totals, std::ostream& out);
+
+	static void requestDump(int signal);
+	static bool takeDumpRequest();
 private:
-	static std::vector<Card> _availableCards;
-	static std::vector<unsigned int> _epicCardIDs, _forPlayerCardIDs, _forBotbderCardIDs;
+	static bool _isEnabled;
+	static volatile std::sig_atomic_t _isDumpRequested;
+	static std::mutex _mutex;
+	static std::vector<std::unique_ptr<LatencyBlock>> _blocks;
+	static thread_local LatencyBlock* _block;
 
-	static void addNewCard(CardType type, std::string name, std::string description, MoveFunc move, MoveFunc nextMove);
+	static LatencyBlock& getBlock();
+};
+
+// Замер участка от создания до stop (или до конца области видимости).
+class LatencyTimer
+{
+public:
+	LatencyTimer(LatencyPoint point);
+	~LatencyTimer();
 
-	static void initEpicCards();
-	static void initCommonCards();
-	static void initPlayerCards();
-	static void initBotbderCards();
+	void stop();
+private:
+	LatencyPoint _point;
+	bool _isRunning;
+	std::chrono::steady_clock::time_point _start;
 };
 
 enum class ConsoleColor
@@ -109,677 +518,6834 @@ enum class ConsoleColor
 	White = 15
 };
 
-// Вспомогательный класс для работы с консолью. А именно - цвета и русская локализация.
+// Буфер вывода в консоль. Копит текст до flush (раз на команду) и меняет цвет только перед текстом
+// и только если цвет действительно другой. В Windows цвет меняется через консоль (перед этим буфер сбрасывается),
+// в остальных системах цвет пишется в тот же буфер ANSI-последовательностью.
+class ConsoleBuffer : public std::streambuf
+{
+public:
+	ConsoleBuffer();
+	~ConsoleBuffer();
+
+	void setColor(ConsoleColor text, ConsoleColor background);
+protected:
+	int_type overflow(int_type c) override;
+	std::streamsize xsputn(const char* s, std::streamsize n) override;
+	int sync() override;
+private:
+	std::string _buffer;
+	// Цвет в консоли и цвет для следующего текста (фон в старших четырёх битах, как в атрибутах Windows).
+	unsigned int _color, _nextColor;
+	// Писать ли ANSI-цвета: только если вывод идёт в терминал, а не в файл или другую программу.
+	bool _isAnsi;
+
+	void applyColor();
+	void write();
+};
+
+// Вспомогательный класс для работы с консолью. А именно - цвета, буферизованный вывод и русская локализация.
 class Console
 {
+#ifdef _WIN32
 	static HANDLE _hOut;
+#endif
+	static ConsoleBuffer _buffer;
+	static std::ostream _stream;
 public:
 	static void setRusLocale();
 	static void setConsoleColor(ConsoleColor text, ConsoleColor background = ConsoleColor::Black);
+	static std::ostream& getStream();
+#ifdef _WIN32
+	static void setAttribute(unsigned int color);
+#endif
 };
 
-// Интерпретатор команд (таких как "!битва инфо").
-class Command
+// Кусок заранее отрисованного экрана одного цвета.
+struct ScreenPart
+{
+	ConsoleColor color;
+	std::string text;
+};
+
+// Заранее отрисованный неизменный экран (правила, список карт и т.п.). Соседние куски одного цвета склеиваются,
+// а для вывода без цветов (в чат) хранится уже склеенный текст.
+class Screen
 {
 public:
-	Command(std::string input);
+	Screen();
 
-	std::string getCommand() const;
-	std::string getArg(unsigned int ind) const;
-	unsigned int getArgCount() const;
-	bool isUnsignedNumber(unsigned int ind) const;
+	Screen& setColor(ConsoleColor color);
+	Screen& add(std::string_view text);
+	void show(std::ostream& out, bool isColored) const;
 private:
-	std::string _cmd;
-	std::vector<std::string> _args;
+	std::vector<ScreenPart> _parts;
+	std::string _text;
+	ConsoleColor _color;
 };
 
-// Основной класс всея игры.
-class GreatBattle
+// Слова команд, которые понимает игра.
+enum class Keyword : unsigned char
+{
+	None,
+	Help,
+	Exit,
+	Battle,
+	Cards,
+	Info,
+	Adversary,
+	Hint,
+	Difficulty,
+	Easy,
+	Normal,
+	Hard,
+	Retake,
+	Stats,
+	Latency,
+	Challenge,
+	Watch
+};
+
+// Таблица слов команд с идеальным хешированием: seed подбирается при компиляции так, чтобы слова не сталкивались.
+struct KeywordTable
+{
+	static const unsigned int size = 64;
+
+	unsigned int seed;
+	std::string_view words[size];
+	Keyword keywords[size];
+};
+
+// Интерпретатор команд (таких как "!битва инфо").
+// Разобранная строка ввода. Не копирует строку, а ссылается на неё, поэтому строка должна жить дольше команды.
+// Аргументы сверх maxArgs отбрасываются.
+class Command
 {
 public:
-	GreatBattle();
-	void run();
+	static const unsigned int maxArgs = 8;
 
-	void reset();
-	void setNicknames();
+	Command(std::string_view input);
 
-	void showGreeting() const;
-	void showCommands() const;
+	static bool isCommand(std::string_view input);
+	static constexpr Keyword findKeyword(std::string_view word);
 
-	void showRules() const;
-	void showAllCards() const;
-	void showInfo() const;
-	void showAdversary() const;
+	std::string_view getCommand() const;
+	std::string_view getArg(unsigned int ind) const;
+	Keyword getKeyword() const;
+	Keyword getArgKeyword(unsigned int ind) const;
+	unsigned int getArgCount() const;
+	bool getUnsignedNumber(unsigned int ind, unsigned int& number) const;
+private:
+	std::string_view _cmd;
+	std::string_view _args[maxArgs];
+	unsigned int _argCount;
 
-	void showCard(unsigned int i, unsigned int id) const;
-	
-	bool moveStep(unsigned int i);
+	static const KeywordTable _keywords;
 
-	void playerMove(unsigned int ind);
-	void botbderMove(unsigned int ind);
-	bool checkDead() const;
+	static constexpr unsigned int hashWord(std::string_view word, unsigned int seed);
+	static constexpr KeywordTable makeKeywordTable();
+};
+
+// Компактное состояние битвы для поиска хода: оба игрока, колода и чей сейчас ход. Клонируется копированием памяти.
+// События клонов пишутся в черновой журнал, который никто не читает.
+class BattleState
+{
+public:
+	BattleState(const Player& you, const Player& botbder, const Deck& deck, bool isBotbderTurn, EventLog& events);
+	BattleState(const BattleState& other);
+	BattleState& operator=(const BattleState& other);
+
+	bool isOver() const;
+	bool isBotbderTurn() const;
+	const Player& getPlayer(bool isBotbder) const;
+	const Deck& getDeck() const;
+	float getBotbderValue() const;
+	unsigned long long getHash() const;
+
+	void applyMove(unsigned int ind);
 private:
 	Player _you, _botbder;
+	Deck _deck;
+	bool _isBotbderTurn;
 };
 
-int main()
+// Ключи Zobrist-хеширования состояния битвы. Считаются при компиляции.
+struct ZobristKeys
 {
-	srand(time(nullptr));
-	Console::setRusLocale();
-	CardManager::initCards();
-	GreatBattle gb;
-	gb.run();
-}
+	unsigned long long health[2][32], extraMoves[2][8], effects[2][EffectWheel::size][64], cards[2][64][16], epics[2][64], botbderTurn;
+};
 
-// ------------< GreatBattle >------------
+// Сложность Botbder'а: лёгкая - случайный ход, обычная и сложная - поиск с разным бюджетом времени.
+enum class Difficulty { Easy, Normal, Hard };
 
-GreatBattle::GreatBattle(): _you(false), _botbder(true)
+// Ограничения поиска на один ход: время в секундах и число итераций.
+struct SearchLimits
 {
-	showGreeting();
-	setNicknames();
-	reset();
-}
+	double seconds;
+	unsigned long long iterations;
+};
 
-void GreatBattle::run()
+// Запись таблицы транспозиций: статистика ходов (по ID карт) из одного состояния битвы.
+// Ценность хода - средний результат для Botbder'а от 0 до 1. generation - номер поиска, последним трогавшего запись.
+struct SearchEntry
 {
-	Console::setConsoleColor(ConsoleColor::LightMagenta);
-	std::cout << "Великая битва началась!" << std::endl;
-	Console::setConsoleColor(ConsoleColor::LightGreen);
-	std::cout << "Введите !помощь для вывода списка команд. " << std::endl;
-	std::string input;
+	unsigned long long key;
+	unsigned int visits;
+	unsigned short generation;
+	unsigned char actionCount;
+	unsigned char actionIDs[Hand::capacity];
+	unsigned int actionVisits[Hand::capacity];
+	float actionValues[Hand::capacity];
+};
 
-	bool retaked = false;
-	while (true)
-	{
-		Console::setConsoleColor(ConsoleColor::White);
-		std::cout << "> ";
-		std::getline(std::cin, input);
-		Command command(input);
-		if (command.getCommand() == "!помощь")
-			showCommands();
-		else if (command.getCommand() == "!выход")
-			break;
-		else if (command.getCommand() == "!битва")
-		{
-			if (command.getArgCount() == 0)
-				showRules();
-			else if (command.getArg(0) == "карты")
-				showAllCards();
-			else if (command.getArg(0) == "инфо")
-				showInfo();
-			else if (command.getArg(0) == "противник")
-				showAdversary();
-			else if (command.getArg(0) == "пересдать")
-			{
-				if (retaked)
-				{
-					Console::setConsoleColor(ConsoleColor::Red);
-					std::cout << "Вы более не можете пересдать карты!" << std::endl;
-				}
-				else
-				{
-					Console::setConsoleColor(ConsoleColor::LightGreen);
-					std::cout << "Карты пересданы." << std::endl;
-					_you.retakeCards();
-					retaked = true;
-				}
-			}
-			else if (command.isUnsignedNumber(0))
-			{
-				unsigned int ind = std::stoul(command.getArg(0));
-				if (ind > _you.getCardCount() || ind == 0)
-				{
-					Console::setConsoleColor(ConsoleColor::Red);
-					std::cout << "У вас нет такой карты!" << std::endl;
-					continue;
-				}
+// ИИ Botbder'а: поиск Монте-Карло по дереву (UCT) с таблицей транспозиций по Zobrist-хешу состояния.
+// Случайные эффекты карт и добор - узлы случая: ход проигрывается на копии состояния со случайным исходом,
+// а каждый исход попадает в свою запись таблицы, так что ценность хода усредняется по исходам.
+// Игрок считается сильным противником и в своих узлах выбирает худший для Botbder'а ход.
+// Таблица разбита на корзины по bucketSize записей: новое состояние вытесняет в своей корзине запись прошлых поисков,
+// а если таких нет - наименее посещённую. Корень текущего поиска не вытесняется, так что его статистика доживает
+// до выбора хода.
+class BotbderAI
+{
+public:
+	static const unsigned int tableSize = 1 << 15;
+	static const unsigned int bucketSize = 2;
+	static const unsigned int maxDepth = 64;
+	static const unsigned int maxRolloutMoves = 200;
 
-				if (!moveStep(ind))
-				{
-					reset();
-					retaked = false;
-				}
-				else
-					retaked = true;
-			}
-		}
-		else
-		{
-			Console::setConsoleColor(ConsoleColor::Red);
-			std::cout << "Команда не найдена!" << std::endl;
-		}
-	}
-}
+	static SearchLimits getLimits(Difficulty difficulty);
+	static unsigned int chooseCard(const BattleState& state, SearchLimits limits, float* cardValues = nullptr);
+	static EventLog& getScratchEvents();
+private:
+	static thread_local std::vector<SearchEntry> _table;
+	static thread_local EventLog _scratchEvents;
+	static thread_local unsigned long long _rootKey;
+	static thread_local unsigned short _generation;
 
+	static float search(BattleState& state, unsigned int depth);
+	static float rollout(BattleState& state);
+	static unsigned int probe(const BattleState& state, bool& isNew);
+	static bool isCheaper(const SearchEntry& entry, const SearchEntry& other);
+	static unsigned int findCard(const Player& player, unsigned int id);
+	static unsigned int chooseGreedy(const BattleState& state);
+};
 
-void GreatBattle::reset()
+// Шансы на победу обеих сторон.
+struct WinChances
 {
-	_you.setHealth(5);
-	_botbder.setHealth(5);
-
-	_you.removeAllCards();
-	_botbder.removeAllCards();
+	float you, botbder;
+};
 
-	CardManager::restoreEpicCards();
+// Запись таблицы решателя: шансы из состояния при расчёте на depth ходов вперёд. generation - номер расчёта,
+// в котором запись обновлялась; записи прошлых расчётов вытесняются первыми.
+struct SolverEntry
+{
+	unsigned long long key;
+	WinChances chances;
+	unsigned short depth, generation;
+};
 
-	for (int i = 0; i < 3; i++)
-	{
-		_you.addNewCard(CardManager::getNewID(false));
-		_botbder.addNewCard(CardManager::getNewID(true));
-	}
-}
+// Исход хода при переборе: состояние после хода и его вероятность.
+struct SolverOutcome
+{
+	unsigned long long hash;
+	double probability;
+	BattleState state;
+};
 
-void GreatBattle::setNicknames()
+// Решатель для подсказок: шансы на победу для каждой карты ходящего перебором всех ходов обеих сторон и всех
+// случайных исходов (ChanceScript), включая добор и выпадение эпических карт. Законченные битвы считаются точно,
+// на горизонте расчёта шансы оцениваются по жизням. Горизонт растёт, пока хватает времени.
+// Таблица состояний общая для всех битв потока и переживает ходы; её размер ограничен, старые записи вытесняются.
+class BattleSolver
 {
-	Console::setConsoleColor(ConsoleColor::White);
-	std::cout << "Введите свой никнейм: " << std::endl;
-	std::cout << "> ";
-	std::string nick;
-	std::getline(std::cin, nick);
-	_you.setName(nick);
-	_botbder.setName("Botbder");
-}
+public:
+	static const unsigned int tableSize = 1 << 18;
+	static const unsigned int maxDepth = 12;
 
+	static unsigned int analyze(const BattleState& state, double seconds, float* cardChances);
+private:
+	static thread_local std::vector<SolverEntry> _table;
+	static thread_local std::vector<SolverOutcome> _outcomes[maxDepth + 1];
+	static thread_local unsigned short _generation;
+	static thread_local std::chrono::steady_clock::time_point _deadline;
+	static thread_local unsigned int _nodes;
+	static thread_local bool _isAborted;
 
-void GreatBattle::showGreeting() const
+	static WinChances solve(const BattleState& state, unsigned int depth);
+	static WinChances expect(const BattleState& state, unsigned int ind, unsigned int depth);
+	static WinChances evaluate(const BattleState& state);
+};
+
+// Заголовок файла политики Botbder'а.
+struct PolicyHeader
 {
-	Console::setConsoleColor(ConsoleColor::LightMagenta);
-	std::cout << "Добро пожаловать на Великую битву!" << std::endl;
-	std::cout << "Великая битва - это коллекционная карточная игра в консольном режиме по Всемирью, нашей фэнтези-вселенной." << std::endl;
-	std::cout << "Версия игры: ";
-	Console::setConsoleColor(ConsoleColor::LightRed);
-	std::cout << version << std::endl;
-	std::cout << "Автор идеи: Mrakovey" << std::endl;
-	std::cout << "Реализатор: DmitryWS" << std::endl;
-	Console::setConsoleColor(ConsoleColor::LightMagenta);
-	std::cout << "Удачи, боец, и да хранит тебя Аркана!" << std::endl;
-}
+	char magic[8];
+	unsigned int version, rowCount;
+};
 
-void GreatBattle::showCommands() const
+// Политика Botbder'а - заранее посчитанные оценки ходов для абстрактных состояний битвы. Состояние сводится
+// к строке таблицы: жизни обеих сторон (до 7), есть ли у них дополнительные ходы и какие отложенные эффекты ждут.
+// В строке - 64 байта, по байту на ID карты: насколько ход этой картой хорош для Botbder'а (1..255, 0 - нет данных).
+// Мультимножество карт на руке учитывается при выборе: берётся лучшая из карт руки. Так ход находится чтением
+// одной кэш-линии, а вся таблица (6400 строк, 400 КБ) помещается в L2/L3.
+// Строится отдельно (--build-policy) поиском BotbderAI по состояниям из самоигры, в игре файл отображается в память.
+class PolicyTable
 {
-	Console::setConsoleColor(ConsoleColor::LightGreen);
-	std::cout << "Общие команды:" << std::endl;
-	std::cout << "!помощь - общий список команд;" << std::endl;
-	std::cout << "!выход - выход из игры." << std::endl;
-	std::cout << "!битва - правила Великой битвы." << std::endl;
-}
+public:
+	static const unsigned int version = 1;
+	static const unsigned int rowSize = 64;
+	static const unsigned int delayedCount = 5;
+	static const unsigned int rowCount = 8 * 8 * 2 * 2 * delayedCount * delayedCount;
 
+	static bool load(const std::string& path);
+	static bool isLoaded();
+	static unsigned int findCard(const BattleState& state);
+	static unsigned int getRow(const BattleState& state);
 
-void GreatBattle::showRules() const
+	static void build(const std::string& path, unsigned int states, double secondsPerState, unsigned int threads);
+private:
+	static const unsigned char* _rows;
+
+	static constexpr unsigned int getDelayedIndex(unsigned int id);
+	static void buildWorker(unsigned int states, double secondsPerState, unsigned long long seed,
+		std::vector<double>& sums, std::vector<unsigned int>& counts);
+};
+
+// Ход в записи битвы: кто и какой по счёту картой руки сходил (action), какая это была карта
+// и сколько жизней противник потерял за этот ход.
+struct ReplayMove
 {
-	Console::setConsoleColor(ConsoleColor::LightGreen);
-	std::cout << "В начале битвы вам и вашему противнику Botbder'у выдаются три карты." << std::endl;
-	std::cout << "У вас изначально 5 жизней, как и у Botbder. Ходы делаются поочерёдно, начиная с вас." << std::endl;
-	std::cout << "За ход можно использовать не более одной карты. Каждый ход вы вытягиваете ещё одну карту." << std::endl;
-	std::cout << "Проигрывает тот, у кого заканчиваются жизни." << std::endl;
-	std::cout << "!битва карты - информация о картах Великой битвы;" << std::endl;
-	std::cout << "!битва инфо - информация о ваших жизнях и картах;" << std::endl;
-	std::cout << "!битва противник - информация о жизнях Botbder;" << std::endl;
-	std::cout << "!битва [номер карты] - сыграть нужную карту;" << std::endl;
-	std::cout << "!битва пересдать - пересдать себе карты на первом ходу (один раз за битву)." << std::endl;
-}
+	// Старший бит action - ход Botbder'а, младшие - номер карты в руке (с нуля). Пересдача карт - retake.
+	static const unsigned char botbderFlag = 0x80;
+	static const unsigned char retake = 0x7F;
 
-void GreatBattle::showAllCards() const
+	unsigned char action, cardID, damage;
+};
+
+// Заголовок записи битвы в журнале. За ним идут ник игрока (nicknameLength байт) и moveCount ходов ReplayMove;
+// size - длина всей записи, выровненная на 8 байт. outcome - BattleOutcome или unfinished.
+// По marker (вместе с проверкой длин) начало записи находится с любого места файла, без чтения с начала.
+struct ReplayHeader
 {
-	Console::setConsoleColor(ConsoleColor::LightGreen);
-	std::cout << "Цветовые обозначения:" << std::endl;
+	static const unsigned char unfinished = 3;
+	static const unsigned short markerValue = 0x7EB7;
+
+	unsigned long long seed;
+	unsigned int size, moveCount;
+	unsigned char outcome, difficulty, nicknameLength, initialHand[3];
+	unsigned short marker;
+};
+
+// Заголовок файла журнала битв.
+struct ReplayFileHeader
+{
+	char magic[8];
+	unsigned int version, reserved;
+};
+
+// Журнал битв: файл, в конец которого дописываются записи законченных битв. Записи копятся в буфере
+// и пишутся в файл, когда буфер заполнится, при flush и при закрытии журнала.
+class ReplayLog
+{
+public:
+	static const unsigned int version = 3;
+	static const unsigned int bufferSize = 1 << 16;
+
+	ReplayLog();
+	~ReplayLog();
+
+	bool open(const std::string& path);
+	void write(const ReplayHeader& header, std::string_view nickname, const std::pmr::vector<ReplayMove>& moves);
+	void flush();
+
+	static bool show(const std::string& path, unsigned long long index);
+	static bool verify(const std::string& path);
+	static bool isRecord(const char* data, size_t size, size_t pos);
+private:
+	// Битвы чат-сервера пишут в журнал из разных потоков.
+	std::mutex _mutex;
+	std::ofstream _file;
+	std::vector<char> _buffer;
+
+	void writeBuffer();
+
+	static bool read(const std::string& path, std::vector<char>& data);
+	static bool replay(const ReplayHeader& header, std::ostream& out);
+};
+
+// Сохранённая сессия чата: битва с Botbder'ом, которую зритель ещё не доиграл, его сложность и победы.
+// Запись фиксированного размера лежит в своём слоте файла сессий и переписывается целиком. marker == 0 - слот свободен.
+// checksum (FNV-1a по остальным байтам записи) отсеивает записи, оборванные сбоем посреди записи.
+struct SessionRecord
+{
+	static const unsigned short markerValue = 0x5E55;
+	static const unsigned int maxNicknameLength = 36;
+
+	unsigned int checksum;
+	unsigned short marker;
+	unsigned char difficulty, isRetaked;
+	unsigned long long epicMask[2];
+	PlayerRecord players[2];
+	unsigned short wins;
+	unsigned char reserved, nicknameLength;
+	char nickname[maxNicknameLength];
+};
+
+static_assert(sizeof(SessionRecord) == 128, "Запись сессии должна занимать ровно 128 байт без выравнивающих пропусков");
+
+// Сводка по журналу битв одного потока анализатора. По ID карты: held - битвы, где карта была в руке игрока
+// на первом ходу, и победы в них; plays и damage - сколько раз карту сыграли и сколько жизней противник
+// потерял за эти ходы; decisive - сколько битв закончилось ходом этой картой.
+struct ReplayStats
+{
+	unsigned long long games, moves, bytes;
+	unsigned long long outcomes[4];
+	unsigned long long held[64], heldWins[64], plays[64], damage[64], decisive[64];
+};
+
+// Анализатор журнала битв: отображает файл в память и считает сводку на всех ядрах прямо по записям,
+// ничего не разбирая в объекты. Каждый поток берёт свой кусок файла и начинает с первой записи в нём.
+class ReplayAnalyzer
+{
+public:
+	static bool run(const std::string& path, unsigned int threads);
+private:
+	static void scanWorker(const char* data, size_t size, size_t begin, size_t end, ReplayStats& stats);
+	static void showStats(const ReplayStats& stats, double seconds, unsigned int threads);
+};
+
+// Память битвы зрителя - буфер внутри самой битвы, который заполняется с двух концов. Снизу - память текущей битвы
+// (запись ходов для повтора): rewind в начале новой битвы откатывает её целиком. Сверху - память, которая живёт,
+// пока жива сама битва (ник зрителя, буфер трансляции): её выделяет getSessionResource, и rewind её не трогает.
+// Выделение - сдвиг указателя, освобождение ничего не делает, поэтому сверху кладётся только то, что выделяется
+// один раз и потом почти не растёт. Если буфера не хватит, остальное берётся из кучи: память битвы возвращается
+// при откате, память сессии - вместе с битвой. Арена однопоточная: её трогает только тот, кто ведёт битву.
+// getUsed - расход текущей битвы. Счётчики getMaxUsed (наибольший расход битвы с запуска) и getOverflowCount
+// (сколько битв не уместились в буфер) общие на весь процесс.
+class BattleArena : public std::pmr::memory_resource
+{
+public:
+	static const size_t bufferSize = 2048;
+
+	BattleArena();
+
+	std::pmr::memory_resource* getSessionResource();
+	size_t getUsed() const;
+	size_t getSessionUsed() const;
+	void rewind();
+
+	static size_t getMaxUsed();
+	static unsigned long long getOverflowCount();
+private:
+	// Сессионная часть арены: выделяет с верхнего конца буфера.
+	class SessionResource : public std::pmr::memory_resource
+	{
+	public:
+		SessionResource(BattleArena& arena);
+	private:
+		BattleArena& _arena;
+
+		void* do_allocate(size_t bytes, size_t alignment) override;
+		void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+	};
+
+	alignas(std::max_align_t) unsigned char _buffer[bufferSize];
+	// Занятое снизу и сверху буфера (смещения границ) и сколько байт выделила каждая часть без учёта выравнивания.
+	size_t _bottom, _top;
+	size_t _used, _sessionUsed;
+	bool _isOverflowed;
+	std::pmr::monotonic_buffer_resource _overflow, _sessionOverflow;
+	SessionResource _session;
+
+	static std::atomic<size_t> _maxUsed;
+	static std::atomic<unsigned long long> _overflows;
+
+	void* do_allocate(size_t bytes, size_t alignment) override;
+	void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+// Ход битвы как сопрограмма. Сопрограмма запускается сразу и идёт до первого ожидания ввода, а дальше
+// продолжается по одной строке ввода за раз. Ждущая ввода битва занимает только кадр сопрограммы.
+// Ход может ждать вложенный ход (co_await), тогда вложенный, закончившись, продолжает ждущего.
+// Результат - остался ли игрок в игре. Исключение хода запоминается и бросается снова в ждущем его ходе,
+// а исключение самого внешнего хода остаётся в нём (getException) - его забирает тот, кто ведёт битву.
+class BattleTask
+{
+public:
+	struct promise_type;
+
+	// Конец хода: управление переходит к ждущему его ходу, если он есть.
+	struct FinalAwaiter
+	{
+		bool await_ready() const noexcept;
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) const noexcept;
+		void await_resume() const noexcept;
+	};
+
+	struct promise_type
+	{
+		std::coroutine_handle<> continuation;
+		bool isStaying;
+		std::exception_ptr exception;
+
+		BattleTask get_return_object();
+		std::suspend_never initial_suspend() noexcept;
+		FinalAwaiter final_suspend() noexcept;
+		void return_value(bool isStaying);
+		void unhandled_exception();
+	};
+
+	// Ожидание вложенного хода. Вложенный ход к этому времени уже ждёт ввода или закончился.
+	struct Awaiter
+	{
+		std::coroutine_handle<promise_type> handle;
+
+		bool await_ready() const noexcept;
+		void await_suspend(std::coroutine_handle<> continuation) const noexcept;
+		bool await_resume() const;
+	};
+
+	BattleTask();
+	BattleTask(BattleTask&& other) noexcept;
+	BattleTask& operator=(BattleTask&& other) noexcept;
+	~BattleTask();
+
+	Awaiter operator co_await() const noexcept;
+	bool isDone() const;
+	std::exception_ptr getException() const;
+private:
+	std::coroutine_handle<promise_type> _handle;
+
+	BattleTask(std::coroutine_handle<promise_type> handle);
+};
+
+class Duel;
+
+// Место зрителя в подборе соперника, а потом в битве с ним. Его делят битва зрителя, очередь подбора и битва двух зрителей.
+// Состояние меняется через CAS: ждущее место забирает ровно один из подбирающих (Claimed, затем Matched),
+// либо его отменяет хозяин (Cancelled), либо снимает подбор по тайм-ауту (Expired).
+// Битва с соперником записывается до Matched, поэтому хозяин, увидевший Matched, видит и её.
+// Пока место стоит в очереди, очередь держит на него ссылку (queueRef). Будит битву хозяина wake - под мьютексом,
+// чтобы хозяин мог отцепиться (detach) до того, как его сессия удалится.
+class DuelSeat
+{
+public:
+	enum class State : unsigned char { Waiting, Claimed, Matched, Cancelled, Expired };
+
+	DuelSeat(std::string_view nickname, unsigned int bucket, std::function<void()> wake);
+
+	std::string_view getNickname() const;
+	unsigned int getBucket() const;
+	std::chrono::steady_clock::time_point getQueued() const;
+	State getState() const;
+	const std::shared_ptr<Duel>& getDuel() const;
+	unsigned int getSide() const;
+
+	bool tryClaim();
+	void unclaim();
+	bool tryCancel();
+	bool tryExpire();
+	void start(std::shared_ptr<Duel> duel, unsigned int side);
+	void rearm(unsigned int bucket, const std::function<void()>& wake);
+	void setQueueRef(std::shared_ptr<DuelSeat> seat);
+	std::shared_ptr<DuelSeat> takeQueueRef();
+	void wake();
+	void detach();
+private:
+	std::string _nickname;
+	unsigned int _bucket;
+	std::chrono::steady_clock::time_point _queued;
+	std::atomic<State> _state;
+	std::shared_ptr<Duel> _duel;
+	unsigned int _side;
+	std::shared_ptr<DuelSeat> _queueRef;
+	std::mutex _mutex;
+	std::function<void()> _wake;
+};
+
+// Битва двух зрителей по обычным правилам: ходы по очереди, дополнительные ходы - как в битве с Botbder'ом.
+// Сторона 0 - дольше ждавший вызова, ходит первой. Сторона 1 в событиях отмечена как isBotbder, но, как и сторона 0,
+// тянет карты игрока (колода в режиме дуэли). Битву ведут воркеры обоих зрителей, поэтому все методы, кроме
+// getMutex, вызываются под getMutex().
+class Duel
+{
+public:
+	Duel(std::shared_ptr<DuelSeat> first, std::shared_ptr<DuelSeat> second, unsigned long long seed);
+
+	std::mutex& getMutex();
+	EventReader& getReader(unsigned int side);
+	const Player& getPlayer(unsigned int side) const;
+	DuelSeat& getSeat(unsigned int side) const;
+	unsigned int getTurn() const;
+	bool isOver() const;
+	bool hasLeft(unsigned int side) const;
+
+	void move(unsigned int side, unsigned int ind);
+	void leave(unsigned int side);
+private:
+	std::mutex _mutex;
+	EventLog _events;
+	// Что из событий уже выведено каждой стороне.
+	EventReader _readers[2];
+	Deck _deck;
+	Player _players[2];
+	RandomState _random;
+	std::shared_ptr<DuelSeat> _seats[2];
+	unsigned int _turn;
+	bool _isOver;
+	bool _hasLeft[2];
+
+	bool checkDead();
+};
+
+// Ограниченная lock-free очередь MPMC (по Вьюкову) из мест, ждущих соперника. Ячейка хранит номер последовательности:
+// по нему писатель видит, что ячейка свободна, а читатель - что она записана. Позиции писателей и читателей
+// занимают каждая свою строку кэша. Полная очередь не принимает место (push возвращает false).
+class MatchQueue
+{
+public:
+	static const unsigned int capacity = 1 << 12;
+
+	MatchQueue();
+
+	bool push(DuelSeat* seat);
+	bool pop(DuelSeat*& seat);
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		DuelSeat* seat;
+	};
+
+	alignas(64) std::atomic<size_t> _tail;
+	alignas(64) std::atomic<size_t> _head;
+	alignas(64) Cell _cells[capacity];
+};
+
+// Подбор соперников для битв между зрителями. Места ждут в очередях MatchQueue, по очереди на корзину умения
+// (по числу побед зрителя). Бросивший вызов забирает ждущего из своей корзины и сразу начинает битву, а если
+// ждущих нет - встаёт в очередь сам. Раз в sweepInterval сервер перебирает очереди: сводит разминувшихся в гонке,
+// после widenAfter - и ждущих из соседних корзин, а после matchTimeout снимает подбор (битва с Botbder'ом продолжается).
+class Matchmaker
+{
+public:
+	static const unsigned int bucketCount = 4;
+	static constexpr std::chrono::seconds sweepInterval{ 1 };
+	static constexpr std::chrono::seconds widenAfter{ 10 };
+	static constexpr std::chrono::seconds matchTimeout{ 30 };
+
+	Matchmaker();
+	~Matchmaker();
+
+	static unsigned int getBucket(unsigned int wins);
+	bool challenge(const std::shared_ptr<DuelSeat>& seat);
+	void sweep(std::chrono::steady_clock::time_point now);
+	unsigned long long getMatchCount() const;
+	unsigned long long getTimeoutCount() const;
+private:
+	std::unique_ptr<MatchQueue[]> _queues;
+	// Места, вынутые из очередей при переборе. Только для потока сервера.
+	std::vector<std::shared_ptr<DuelSeat>> _swept;
+	std::atomic<unsigned long long> _matches, _timeouts;
+
+	void start(std::shared_ptr<DuelSeat> first, std::shared_ptr<DuelSeat> second);
+};
+
+// Трансляция битвы зрителям. Вывод каждого хода отрисовывается один раз (в буфер битвы) и копируется в кольцо
+// последних capacity ходов с номерами: зритель хранит номер следующего непрочитанного хода, а отставший больше чем на
+// capacity ходов пропускает старые. Строки кольца переиспользуются, так что, раз дорастив до длины хода, трансляция
+// больше не выделяет память. Битва никогда не ждёт зрителей, а без зрителей ходы не отрисовываются вовсе.
+// Публикует ходы воркер битвы, читает сервер, поэтому кольцо - под мьютексом.
+class SpectatorFeed
+{
+public:
+	static const unsigned int capacity = 8;
+	// Под сколько байт место в строке хода выделяется сразу. Вывод хода почти всегда короче.
+	static const unsigned int textReserve = 1024;
+
+	SpectatorFeed();
+
+	void publish(std::string_view text);
+	bool read(unsigned long long& pos, unsigned long long& skipped, std::string& text) const;
+	unsigned long long getEnd() const;
+
+	bool hasSpectators() const;
+	void addSpectator();
+	void removeSpectator();
+private:
+	mutable std::mutex _mutex;
+	std::string _texts[capacity];
+	unsigned long long _end;
+	std::atomic<unsigned int> _spectators;
+};
+
+// Основной класс всея игры.
+class GreatBattle
+{
+public:
+	// Под сколько ходов место в записи битвы выделяется сразу. Почти все битвы короче.
+	static const unsigned int initialMoves = 64;
+	// Служебная строка ввода: битву будит подбор соперника или ход соперника. Строка чата такой не бывает.
+	static constexpr std::string_view wakeLine = "\x01";
+
+	GreatBattle();
+	GreatBattle(std::string_view nickname, std::ostream& out = Console::getStream());
+	~GreatBattle();
+	void run();
+	bool handleInput(std::string_view input);
+
+	void reset();
+	void reset(unsigned long long seed);
+	void setReplayLog(ReplayLog* replayLog);
+	void setMatchmaker(Matchmaker* matchmaker, std::function<void()> wake);
+	void setFeed(SpectatorFeed* feed);
+	bool replay(const ReplayHeader& header);
+	bool save(SessionRecord& record) const;
+	void restore(const SessionRecord& record);
+	bool isInDuel() const;
+
+	void showGreeting() const;
+	void showCommands() const;
+
+	void showRules() const;
+	void showAllCards() const;
+	void showInfo() const;
+	void showAdversary() const;
+	void showHint() const;
+	void showCardStats() const;
+	void showLatency() const;
+
+	void showCard(unsigned int i, unsigned int id) const;
+	static ConsoleColor getCardColor(CardType type);
 	
-	Console::setConsoleColor(ConsoleColor::LightMagenta);
-	std::cout << "###";
-	Console::setConsoleColor(ConsoleColor::LightGreen);
-	std::cout << " - данные карты существуют в единственном экземпляре и могут применяться один раз за битву." << std::endl;
-	Console::setConsoleColor(ConsoleColor::Yellow);
-	std::cout << "###";
-	Console::setConsoleColor(ConsoleColor::LightGreen);
-	std::cout << " - данные карты могут повторяться при выдаче." << std::endl;
-	Console::setConsoleColor(ConsoleColor::LightCyan);
-	std::cout << "###";
-	Console::setConsoleColor(ConsoleColor::LightGreen);
-	std::cout << " - данные карты доступны только игроку." << std::endl;
-	Console::setConsoleColor(ConsoleColor::Cyan);
-	std::cout << "###";
-	Console::setConsoleColor(ConsoleColor::LightGreen);
-	std::cout << " - данные карты доступны только Botbder'у." << std::endl;
+	bool moveStep(unsigned int i);
+
+	void playerMove(unsigned int ind);
+	void botbderMove(unsigned int ind);
+	unsigned int chooseBotbderCard();
+	bool checkDead();
+	void recordMove(bool isBotbder, unsigned int ind, unsigned int id, unsigned int enemyHealth);
+	void writeReplay();
+
+	void renderEvents();
+	void renderEvents(EventReader& reader, bool side, const std::string_view* names);
+	void publishTurn();
+
+	const Player& getYou() const;
+	const Player& getBotbder() const;
+	const EventLog& getEvents() const;
+	BattleState getState(EventLog& events) const;
+	std::string_view getName(bool isBotbder) const;
+
+	void setDifficulty(Difficulty difficulty);
+	void showDifficulty() const;
+	void setColor(ConsoleColor color) const;
+	bool isConsole() const;
+private:
+	// Ожидание следующей строки ввода: ход битвы засыпает, а handleInput будит его со строкой в _input.
+	struct InputAwaiter
+	{
+		GreatBattle& battle;
+
+		bool await_ready() const noexcept;
+		void await_suspend(std::coroutine_handle<> handle) const noexcept;
+		std::string_view await_resume() const noexcept;
+	};
+
+	// Куда пишется вывод битвы. Цвета меняются только при выводе в консоль.
+	std::ostream& _out;
+	// Память битвы. Объявлена до всего, что в ней живёт.
+	BattleArena _arena;
+	// Ник зрителя - в сессионной части арены.
+	std::pmr::string _nickname;
+	Difficulty _difficulty;
+	EventLog _events;
+	EventReader _renderer;
+	Deck _deck;
+	Player _you, _botbder;
+	// Свой генератор битвы: всё случайное в битве идёт от зерна _seed, так что битву можно повторить по записи.
+	RandomState _random;
+	// Запись текущей битвы и журнал, куда она попадёт по окончании битвы.
+	ReplayLog* _replayLog;
+	ReplayHeader _replayHeader;
+	std::pmr::vector<ReplayMove> _replayMoves;
+	// При повторе битвы - следующий записанный ход (ходы Botbder'а берутся из записи).
+	const ReplayMove* _replayPos;
+	// Пересдавал ли игрок карты (или уже ходил) в этой битве. Битва, восстановленная из сохранения сессии,
+	// начинается не с начала, так что в журнал она не пишется.
+	bool _isRetaked, _isRestored;
+	// Трансляция битвы (в чате): её свой читатель событий и буфер в сессионной части арены, в котором ход
+	// отрисовывается для зрителей. Место под буфер (SpectatorFeed::textReserve) берётся при первом ходе со зрителями.
+	SpectatorFeed* _feed;
+	EventReader _feedReader;
+	std::pmr::string _feedText;
+	// Подбор соперника (в чате), как разбудить битву зрителя, сколько битв он выиграл и его место в подборе или битве с соперником.
+	// Место прошлого вызова (_spareSeat) берётся для следующего, если его уже отпустили очередь и битва с соперником.
+	Matchmaker* _matchmaker;
+	std::function<void()> _wake;
+	unsigned int _wins;
+	std::shared_ptr<DuelSeat> _seat, _spareSeat;
+	// Ход битвы, строка ввода, с которой он продолжается, и ждущий её ход (вложенный или сам ход битвы).
+	// Объявлен последним: кадр сопрограммы ссылается на битву.
+	std::string_view _input;
+	std::coroutine_handle<> _waiting;
+	BattleTask _task;
+
+	BattleTask play();
+	BattleTask playDuel();
+	InputAwaiter nextInput();
+	bool challenge();
+	void leaveDuel();
+	void closeOnError(std::exception_ptr exception);
+	void showDuelInfo(const Duel& duel, unsigned int side) const;
+
+	static void appendNumber(std::pmr::string& text, unsigned int number);
+};
+
+// Результат одного замера: сколько наносекунд уходит на одну операцию.
+struct BenchmarkResult
+{
+	std::string name;
+	double nsPerOp;
+	unsigned long long ops;
+};
+
+// Замеры скорости движка на фиксированных зёрнах: от отдельных операций (вытягивание карты, ход, разбор команды)
+// до целых битв через moveStep без вывода. Каждый замер повторяется, берётся лучший результат.
+// Результаты можно сохранить в JSON и сравнить с сохранёнными ранее: замедление больше чем на
+// threshold (по умолчанию defaultThreshold) считается регрессией.
+class Benchmark
+{
+public:
+	static const unsigned int repeats = 5;
+	static constexpr double defaultThreshold = 0.10;
+
+	static bool run(const std::string& jsonPath, const std::string& baselinePath, double threshold);
+private:
+	template <typename Func>
+	static BenchmarkResult measure(std::string name, unsigned long long ops, Func func);
+
+	static BenchmarkResult benchDrawCard();
+	static BenchmarkResult benchGetCardByID();
+	static BenchmarkResult benchPlayerMove();
+	static BenchmarkResult benchUseCard();
+	static BenchmarkResult benchCommand();
+	static BenchmarkResult benchRestoreEpicCards();
+	static BenchmarkResult benchReset();
+	static BenchmarkResult benchGame();
+
+	static bool writeJson(const std::string& path, const std::vector<BenchmarkResult>& results);
+	static bool readJson(const std::string& path, std::vector<BenchmarkResult>& results);
+};
+
+// Статистика симуляции одного потока.
+struct SimulatorStats
+{
+	unsigned long long games, moves, aborted;
+	unsigned long long outcomes[3];
+	std::vector<unsigned long long> plays, gamesPlayed, gamesWon;
+
+	SimulatorStats(unsigned int cardCount);
+	void add(const SimulatorStats& other);
+};
+
+// Безголовый симулятор Великой битвы: играет множество битв по обычным правилам (reset + moveStep) на всех ядрах.
+// Обе стороны ходят случайной картой. Нужен для балансировки карт.
+class Simulator
+{
+public:
+	static const unsigned int maxMovesPerGame = 10000;
+
+	static void run(unsigned long long games, unsigned int threads, bool isBatch);
+	static void simulate(unsigned long long games, unsigned int threads, unsigned long long seed, bool isBatch, SimulatorStats& total);
+private:
+	static void runWorker(unsigned long long games, unsigned long long seed, SimulatorStats& stats);
+	static void runBatchWorker(unsigned long long games, unsigned long long seed, SimulatorStats& stats);
+	static void showStats(const SimulatorStats& stats, double seconds, unsigned int threads);
+};
+
+// Эффект простой карты: урон, лечение и дополнительные ходы себе (self) и противнику (enemy).
+// С вероятностью bonusChance из 10 противнику наносится ещё bonusDamage ед. урона.
+struct CardEffect
+{
+	unsigned char selfDamage, enemyDamage, selfHeal, enemyHeal, selfExtraMoves, enemyExtraMoves, bonusChance, bonusDamage;
+};
+
+// Эффекты карты для пакетного движка: при использовании (move) и на следующем ходу (nextMove).
+// keepsCard - карта возвращается в руку (Бумеранг), drawCards и drawPotions - сколько карт из колоды и случайных
+// зелий получает игрок. Сложные карты (случайные эффекты на несколько исходов, чужие карты) считаются скалярно.
+struct CardEffects
+{
+	bool isComplex, keepsCard;
+	unsigned char drawCards, drawPotions;
+	CardEffect move, nextMove;
+};
+
+// Пакетный движок для массовой симуляции. Хранит множество битв в параллельных массивах и двигает их все на ход за раз.
+// Простые карты применяются общим ядром без ветвлений по таблице эффектов, а редкие сложные карты -
+// через настоящие Player и Card. По правилам совпадает с GreatBattle::moveStep при случайных ходах обеих сторон.
+class BatchEngine
+{
+public:
+	BatchEngine(unsigned int lanes);
+
+	void run(unsigned long long games, SimulatorStats& stats);
+
+	static constexpr CardEffects getCardEffects(unsigned int id);
+	static constexpr bool hasAllCardEffects();
+private:
+	// Эффекты простой карты по её названию.
+	struct NamedEffects
+	{
+		std::string_view name;
+		CardEffect move, nextMove;
+		bool keepsCard;
+		unsigned char drawCards, drawPotions;
+	};
+
+	static const NamedEffects _simpleCards[];
+	static const std::string_view _complexCards[];
+	static const CardEffects _effects[64];
+
+	unsigned int _lanes;
+	// Состояние сторон битвы i лежит по индексам 2 * i (игрок) и 2 * i + 1 (Botbder).
+	std::vector<unsigned int> _health, _extraMoves;
+	std::vector<unsigned char> _prevCardID;
+	std::vector<Hand> _hands;
+	std::vector<Deck> _decks;
+	// Состояние каждой битвы: кто ходит, какой картой, сколько ходов сделано и какие карты сыграла каждая сторона.
+	std::vector<unsigned char> _mover, _cardID, _isActive;
+	std::vector<unsigned int> _moves, _rolls;
+	std::vector<unsigned long long> _played;
+	EventLog _scratchEvents;
+
+	void startGame(unsigned int lane);
+	void finishGame(unsigned int lane, SimulatorStats& stats);
+	void chooseCards(SimulatorStats& stats);
+	void applySimpleCards();
+	void applyComplexCard(unsigned int lane);
+	void loadPlayer(Player& player, unsigned int side) const;
+	void storePlayer(const Player& player, unsigned int side);
+};
+
+// Ограничитель частоты: ведро на capacity жетонов, которое пополняется со скоростью rate жетонов в секунду.
+class TokenBucket
+{
+public:
+	TokenBucket(double capacity, double rate);
+
+	bool take(std::chrono::steady_clock::time_point now);
+	std::chrono::steady_clock::duration getWaitTime(std::chrono::steady_clock::time_point now);
+private:
+	double _capacity, _rate, _tokens;
+	std::chrono::steady_clock::time_point _updated;
+
+	void refill(std::chrono::steady_clock::time_point now);
+};
+
+#ifndef _WIN32
+// Хеш ников, чтобы искать сессии по string_view без создания строки.
+struct NicknameHash
+{
+	using is_transparent = void;
+
+	size_t operator()(std::string_view nickname) const;
+};
+
+// Сохранённые сессии чата, чтобы недоигранные битвы пережили перезапуск сервера. Файл - массив слотов по записи
+// SessionRecord, у каждого зрителя свой слот. Файл читается целиком при открытии, и последняя сохранённая запись
+// каждого слота держится в памяти (по sizeof(SessionRecord) на слот): битва восстанавливается, когда зритель
+// напишет снова, без чтения с диска и без ожидания записи, даже если его сессию только что выгрузили.
+// Воркеры отдают изменившиеся сессии в пакет, а поток записи пишет пакет в слоты
+// и делает на весь пакет один fdatasync (group commit) не чаще раза в commitInterval: пока пакет пишется
+// или ждёт своего времени, следующие сохранения копятся в нём же или в новом пакете. Сессия, сохранённая
+// несколько раз до записи, пишется один раз - последней версией. При сбое теряется не больше commitInterval ходов.
+class SessionStore
+{
+public:
+	static const unsigned int noSlot = ~0u;
+	static constexpr std::chrono::milliseconds commitInterval{ 100 };
+
+	SessionStore();
+	~SessionStore();
+
+	bool open(const std::string& path);
+	bool load(std::string_view nickname, unsigned int& slot, SessionRecord& record);
+	void save(unsigned int slot, const SessionRecord& record);
+	void release(std::string_view nickname, unsigned int slot);
+
+	unsigned long long getRecordCount() const;
+	unsigned long long getCommitCount() const;
+private:
+	struct PendingRecord
+	{
+		unsigned int slot;
+		SessionRecord record;
+	};
+
+	int _file;
+	// Слоты сохранённых и текущих сессий по никам и освободившиеся слоты (только поток сервера).
+	std::unordered_map<std::string, unsigned int, NicknameHash, std::equal_to<>> _slots;
+	std::vector<unsigned int> _freeSlots;
+	unsigned int _slotCount;
+	// Последние сохранённые записи слотов (без контрольной суммы), пакет, ждущий записи, и для каждого слота -
+	// место его записи в пакете плюс один (0 - записи нет).
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::vector<SessionRecord> _saved;
+	std::vector<PendingRecord> _pending;
+	std::vector<unsigned int> _pendingPos;
+	bool _isStopping;
+	std::atomic<unsigned long long> _records, _commits;
+	std::thread _thread;
+
+	void runWriter();
+
+	static unsigned int getChecksum(const SessionRecord& record);
+};
+
+// Сессия зрителя. Битву (и её вывод) трогает только воркер SessionScheduler, выполняющий сессию.
+// Под mutex - то, что делят сервер и воркер: ещё не выполненные команды (по строке на команду), готовый вывод,
+// закрыл ли он битву, стоит ли сессия в очереди воркера или выполняется (isScheduled), ждёт ли она сервер
+// в списке выполненных (isCompleted) и стоит ли битва в подборе или в битве с соперником после последних команд
+// (isInDuel: такую сессию может поставить воркеру чужая битва). Сессию можно удалить, только когда ни воркер,
+// ни список её не держат.
+// Остальное - только сервера: ответ зрителю, когда пришло самое раннее сообщение без ответа (от него
+// считается задержка) и последнее сообщение. Вышедший из игры зритель удаляется только после отправки последнего ответа.
+// Строки команд, вывода и ответа - из собственного пула сессии, а не из общей кучи. Пул не потокобезопасен, поэтому
+// всё, что может выделить в нём память (дописать в эти строки), делается под mutex - и для ответа тоже.
+struct ChatSession
+{
+	// Под сколько байт вывода одной команды место в буфере вывода битвы выделяется сразу.
+	static const size_t outputReserve = 4096;
+
+	std::pmr::unsynchronized_pool_resource memory;
+	std::unique_ptr<GreatBattle> battle;
+	std::ostringstream output;
+	bool isClosed;
+
+	std::mutex mutex;
+	std::pmr::string commands{ &memory }, result{ &memory };
+	bool isFinished, isScheduled, isCompleted, isInDuel;
+	unsigned int worker;
+
+	std::string_view nickname;
+	std::pmr::string reply{ &memory };
+	std::chrono::steady_clock::time_point received, active;
+	bool isWaiting, isQueued;
+
+	// Трансляция битвы сессии и её зрители. Кого смотрит сам зритель и номер следующего хода трансляции
+	// (кроме самой трансляции, всё это трогает только поток сервера).
+	SpectatorFeed feed;
+	std::vector<ChatSession*> spectators;
+	ChatSession* watched;
+	unsigned long long watchPos, watchSkipped;
+
+	// Куда сохраняется сессия и последнее сохранённое состояние (только воркера; слот назначает сервер до первой команды).
+	SessionStore* store;
+	unsigned int slot;
+	SessionRecord saved;
+};
+
+// Планировщик сессий: пул воркеров, у каждого своя очередь сессий, которым есть что выполнить.
+// Сессия закреплена за воркером: новые команды ставят её в его очередь. В каждый момент сессия либо ждёт
+// в одной очереди, либо выполняется одним воркером, так что её команды идут по порядку и битва обходится
+// без блокировок. Воркер без работы крадёт сессию из хвоста чужой очереди и забирает её себе целиком.
+// Долгий выбор хода Botbder'а занимает только свой воркер - сессии, стоящие за ним, уводят свободные воркеры.
+// Выполненные сессии возвращаются серверу списком, о котором сервер узнаёт через eventfd в своём epoll.
+class SessionScheduler
+{
+public:
+	SessionScheduler(unsigned int workers);
+	~SessionScheduler();
+
+	void stop();
+
+	int getEventFd() const;
+	unsigned int getWorkerCount() const;
+	unsigned long long getStealCount() const;
+	unsigned int assignWorker();
+	void submit(ChatSession& session);
+	void takeCompleted(std::vector<ChatSession*>& sessions);
+private:
+	// Очередь воркера. Спящего воркера будит тот, кто поставил сессию в его очередь, или, если хозяин сессии
+	// занят, в очередь к кому-то другому - тогда проснувшийся воркер её украдёт.
+	// Очередь - вектор с индексом головы: опустев, он очищается без освобождения памяти, так что в
+	// установившемся режиме очереди не выделяют память.
+	struct alignas(64) Worker
+	{
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::vector<ChatSession*> queue;
+		size_t head;
+		bool isSleeping;
+	};
+
+	std::vector<std::unique_ptr<Worker>> _workers;
+	std::vector<std::thread> _threads;
+	// Сколько сессий стоит во всех очередях: воркер спит, только если красть нечего.
+	std::atomic<unsigned int> _pending;
+	std::atomic<bool> _isStopping;
+	std::mutex _completedMutex;
+	std::vector<ChatSession*> _completed;
+	int _eventFd;
+	unsigned int _nextWorker;
+	std::atomic<unsigned long long> _steals;
+
+	void runWorker(unsigned int ind, unsigned long long seed);
+	ChatSession* take(unsigned int ind);
+	void wakeIdle();
+	void runSession(ChatSession& session, std::string& commands, std::string& result);
+	void saveSession(ChatSession& session);
+	void complete(ChatSession& session);
+};
+
+// Статистика задержки ответов: от получения сообщения до отправки ответа в чат.
+struct ChatStats
+{
+	unsigned long long received, replies, messages, evicted;
+	std::chrono::steady_clock::duration totalDelay, maxDelay;
+};
+
+// Чат-сервер: подключается к IRC-серверу (Twitch или любому другому), заходит на канал и ведёт отдельную битву
+// для каждого зрителя, написавшего команду игры. Сеть - в одном потоке: неблокирующий сокет, epoll и таблица сессий
+// по никам, а сами битвы ведут воркеры SessionScheduler.
+// Строки чата, не являющиеся командами игры, отбрасываются без разбора и без поиска сессии.
+// Весь вывод битвы на одно сообщение сливается в один ответ, а ответы разных зрителей упаковываются вместе
+// в сообщения чата до maxMessageLength байт. Сообщения уходят не чаще, чем разрешает чат (messagesPer30s).
+// Сессия зрителя, молчащего дольше idleTimeout, сохраняется и выгружается из памяти, а когда он напишет снова,
+// битва читается из сохранения.
+class ChatServer
+{
+public:
+	static const unsigned int readSize = 1 << 16;
+	static const unsigned int maxLineLength = 8192;
+	static const unsigned int maxMessageLength = 500;
+	static constexpr std::chrono::seconds statsInterval{ 10 };
+	static constexpr std::chrono::minutes idleTimeout{ 10 };
+	static constexpr std::chrono::seconds evictInterval{ 10 };
+	// Файл статистики карт для Prometheus, переписывается раз в statsInterval.
+	static constexpr const char* metricsPath = "greatbattle.prom";
+
+	ChatServer(std::string channel, std::string nickname, std::string password, unsigned int messagesPer30s, unsigned int workers,
+		ReplayLog* replayLog, SessionStore* sessionStore);
+	~ChatServer();
+
+	bool connect(const char* host, const char* port);
+	void run();
+
+	unsigned int getSessionCount() const;
+private:
+	std::string _channel, _nickname, _password;
+	ReplayLog* _replayLog;
+	SessionStore* _sessionStore;
+	int _socket, _epoll;
+	// Принятые, но ещё не разобранные байты и ещё не отправленные байты.
+	std::vector<char> _readBuffer;
+	std::string _input, _output;
+	size_t _outputPos;
+	bool _isWaitingOutput;
+	// Подбор соперников для битв между зрителями. Объявлен до сессий: их битвы ставят в него места.
+	Matchmaker _matchmaker;
+	std::chrono::steady_clock::time_point _swept, _evicted;
+	std::unordered_map<std::string, ChatSession, NicknameHash, std::equal_to<>> _sessions;
+	// Воркеры, ведущие битвы. Объявлен после сессий, чтобы остановиться раньше, чем они удалятся.
+	SessionScheduler _scheduler;
+	std::vector<ChatSession*> _completed;
+	// Ники зрителей с неотправленными ответами, в порядке поступления сообщений.
+	std::deque<std::string_view> _replyQueue;
+	// Собираемое сообщение в чат и ход трансляции, который в него копируется.
+	std::string _message, _feedText;
+	TokenBucket _sendLimit;
+	ChatStats _stats, _shownStats;
+	std::chrono::steady_clock::time_point _statsShown;
+	// Гистограммы задержек на момент прошлого вывода статистики: выводятся только замеры за интервал.
+	std::unique_ptr<LatencyTotals> _shownLatency;
+
+	bool readInput();
+	bool writeOutput();
+	void handleLine(std::string_view line);
+	void handleMessage(std::string_view nickname, std::string_view text);
+	void schedule(ChatSession& session, std::string_view line);
+	void watch(ChatSession& session, std::string_view nickname);
+	void addReply(ChatSession& session, std::initializer_list<std::string_view> parts);
+	void unwatch(ChatSession& session);
+	void handleCompleted();
+	bool tryRemove(ChatSession& session);
+	void evictIdle(std::chrono::steady_clock::time_point now);
+	bool tryEvict(ChatSession& session);
+	void remove(ChatSession& session);
+	void queueReply(ChatSession& session);
+	void flushReplies(std::chrono::steady_clock::time_point now);
+	bool packReply(ChatSession& session, std::string_view nickname, std::chrono::steady_clock::time_point now);
+	bool packFeed(ChatSession& session, std::string_view nickname);
+	void send(std::string_view command, std::string_view argument, std::string_view text = {});
+	void setWaitingOutput(bool isWaiting);
+	int getTimeout(std::chrono::steady_clock::time_point now);
+	void showStats(std::chrono::steady_clock::time_point now);
+};
+#endif
+
+// Аргументы командной строки. Числа разбираются так же, как в командах игры: всё слово целиком должно быть числом.
+class Arguments
+{
+public:
+	template <typename T>
+	static bool getNumber(const char* arg, T& number);
+	static int showUsage();
+};
+
+// Тесты подключают игру целиком и определяют GREATBATTLE_NO_MAIN, чтобы собрать свой main.
+#ifndef GREATBATTLE_NO_MAIN
+int main(int argc, char* argv[])
+{
+	Random::seed(time(nullptr));
+	Console::setRusLocale();
+
+	if (argc >= 3 && (std::string(argv[1]) == "--simulate" || std::string(argv[1]) == "--simulate-batch"))
+	{
+		unsigned long long games;
+		unsigned int threads = std::thread::hardware_concurrency();
+		if (!Arguments::getNumber(argv[2], games) || (argc >= 4 && !Arguments::getNumber(argv[3], threads)))
+			return Arguments::showUsage();
+		Simulator::run(games, threads > 0 ? threads : 1, std::string(argv[1]) == "--simulate-batch");
+		return 0;
+	}
+	if (argc >= 4 && std::string(argv[1]) == "--build-policy")
+	{
+		unsigned int states;
+		double milliseconds = 5;
+		if (!Arguments::getNumber(argv[3], states) || (argc >= 5 && !Arguments::getNumber(argv[4], milliseconds)))
+			return Arguments::showUsage();
+		unsigned int threads = std::thread::hardware_concurrency();
+		PolicyTable::build(argv[2], states, milliseconds / 1000, threads > 0 ? threads : 1);
+		return 0;
+	}
+#ifndef _WIN32
+	if (argc >= 5 && std::string(argv[1]) == "--server")
+	{
+		LatencyStats::setEnabled(true);
+		std::signal(SIGUSR1, LatencyStats::requestDump);
+		PolicyTable::load("botbder.policy");
+		unsigned int messagesPer30s = 20;
+		// Воркеров хотя бы два, чтобы долгий ход Botbder'а не задерживал остальных зрителей и на одном ядре.
+		unsigned int workers = std::max(2u, std::thread::hardware_concurrency());
+		if ((argc >= 8 && !Arguments::getNumber(argv[7], messagesPer30s)) || (argc >= 9 && !Arguments::getNumber(argv[8], workers)))
+			return Arguments::showUsage();
+		ReplayLog replayLog;
+		replayLog.open("battles.replay");
+		SessionStore sessionStore;
+		if (!sessionStore.open("sessions.dat"))
+			std::cerr << "Не удалось открыть файл сессий sessions.dat, битвы не переживут перезапуск" << std::endl;
+		ChatServer server(argv[4], argc >= 6 ? argv[5] : "justinfan12345", argc >= 7 ? argv[6] : "", messagesPer30s > 0 ? messagesPer30s : 1,
+			workers > 0 ? workers : 1, &replayLog, &sessionStore);
+		if (!server.connect(argv[2], argv[3]))
+		{
+			std::cerr << "Не удалось подключиться к " << argv[2] << ":" << argv[3] << std::endl;
+			return 1;
+		}
+		server.run();
+		return 0;
+	}
+#endif
+	if (argc >= 2 && std::string(argv[1]) == "--benchmark")
+	{
+		std::string jsonPath, baselinePath;
+		double threshold = Benchmark::defaultThreshold;
+		for (int i = 2; i + 1 < argc; i += 2)
+		{
+			if (std::string(argv[i]) == "--json")
+				jsonPath = argv[i + 1];
+			else if (std::string(argv[i]) == "--baseline")
+				baselinePath = argv[i + 1];
+			else if (std::string(argv[i]) == "--threshold")
+			{
+				if (!Arguments::getNumber(argv[i + 1], threshold))
+					return Arguments::showUsage();
+				threshold /= 100;
+			}
+		}
+		return Benchmark::run(jsonPath, baselinePath, threshold) ? 0 : 1;
+	}
+	if (argc >= 3 && std::string(argv[1]) == "--analyze")
+	{
+		unsigned int threads = std::thread::hardware_concurrency();
+		if (argc >= 4 && !Arguments::getNumber(argv[3], threads))
+			return Arguments::showUsage();
+		return ReplayAnalyzer::run(argv[2], threads > 0 ? threads : 1) ? 0 : 1;
+	}
+	if (argc >= 3 && std::string(argv[1]) == "--replay")
+	{
+		unsigned long long ind;
+		if (argc >= 4)
+			return Arguments::getNumber(argv[3], ind) ? (ReplayLog::show(argv[2], ind) ? 0 : 1) : Arguments::showUsage();
+		return ReplayLog::verify(argv[2]) ? 0 : 1;
+	}
+	PolicyTable::load(argc >= 3 && std::string(argv[1]) == "--policy" ? argv[2] : "botbder.policy");
+
+	LatencyStats::setEnabled(true);
+	ReplayLog replayLog;
+	replayLog.open("battles.replay");
+	GreatBattle gb;
+	gb.setReplayLog(&replayLog);
+	gb.run();
+}
+#endif
+
+// ------------< Arguments >------------
+
+template <typename T>
+bool Arguments::getNumber(const char* arg, T& number)
+{
+	const char* end = arg + std::strlen(arg);
+	auto [pos, error] = std::from_chars(arg, end, number);
+	return arg != end && error == std::errc() && pos == end;
+}
+
+// Выводит режимы запуска. Возвращает код выхода для неверных аргументов.
+int Arguments::showUsage()
+{
+	std::cerr << "Режимы запуска:" << "\n"
+		<< "  GreatBattle [--policy файл]" << "\n"
+		<< "  GreatBattle --simulate|--simulate-batch битв [потоков]" << "\n"
+		<< "  GreatBattle --build-policy файл состояний [мс на состояние]" << "\n"
+#ifndef _WIN32
+		<< "  GreatBattle --server хост порт канал [ник] [пароль] [сообщений за 30 с] [воркеров]" << "\n"
+#endif
+		<< "  GreatBattle --benchmark [--json файл] [--baseline файл] [--threshold проценты]" << "\n"
+		<< "  GreatBattle --analyze журнал [потоков]" << "\n"
+		<< "  GreatBattle --replay журнал [номер битвы]" << std::endl;
+	return 1;
+}
+
+// ------------< BattleTask >------------
+
+BattleTask BattleTask::promise_type::get_return_object()
+{
+	return BattleTask(std::coroutine_handle<promise_type>::from_promise(*this));
+}
+
+std::suspend_never BattleTask::promise_type::initial_suspend() noexcept
+{
+	return {};
+}
+
+// После завершения кадр не удаляется сам: его удаляет BattleTask, а до того по нему видно, что ход окончен.
+BattleTask::FinalAwaiter BattleTask::promise_type::final_suspend() noexcept
+{
+	return {};
+}
+
+void BattleTask::promise_type::return_value(bool isStaying)
+{
+	this->isStaying = isStaying;
+}
+
+// Ход с исключением заканчивается как обычно (ждущий его ход продолжается), а исключение ждёт в promise.
+void BattleTask::promise_type::unhandled_exception()
+{
+	exception = std::current_exception();
+}
+
+bool BattleTask::FinalAwaiter::await_ready() const noexcept
+{
+	return false;
+}
+
+std::coroutine_handle<> BattleTask::FinalAwaiter::await_suspend(std::coroutine_handle<promise_type> handle) const noexcept
+{
+	std::coroutine_handle<> continuation = handle.promise().continuation;
+	return continuation ? continuation : std::noop_coroutine();
+}
+
+void BattleTask::FinalAwaiter::await_resume() const noexcept
+{
+}
+
+bool BattleTask::Awaiter::await_ready() const noexcept
+{
+	return handle.done();
+}
+
+void BattleTask::Awaiter::await_suspend(std::coroutine_handle<> continuation) const noexcept
+{
+	handle.promise().continuation = continuation;
+}
+
+bool BattleTask::Awaiter::await_resume() const
+{
+	if (handle.promise().exception)
+		std::rethrow_exception(handle.promise().exception);
+	return handle.promise().isStaying;
+}
+
+BattleTask::BattleTask() : _handle()
+{
+}
+
+BattleTask::BattleTask(std::coroutine_handle<promise_type> handle) : _handle(handle)
+{
+	_handle.promise().isStaying = true;
+}
+
+BattleTask::BattleTask(BattleTask&& other) noexcept : _handle(std::exchange(other._handle, {}))
+{
+}
+
+BattleTask& BattleTask::operator=(BattleTask&& other) noexcept
+{
+	if (this != &other)
+	{
+		if (_handle)
+			_handle.destroy();
+		_handle = std::exchange(other._handle, {});
+	}
+	return *this;
+}
+
+BattleTask::~BattleTask()
+{
+	if (_handle)
+		_handle.destroy();
+}
+
+BattleTask::Awaiter BattleTask::operator co_await() const noexcept
+{
+	return { _handle };
+}
+
+bool BattleTask::isDone() const
+{
+	return !_handle || _handle.done();
+}
+
+std::exception_ptr BattleTask::getException() const
+{
+	return _handle ? _handle.promise().exception : nullptr;
+}
+
+// ------------< GreatBattle >------------
+
+// Битва в консоли: приветствие и ник спрашивает сам ход битвы.
+GreatBattle::GreatBattle(): _out(Console::getStream()), _arena(), _nickname(_arena.getSessionResource()), _difficulty(Difficulty::Normal), _renderer(_events),
+	_you(false, _events, _deck), _botbder(true, _events, _deck), _random(), _replayLog(nullptr), _replayHeader(), _replayMoves(&_arena), _replayPos(nullptr),
+	_isRetaked(false), _isRestored(false), _feed(nullptr), _feedReader(_events), _feedText(_arena.getSessionResource()), _matchmaker(nullptr), _wake(), _wins(0), _seat(), _spareSeat(),
+	_input(), _waiting(), _task()
+{
+	reset();
+	_task = play();
+}
+
+GreatBattle::GreatBattle(std::string_view nickname, std::ostream& out) : _out(out), _arena(), _nickname(nickname, _arena.getSessionResource()),
+	_difficulty(Difficulty::Normal), _renderer(_events), _you(false, _events, _deck), _botbder(true, _events, _deck), _random(), _replayLog(nullptr),
+	_replayHeader(), _replayMoves(&_arena), _replayPos(nullptr), _isRetaked(false), _isRestored(false), _feed(nullptr), _feedReader(_events),
+	_feedText(_arena.getSessionResource()), _matchmaker(nullptr), _wake(), _wins(0), _seat(), _spareSeat(),
+	_input(), _waiting(), _task()
+{
+	reset();
+	_task = play();
+}
+
+// Недоигранная битва тоже попадает в журнал. Место в подборе или битве с соперником освобождается.
+GreatBattle::~GreatBattle()
+{
+	leaveDuel();
+	writeReplay();
+}
+
+void GreatBattle::run()
+{
+	std::string input;
+
+	do
+	{
+		setColor(ConsoleColor::White);
+		_out << "> " << std::flush;
+		std::getline(std::cin, input);
+	} while (handleInput(input) && std::cin);
+}
+
+// Выполнение одной строки ввода: ждущий ввода ход продолжается с этой строкой до следующего ожидания ввода.
+// Возвращает false, если игрок вышел из игры. Следующая строка после выхода начинает новую битву
+// (кроме wakeLine, запоздавшей к вышедшему).
+bool GreatBattle::handleInput(std::string_view input)
+{
+	LatencyTimer inputTimer(LatencyPoint::Input);
+	if (_task.isDone())
+	{
+		if (input == wakeLine)
+			return false;
+		reset();
+		_task = play();
+	}
+	_input = input;
+	if (_waiting)
+		std::exchange(_waiting, {}).resume();
+	if (std::exception_ptr exception = _task.getException())
+	{
+		closeOnError(exception);
+		return false;
+	}
+	return !_task.isDone();
+}
+
+// Ход битвы закончился исключением: закрывается только эта битва (в чате - сессия зрителя), а не вся игра.
+void GreatBattle::closeOnError(std::exception_ptr exception)
+{
+	_task = {};
+	leaveDuel();
+	try
+	{
+		std::rethrow_exception(exception);
+	}
+	catch (const std::exception& error)
+	{
+		std::cerr << "Битва " << _nickname << " прервана: " << error.what() << std::endl;
+	}
+	catch (...)
+	{
+		std::cerr << "Битва " << _nickname << " прервана неизвестным исключением" << std::endl;
+	}
+	setColor(ConsoleColor::LightRed);
+	_out << "Битва прервана из-за внутренней ошибки." << "\n";
+}
+
+GreatBattle::InputAwaiter GreatBattle::nextInput()
+{
+	return { *this };
+}
+
+bool GreatBattle::InputAwaiter::await_ready() const noexcept
+{
+	return false;
+}
+
+void GreatBattle::InputAwaiter::await_suspend(std::coroutine_handle<> handle) const noexcept
+{
+	battle._waiting = handle;
+}
+
+std::string_view GreatBattle::InputAwaiter::await_resume() const noexcept
+{
+	return battle._input;
+}
+
+// Ход битвы. В консоли сначала приветствие и ник игрока. Дальше битвы идут одна за другой: каждая ждёт команд
+// игрока, пересдать карты можно только до первого хода, а после смерти одной из сторон начинается новая битва.
+// Ходы Botbder'а (вместе с дополнительными) делает moveStep сразу после хода игрока: ввода они не ждут.
+// Когда находится соперник, битва с Botbder'ом откладывается до конца битвы с ним (playDuel).
+BattleTask GreatBattle::play()
+{
+	if (_nickname.empty())
+	{
+		showGreeting();
+		setColor(ConsoleColor::White);
+		_out << "Введите свой никнейм: " << "\n";
+		_nickname = co_await nextInput();
+		setColor(ConsoleColor::LightMagenta);
+		_out << "Великая битва началась!" << "\n";
+		setColor(ConsoleColor::LightGreen);
+		_out << "Введите !помощь для вывода списка команд. " << "\n";
+	}
+
+	while (true)
+	{
+		bool isAlive = true;
+		while (isAlive)
+		{
+			std::string_view input = co_await nextInput();
+			if (input == wakeLine)
+			{
+				DuelSeat::State state = _seat != nullptr ? _seat->getState() : DuelSeat::State::Cancelled;
+				if (state == DuelSeat::State::Matched)
+				{
+					if (!co_await playDuel())
+						co_return false;
+				}
+				else if (state == DuelSeat::State::Expired)
+				{
+					_spareSeat = std::move(_seat);
+					setColor(ConsoleColor::Red);
+					_out << "Соперник не нашёлся. Битва с Botbder'ом продолжается." << "\n";
+				}
+				continue;
+			}
+			if (!Command::isCommand(input))
+			{
+				setColor(ConsoleColor::Red);
+				_out << "Команда не найдена!" << "\n";
+				continue;
+			}
+			LatencyTimer commandTimer(LatencyPoint::Command);
+			Command command(input);
+			commandTimer.stop();
+			unsigned int ind;
+			if (command.getKeyword() == Keyword::Help)
+				showCommands();
+			else if (command.getKeyword() == Keyword::Exit)
+			{
+				leaveDuel();
+				co_return false;
+			}
+			else if (command.getKeyword() == Keyword::Battle)
+			{
+				switch (command.getArgKeyword(0))
+				{
+				case Keyword::Cards:
+					showAllCards();
+					break;
+				case Keyword::Info:
+					showInfo();
+					break;
+				case Keyword::Challenge:
+					if (challenge() && !co_await playDuel())
+						co_return false;
+					break;
+				case Keyword::Adversary:
+					showAdversary();
+					break;
+				case Keyword::Hint:
+					showHint();
+					break;
+				case Keyword::Stats:
+					showCardStats();
+					break;
+				case Keyword::Latency:
+					showLatency();
+					break;
+				case Keyword::Watch:
+					// В чате команду забирает сервер, до битвы она доходит только в консоли.
+					setColor(ConsoleColor::Red);
+					_out << "Смотреть битвы можно только в чате." << "\n";
+					break;
+				case Keyword::Difficulty:
+					if (command.getArgKeyword(1) == Keyword::Easy)
+						setDifficulty(Difficulty::Easy);
+					else if (command.getArgKeyword(1) == Keyword::Normal)
+						setDifficulty(Difficulty::Normal);
+					else if (command.getArgKeyword(1) == Keyword::Hard)
+						setDifficulty(Difficulty::Hard);
+					else if (command.getArgCount() > 1)
+					{
+						setColor(ConsoleColor::Red);
+						_out << "Нет такой сложности!" << "\n";
+						break;
+					}
+					showDifficulty();
+					break;
+				case Keyword::Retake:
+					if (_isRetaked)
+					{
+						setColor(ConsoleColor::Red);
+						_out << "Вы более не можете пересдать карты!" << "\n";
+					}
+					else
+					{
+						setColor(ConsoleColor::LightGreen);
+						_out << "Карты пересданы." << "\n";
+						RandomScope scope(_random);
+						_you.retakeCards();
+						_isRetaked = true;
+						_replayMoves.push_back({ ReplayMove::retake, 0, 0 });
+					}
+					break;
+				default:
+					if (command.getArgCount() == 0)
+						showRules();
+					else if (command.getUnsignedNumber(0, ind))
+					{
+						if (ind > _you.getCardCount() || ind == 0)
+						{
+							setColor(ConsoleColor::Red);
+							_out << "У вас нет такой карты!" << "\n";
+							break;
+						}
+
+						isAlive = moveStep(ind);
+						renderEvents();
+						publishTurn();
+						_isRetaked = true;
+					}
+				}
+			}
+			else
+			{
+				setColor(ConsoleColor::Red);
+				_out << "Команда не найдена!" << "\n";
+			}
+		}
+		reset();
+	}
+}
+
+// Битва с другим зрителем. Ход соперника будит битву строкой wakeLine, и его события выводятся сразу.
+// Выход из игры засчитывается как поражение. Результат - остался ли игрок в игре.
+BattleTask GreatBattle::playDuel()
+{
+	std::shared_ptr<Duel> duel = _seat->getDuel();
+	unsigned int side = _seat->getSide();
+	std::string_view names[2];
+	names[side] = _nickname;
+	names[1 - side] = duel->getSeat(1 - side).getNickname();
+	unsigned int turn;
+	{
+		std::lock_guard<std::mutex> lock(duel->getMutex());
+		setColor(ConsoleColor::LightMagenta);
+		_out << "Соперник найден! Битва с игроком " << names[1 - side] << " началась." << "\n";
+		renderEvents(duel->getReader(side), side, names);
+		showDuelInfo(*duel, side);
+		turn = duel->getTurn();
+	}
+
+	bool isStaying = true, isOver = false;
+	while (isStaying && !isOver)
+	{
+		std::string_view input = co_await nextInput();
+		std::lock_guard<std::mutex> lock(duel->getMutex());
+		if (input == wakeLine)
+			;
+		else if (!Command::isCommand(input))
+		{
+			setColor(ConsoleColor::Red);
+			_out << "Команда не найдена!" << "\n";
+		}
+		else
+		{
+			Command command(input);
+			unsigned int ind;
+			if (command.getKeyword() == Keyword::Help)
+				showCommands();
+			else if (command.getKeyword() == Keyword::Exit)
+			{
+				duel->leave(side);
+				isStaying = false;
+			}
+			else if (command.getKeyword() != Keyword::Battle)
+			{
+				setColor(ConsoleColor::Red);
+				_out << "Команда не найдена!" << "\n";
+			}
+			else if (command.getArgKeyword(0) == Keyword::Info || command.getArgKeyword(0) == Keyword::Adversary)
+				showDuelInfo(*duel, side);
+			else if (command.getArgKeyword(0) == Keyword::Cards)
+				showAllCards();
+			else if (command.getArgKeyword(0) != Keyword::None || !command.getUnsignedNumber(0, ind))
+			{
+				setColor(ConsoleColor::Red);
+				_out << "В битве с игроком эта команда недоступна!" << "\n";
+			}
+			else if (duel->getTurn() != side)
+			{
+				setColor(ConsoleColor::Red);
+				_out << "Сейчас ходит " << names[1 - side] << "!" << "\n";
+			}
+			else if (ind > duel->getPlayer(side).getCardCount() || ind == 0)
+			{
+				setColor(ConsoleColor::Red);
+				_out << "У вас нет такой карты!" << "\n";
+			}
+			else
+			{
+				duel->move(side, ind);
+				duel->getSeat(1 - side).wake();
+			}
+		}
+
+		if (duel->hasLeft(1 - side))
+		{
+			setColor(ConsoleColor::LightMagenta);
+			_out << "Игрок " << names[1 - side] << " покинул битву." << "\n";
+		}
+		renderEvents(duel->getReader(side), side, names);
+		isOver = duel->isOver();
+		if (isOver && !duel->hasLeft(side) && !duel->getPlayer(side).isDead()
+			&& (duel->getPlayer(1 - side).isDead() || duel->hasLeft(1 - side)))
+			_wins++;
+		else if (!isOver && duel->getTurn() == side && turn != side)
+		{
+			setColor(ConsoleColor::LightGreen);
+			_out << "Ваш ход!" << "\n";
+		}
+		turn = duel->getTurn();
+	}
+	leaveDuel();
+	if (isStaying)
+	{
+		setColor(ConsoleColor::LightGreen);
+		_out << "Битва с Botbder'ом продолжается." << "\n";
+	}
+	co_return isStaying;
+}
+
+// Вызов на битву другого зрителя. Возвращает true, если соперник нашёлся сразу.
+bool GreatBattle::challenge()
+{
+	if (_matchmaker == nullptr)
+	{
+		setColor(ConsoleColor::Red);
+		_out << "Битвы с другими игроками есть только в чате!" << "\n";
+		return false;
+	}
+	if (_seat != nullptr)
+	{
+		setColor(ConsoleColor::Red);
+		_out << "Вы уже ищете соперника!" << "\n";
+		return false;
+	}
+	unsigned int bucket = Matchmaker::getBucket(_wins);
+	if (_spareSeat != nullptr && _spareSeat.use_count() == 1)
+	{
+		// Остальные владельцы отпустили место с release: всё, что они с ним делали, видно после acquire.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		_seat = std::move(_spareSeat);
+		_seat->rearm(bucket, _wake);
+	}
+	else
+		_seat = std::make_shared<DuelSeat>(_nickname, bucket, _wake);
+	if (!_matchmaker->challenge(_seat))
+	{
+		_spareSeat = std::move(_seat);
+		setColor(ConsoleColor::Red);
+		_out << "Соперника ищут слишком многие, попробуйте позже!" << "\n";
+		return false;
+	}
+	if (_seat->getState() == DuelSeat::State::Matched)
+		return true;
+	setColor(ConsoleColor::LightGreen);
+	_out << "Ищем соперника... А пока можно биться с Botbder'ом." << "\n";
+	return false;
+}
+
+// Уход из подбора или из битвы с соперником (из неначатой битвы - поражение). После этого битву никто не будит.
+// Место, которое как раз сейчас забирают, недолго ждём: через мгновение оно окажется в битве или снова в очереди.
+void GreatBattle::leaveDuel()
+{
+	if (_seat == nullptr)
+		return;
+	while (!_seat->tryCancel())
+	{
+		DuelSeat::State state = _seat->getState();
+		if (state == DuelSeat::State::Matched)
+		{
+			Duel& duel = *_seat->getDuel();
+			std::lock_guard<std::mutex> lock(duel.getMutex());
+			duel.leave(_seat->getSide());
+			break;
+		}
+		if (state != DuelSeat::State::Claimed)
+			break;
+		std::this_thread::yield();
+	}
+	_seat->detach();
+	_spareSeat = std::move(_seat);
+}
+
+// Жизни и карты зрителя, жизни соперника и чей ход. Вызывается под мьютексом битвы.
+void GreatBattle::showDuelInfo(const Duel& duel, unsigned int side) const
+{
+	const Player& you = duel.getPlayer(side);
+	setColor(ConsoleColor::LightGreen);
+	_out << "Ваше здоровье: " << you.getHealth() << " ед." << "\n";
+	_out << "Ваши карты: " << "\n";
+	for (unsigned int i = 0; i < you.getCardCount(); i++)
+		showCard(i + 1, you.getCardID(i));
+	setColor(ConsoleColor::LightGreen);
+	_out << "Здоровье игрока " << duel.getSeat(1 - side).getNickname() << ": " << duel.getPlayer(1 - side).getHealth() << " ед." << "\n";
+	_out << (duel.getTurn() == side ? "Ваш ход." : "Ход соперника.") << "\n";
+}
+
+void GreatBattle::reset()
+{
+	reset(Random::nextSeed());
+}
+
+// Новая битва с генератором от заданного зерна. Прошлая битва записывается в журнал.
+void GreatBattle::reset(unsigned long long seed)
+{
+	writeReplay();
+	_random = Random::makeState(seed);
+	RandomScope scope(_random);
+
+	_you.setHealth(5);
+	_botbder.setHealth(5);
+	_you.setExtraMovesCount(0);
+	_botbder.setExtraMovesCount(0);
+	_you.clearEffects();
+	_botbder.clearEffects();
+
+	_you.removeAllCards();
+	_botbder.removeAllCards();
+
+	_deck.restoreEpicCards();
+
+	for (int i = 0; i < 3; i++)
+	{
+		_you.drawCard();
+		_botbder.drawCard();
+	}
+	_renderer.skipAll();
+	_feedReader.skipAll();
+	_isRetaked = false;
+	_isRestored = false;
+
+	_replayHeader = {};
+	_replayHeader.seed = seed;
+	_replayHeader.outcome = ReplayHeader::unfinished;
+	for (unsigned int i = 0; i < 3; i++)
+		_replayHeader.initialHand[i] = _you.getCardID(i);
+	// Ходы прошлой битвы уже записаны: их память отдаётся вместе со всей памятью битвы.
+	std::pmr::vector<ReplayMove>(&_arena).swap(_replayMoves);
+	_arena.rewind();
+	_replayMoves.reserve(initialMoves);
+}
+
+void GreatBattle::setReplayLog(ReplayLog* replayLog)
+{
+	_replayLog = replayLog;
+}
+
+void GreatBattle::setFeed(SpectatorFeed* feed)
+{
+	_feed = feed;
+}
+
+// Битвы с другими зрителями: подбор соперника и как разбудить эту битву, когда соперник найден или сходил.
+void GreatBattle::setMatchmaker(Matchmaker* matchmaker, std::function<void()> wake)
+{
+	_matchmaker = matchmaker;
+	_wake = std::move(wake);
+}
+
+// Стоит ли зритель в подборе соперника или в битве с ним: тогда битву может разбудить чужой воркер.
+bool GreatBattle::isInDuel() const
+{
+	return _seat != nullptr;
+}
+
+// Повтор записанной битвы: та же битва от того же зерна с ходами из записи. Возвращает, совпала ли битва с записью.
+bool GreatBattle::replay(const ReplayHeader& header)
+{
+	const ReplayMove* moves = (const ReplayMove*)((const char*)(&header + 1) + header.nicknameLength);
+	reset(header.seed);
+	_difficulty = (Difficulty)header.difficulty;
+	for (_replayPos = moves; _replayPos < moves + header.moveCount; )
+	{
+		const ReplayMove& move = *_replayPos++;
+		if (move.action == ReplayMove::retake)
+		{
+			RandomScope scope(_random);
+			_you.retakeCards();
+			_replayMoves.push_back(move);
+		}
+		else if ((move.action & ReplayMove::botbderFlag) || move.action >= _you.getCardCount())
+			break;
+		else
+		{
+			moveStep(move.action + 1);
+			renderEvents();
+		}
+	}
+	_replayPos = nullptr;
+	bool isSame = _replayMoves.size() == header.moveCount && std::memcmp(_replayMoves.data(), moves, header.moveCount * sizeof(ReplayMove)) == 0
+		&& _replayHeader.outcome == header.outcome;
+	_replayMoves.clear();
+	return isSame;
+}
+
+// Снимок битвы для сохранения сессии. Возвращает false, если ник не влезает в запись - такая сессия не сохраняется.
+bool GreatBattle::save(SessionRecord& record) const
+{
+	if (_nickname.size() > SessionRecord::maxNicknameLength)
+		return false;
+	record.marker = SessionRecord::markerValue;
+	record.difficulty = (unsigned char)_difficulty;
+	record.isRetaked = _isRetaked;
+	for (unsigned int side = 0; side < 2; side++)
+		record.epicMask[side] = _deck.getEpicMask(side);
+	_you.save(record.players[0]);
+	_botbder.save(record.players[1]);
+	record.wins = std::min(_wins, 0xFFFFu);
+	record.nicknameLength = _nickname.size();
+	std::memcpy(record.nickname, _nickname.data(), _nickname.size());
+	return true;
+}
+
+// Продолжение битвы из сохранения сессии вместо только что начатой. Генератор битвы - от нового зерна.
+void GreatBattle::restore(const SessionRecord& record)
+{
+	_replayMoves.clear();
+	_random = Random::makeState(Random::nextSeed());
+	_difficulty = record.difficulty <= (unsigned char)Difficulty::Hard ? (Difficulty)record.difficulty : Difficulty::Normal;
+	_isRetaked = record.isRetaked;
+	_isRestored = true;
+	for (unsigned int side = 0; side < 2; side++)
+		_deck.setEpicMask(side, record.epicMask[side]);
+	_you.load(record.players[0]);
+	_botbder.load(record.players[1]);
+	_wins = record.wins;
+	_renderer.skipAll();
+	_feedReader.skipAll();
+	setColor(ConsoleColor::LightMagenta);
+	_out << "Ваша битва продолжается с того места, где вы остановились." << "\n";
+}
+
+void GreatBattle::showGreeting() const
+{
+	setColor(ConsoleColor::LightMagenta);
+	_out << "Добро пожаловать на Великую битву!" << "\n";
+	_out << "Великая битва - это коллекционная карточная игра в консольном режиме по Всемирью, нашей фэнтези-вселенной." << "\n";
+	_out << "Версия игры: ";
+	setColor(ConsoleColor::LightRed);
+	_out << version << "\n";
+	_out << "Автор идеи: Mrakovey" << "\n";
+	_out << "Реализатор: DmitryWS" << "\n";
+	setColor(ConsoleColor::LightMagenta);
+	_out << "Удачи, боец, и да хранит тебя Аркана!" << "\n";
+}
+
+void GreatBattle::showCommands() const
+{
+	static const Screen screen = Screen()
+		.setColor(ConsoleColor::LightGreen)
+		.add("Общие команды:\n")
+		.add("!помощь - общий список команд;\n")
+		.add("!выход - выход из игры.\n")
+		.add("!битва - правила Великой битвы.\n");
+	screen.show(_out, isConsole());
+}
+
+
+void GreatBattle::showRules() const
+{
+	static const Screen screen = Screen()
+		.setColor(ConsoleColor::LightGreen)
+		.add("В начале битвы вам и вашему противнику Botbder'у выдаются три карты.\n")
+		.add("У вас изначально 5 жизней, как и у Botbder. Ходы делаются поочерёдно, начиная с вас.\n")
+		.add("За ход можно использовать не более одной карты. Каждый ход вы вытягиваете ещё одну карту.\n")
+		.add("Проигрывает тот, у кого заканчиваются жизни.\n")
+		.add("!битва карты - информация о картах Великой битвы;\n")
+		.add("!битва инфо - информация о ваших жизнях и картах;\n")
+		.add("!битва противник - информация о жизнях Botbder;\n")
+		.add("!битва сложность [лёгкая/обычная/сложная] - сложность Botbder'а;\n")
+		.add("!битва подсказка - шансы на победу для каждой из ваших карт;\n")
+		.add("!битва стат - статистика карт по всем битвам и память этой битвы;\n")
+		.add("!битва задержки - время обработки команд (p50/p99/p999);\n")
+		.add("!битва вызов - битва с другим зрителем чата (пока соперник ищется, битва с Botbder'ом продолжается);\n")
+		.add("!битва смотреть [ник] - смотреть битву другого зрителя (без ника - перестать смотреть);\n")
+		.add("!битва [номер карты] - сыграть нужную карту;\n")
+		.add("!битва пересдать - пересдать себе карты на первом ходу (один раз за битву).\n");
+	screen.show(_out, isConsole());
+}
+
+void GreatBattle::showAllCards() const
+{
+	static const Screen screen = []
+	{
+		Screen screen;
+		screen.setColor(ConsoleColor::LightGreen).add("Цветовые обозначения:\n")
+			.setColor(ConsoleColor::LightMagenta).add("###")
+			.setColor(ConsoleColor::LightGreen).add(" - данные карты существуют в единственном экземпляре и могут применяться один раз за битву.\n")
+			.setColor(ConsoleColor::Yellow).add("###")
+			.setColor(ConsoleColor::LightGreen).add(" - данные карты могут повторяться при выдаче.\n")
+			.setColor(ConsoleColor::LightCyan).add("###")
+			.setColor(ConsoleColor::LightGreen).add(" - данные карты доступны только игроку.\n")
+			.setColor(ConsoleColor::Cyan).add("###")
+			.setColor(ConsoleColor::LightGreen).add(" - данные карты доступны только Botbder'у.\n");
+		for (unsigned int i = 1; i <= CardManager::getAllCardsCount(); i++)
+		{
+			const Card& card = CardManager::getCardByID(i);
+			screen.setColor(getCardColor(card.getType()))
+				.add(std::to_string(i)).add(") ").add(card.getName()).add(" - ").add(card.getDescription()).add("\n");
+		}
+		return screen;
+	}();
+	screen.show(_out, isConsole());
+}
+
+void GreatBattle::showInfo() const
+{
+	setColor(ConsoleColor::LightGreen);
+	_out << "Ваше здоровье: " << _you.getHealth() << " ед." << "\n";
+	_out << "Ваши карты: " << "\n";
+	for (int i = 0; i < _you.getCardCount(); i++)
+		showCard(i + 1, _you.getCardID(i));
+}
+
+void GreatBattle::showAdversary() const
+{
+	setColor(ConsoleColor::LightGreen);
+	_out << "Здоровье Botbder'а: " << _botbder.getHealth() << " ед." << "\n";
+}
+
+void GreatBattle::showHint() const
+{
+	float chances[64];
+	unsigned int depth = BattleSolver::analyze(getState(BotbderAI::getScratchEvents()), 0.003, chances);
+	if (depth == 0)
+	{
+		setColor(ConsoleColor::Red);
+		_out << "Шансы не успели посчитаться, попробуйте ещё раз." << "\n";
+		return;
+	}
+	setColor(ConsoleColor::LightGreen);
+	_out << "Шансы на победу (расчёт на " << depth << " ход(а) вперёд):" << "\n";
+	for (unsigned int i = 0; i < _you.getCardCount(); i++)
+	{
+		unsigned int id = _you.getCardID(i);
+		_out << i + 1 << ") " << CardManager::getCardByID(id).getName() << " - " << std::lround(100 * chances[id]) << "%" << "\n";
+	}
+}
+
+// Статистика карт по всем битвам всех игроков. Показываются только карты, которые уже встречались.
+void GreatBattle::showCardStats() const
+{
+	CardStatsTotals totals;
+	CardStats::collect(totals);
+	setColor(ConsoleColor::LightGreen);
+	_out << "Битв: " << totals.outcomes[0] + totals.outcomes[1] + totals.outcomes[2]
+		<< " (побед игроков: " << totals.outcomes[(unsigned int)BattleOutcome::YouWon]
+		<< ", побед Botbder'а: " << totals.outcomes[(unsigned int)BattleOutcome::YouLost]
+		<< ", взаимных поражений: " << totals.outcomes[(unsigned int)BattleOutcome::BothLost] << ")"
+		<< ", битв зрителей между собой: " << totals.duels << "\n";
+	_out << "Память этой битвы: " << _arena.getUsed() << " байт, на всю сессию: " << _arena.getSessionUsed() << " байт из буфера в "
+		<< BattleArena::bufferSize << " байт (наибольший расход битвы с запуска: " << BattleArena::getMaxUsed()
+		<< " байт, не уместились в буфер: " << BattleArena::getOverflowCount() << ")" << "\n";
+	for (unsigned int id = 1; id <= CardManager::getAllCardsCount(); id++)
+	{
+		const CardTotals& card = totals.cards[id];
+		unsigned long long hands = card.winningHands + card.losingHands;
+		if (card.plays == 0 && hands == 0)
+			continue;
+		setColor(getCardColor(CardManager::getCardByID(id).getType()));
+		_out << id << ") " << CardManager::getCardByID(id).getName() << ": сыграна " << card.plays << " раз";
+		setColor(ConsoleColor::LightGreen);
+		_out << ", урон " << card.damage << ", урон себе " << card.selfDamage << ", лечение " << card.heal
+			<< ", доп. ходы " << card.extraMoves;
+		if (card.delayed > 0)
+			_out << ", отложенных эффектов " << card.delayed;
+		if (hands > 0)
+			_out << ", в руке победителя " << std::lround(100.0 * card.winningHands / hands) << "%";
+		_out << "\n";
+	}
+}
+
+// Гистограммы задержек с запуска игры по всем битвам.
+void GreatBattle::showLatency() const
+{
+	LatencyTotals totals;
+	LatencyStats::collect(totals);
+	setColor(ConsoleColor::LightGreen);
+	_out << "Время обработки с запуска игры:" << "\n";
+	LatencyStats::show(totals, _out);
+}
+
+
+void GreatBattle::showCard(unsigned int i, unsigned int id) const
+{
+	const Card& card = CardManager::getCardByID(id);
+	setColor(getCardColor(card.getType()));
+	_out << i << ") " << card.getName() << " - " << card.getDescription() << "\n";
+}
+
+ConsoleColor GreatBattle::getCardColor(CardType type)
+{
+	switch (type)
+	{
+	case CardType::Epic:
+		return ConsoleColor::LightMagenta;
+	case CardType::Common:
+		return ConsoleColor::Yellow;
+	case CardType::Player:
+		return ConsoleColor::LightCyan;
+	case CardType::Botbder:
+		return ConsoleColor::Cyan;
+	}
+	return ConsoleColor::White;
+}
+
+
+bool GreatBattle::moveStep(unsigned int i)
+{
+	RandomScope scope(_random);
+	playerMove(i);
+	if (checkDead())
+		return false;
+	_you.drawCard();
+	if (_you.getExtraMovesCount() > 0)
+		return true;
+
+	LatencyTimer timer(LatencyPoint::BotbderTurn);
+	do
+	{
+		botbderMove(chooseBotbderCard());
+		if (checkDead())
+		{
+			return false;
+		}
+		_botbder.drawCard();
+	} while (_botbder.getExtraMovesCount() > 0);
+
+	return true;
+}
+
+void GreatBattle::playerMove(unsigned int ind)
+{
+	LatencyTimer timer(LatencyPoint::PlayerMove);
+	unsigned int id = _you.getCardID(ind - 1), health = _botbder.getHealth();
+	CardStats::setEnabled(true);
+	_you.move(_botbder, ind - 1);
+	CardStats::setEnabled(false);
+	recordMove(false, ind - 1, id, health);
+}
+
+void GreatBattle::botbderMove(unsigned int ind)
+{
+	LatencyTimer timer(LatencyPoint::BotbderMove);
+	unsigned int id = _botbder.getCardID(ind - 1), health = _you.getHealth();
+	CardStats::setEnabled(true);
+	_botbder.move(_you, ind - 1);
+	CardStats::setEnabled(false);
+	recordMove(true, ind - 1, id, health);
+}
+
+// Лёгкий Botbder ходит случайно. Остальные берут ход из политики (обычный иногда ошибается нарочно),
+// а для состояний, которых нет в политике, ищут ход сами. Выбор идёт на генераторе потока, а не битвы:
+// поиск тратит случайные числа по-разному в зависимости от времени, а ходы Botbder'а всё равно записываются.
+// При повторе битвы ход берётся из записи.
+unsigned int GreatBattle::chooseBotbderCard()
+{
+	if (_replayPos != nullptr)
+	{
+		unsigned int ind = _replayPos->action & ~ReplayMove::botbderFlag;
+		if (!(_replayPos->action & ReplayMove::botbderFlag) || ind >= _botbder.getCardCount())
+			return 1;
+		_replayPos++;
+		return ind + 1;
+	}
+	RandomScope scope(_random);
+	if (_difficulty == Difficulty::Easy || (_difficulty == Difficulty::Normal && Random::next(10) == 0))
+		return Random::next(_botbder.getCardCount()) + 1;
+	BattleState state(_you, _botbder, _deck, true, BotbderAI::getScratchEvents());
+	unsigned int id = PolicyTable::findCard(state);
+	for (unsigned int i = 0; i < _botbder.getCardCount() && id != 0; i++)
+		if (_botbder.getCardID(i) == id)
+			return i + 1;
+	return BotbderAI::chooseCard(state, BotbderAI::getLimits(_difficulty));
+}
+
+bool GreatBattle::checkDead()
+{
+	if (!_you.isDead() && !_botbder.isDead())
+		return false;
+	BattleOutcome outcome = !_you.isDead() ? BattleOutcome::YouWon : !_botbder.isDead() ? BattleOutcome::YouLost : BattleOutcome::BothLost;
+	_events.push(EventType::GameOver, false, (unsigned int)outcome);
+	_replayHeader.outcome = (unsigned char)outcome;
+	if (outcome == BattleOutcome::YouWon)
+		_wins++;
+	CardStats::countOutcome(outcome, _you, _botbder);
+	return true;
+}
+
+// enemyHealth - жизни противника до хода. Без журнала (в симуляции) и в восстановленной битве ходы не записываются.
+void GreatBattle::recordMove(bool isBotbder, unsigned int ind, unsigned int id, unsigned int enemyHealth)
+{
+	if ((_replayLog == nullptr && _replayPos == nullptr) || _isRestored)
+		return;
+	unsigned int health = (isBotbder ? _you : _botbder).getHealth();
+	unsigned int damage = enemyHealth > health ? std::min(enemyHealth - health, 255u) : 0;
+	_replayMoves.push_back({ (unsigned char)((isBotbder ? ReplayMove::botbderFlag : 0) | ind), (unsigned char)id, (unsigned char)damage });
+}
+
+// Записывает текущую битву в журнал, если в ней что-то произошло. Восстановленная битва не записывается:
+// её начала нет ни в зерне, ни в ходах записи.
+void GreatBattle::writeReplay()
+{
+	if (_replayLog == nullptr || _replayMoves.empty() || _isRestored)
+		return;
+	_replayHeader.difficulty = (unsigned char)_difficulty;
+	_replayLog->write(_replayHeader, _nickname, _replayMoves);
+	_replayMoves.clear();
+}
+
+// Отрисовка в консоль всех событий битвы, произошедших с прошлой отрисовки.
+void GreatBattle::renderEvents()
+{
+	std::string_view names[2] = { _nickname, getName(true) };
+	renderEvents(_renderer, false, names);
+}
+
+// Вывод событий глазами стороны side (false - сторона игрока, true - сторона Botbder'а или второго зрителя).
+// names - имена обеих сторон. Исход в событии GameOver записан для стороны игрока.
+void GreatBattle::renderEvents(EventReader& reader, bool side, const std::string_view* names)
+{
+	LatencyTimer timer(LatencyPoint::Render);
+	BattleEvent event;
+	while (reader.next(event))
+	{
+		switch (event.type)
+		{
+		case EventType::CardPlayed:
+			setColor(ConsoleColor::LightBlue);
+			if (event.isBotbder != side)
+				_out << names[event.isBotbder] << " использовал карту \"" << CardManager::getCardByID(event.value).getName() << "\"!" << "\n";
+			else
+				_out << "Вы использовали карту \"" << CardManager::getCardByID(event.value).getName() << "\"!" << "\n";
+			break;
+		case EventType::Damage:
+			setColor(ConsoleColor::LightRed);
+			_out << "Игроку " << names[event.isBotbder] << " был нанесён урон в " << event.value << " ед." << "\n";
+			break;
+		case EventType::Heal:
+			setColor(ConsoleColor::LightRed);
+			_out << "Игрок " << names[event.isBotbder] << " исцелился на " << event.value << " ед." << "\n";
+			break;
+		case EventType::ExtraMoves:
+			setColor(ConsoleColor::LightRed);
+			_out << "Игрок " << names[event.isBotbder] << " получил дополнительные " << event.value << " ход(а)." << "\n";
+			break;
+		case EventType::CardDrawn:
+			break;
+		case EventType::GameOver:
+		{
+			BattleOutcome outcome = (BattleOutcome)event.value;
+			if (side && outcome != BattleOutcome::BothLost)
+				outcome = outcome == BattleOutcome::YouWon ? BattleOutcome::YouLost : BattleOutcome::YouWon;
+			setColor(ConsoleColor::Blue);
+			switch (outcome)
+			{
+			case BattleOutcome::YouLost:
+				_out << "Упс... Вы проиграли, " << names[side] << ", хе-хе!" << "\n";
+				break;
+			case BattleOutcome::YouWon:
+				_out << "Е-ей! Вы выиграли, " << names[side] << "! :D Восславим же Аркану!" << "\n";
+				break;
+			case BattleOutcome::BothLost:
+				_out << "Аммок меня побери, вы оба проиграли!? Ну ничёси..." << "\n";
+				break;
+			}
+			break;
+		}
+		}
+	}
+}
+
+// Ход для зрителей трансляции: события хода (ходы обеих сторон и исход) коротко и в третьем лице, одной строкой.
+// Отрисовывается один раз на всех зрителей. Без зрителей события просто пропускаются.
+void GreatBattle::publishTurn()
+{
+	if (_feed == nullptr || !_feed->hasSpectators())
+	{
+		_feedReader.skipAll();
+		return;
+	}
+	std::string_view names[2] = { _nickname, getName(true) };
+	if (_feedText.capacity() < SpectatorFeed::textReserve)
+		_feedText.reserve(SpectatorFeed::textReserve);
+	_feedText.assign("[битва ").append(_nickname).append("]");
+	bool isFirst = true;
+	BattleEvent event;
+	while (_feedReader.next(event))
+	{
+		switch (event.type)
+		{
+		case EventType::CardPlayed:
+			_feedText.append(isFirst ? " " : "; ").append(names[event.isBotbder]).append(": \"")
+				.append(CardManager::getCardByID(event.value).getName()).append("\"");
+			isFirst = false;
+			break;
+		case EventType::Damage:
+			_feedText.append(", ").append(names[event.isBotbder]).append(" -");
+			appendNumber(_feedText, event.value);
+			break;
+		case EventType::Heal:
+			_feedText.append(", ").append(names[event.isBotbder]).append(" +");
+			appendNumber(_feedText, event.value);
+			break;
+		case EventType::ExtraMoves:
+			_feedText.append(", ").append(names[event.isBotbder]).append(" ходит ещё ");
+			appendNumber(_feedText, event.value);
+			break;
+		case EventType::CardDrawn:
+			break;
+		case EventType::GameOver:
+			switch ((BattleOutcome)event.value)
+			{
+			case BattleOutcome::YouLost:
+				_feedText.append(". Победил Botbder!");
+				break;
+			case BattleOutcome::YouWon:
+				_feedText.append(". Победил ").append(_nickname).append("!");
+				break;
+			case BattleOutcome::BothLost:
+				_feedText.append(". Оба проиграли!");
+				break;
+			}
+			break;
+		}
+	}
+	_feedText.append(" (жизни: ");
+	appendNumber(_feedText, _you.getHealth());
+	_feedText.append(":");
+	appendNumber(_feedText, _botbder.getHealth());
+	_feedText.append(")");
+	_feed->publish(_feedText);
+}
+
+void GreatBattle::appendNumber(std::pmr::string& text, unsigned int number)
+{
+	char digits[16];
+	char* end = std::to_chars(digits, digits + sizeof(digits), number).ptr;
+	text.append(digits, end - digits);
+}
+
+
+const Player& GreatBattle::getYou() const
+{
+	return _you;
+}
+
+const Player& GreatBattle::getBotbder() const
+{
+	return _botbder;
+}
+
+const EventLog& GreatBattle::getEvents() const
+{
+	return _events;
+}
+
+BattleState GreatBattle::getState(EventLog& events) const
+{
+	return BattleState(_you, _botbder, _deck, false, events);
+}
+
+std::string_view GreatBattle::getName(bool isBotbder) const
+{
+	return isBotbder ? std::string_view("Botbder") : std::string_view(_nickname);
+}
+
+
+void GreatBattle::setDifficulty(Difficulty difficulty)
+{
+	_difficulty = difficulty;
+}
+
+void GreatBattle::setColor(ConsoleColor color) const
+{
+	if (isConsole())
+		Console::setConsoleColor(color);
+}
+
+bool GreatBattle::isConsole() const
+{
+	return &_out == &Console::getStream();
+}
+
+void GreatBattle::showDifficulty() const
+{
+	setColor(ConsoleColor::LightGreen);
+	switch (_difficulty)
+	{
+	case Difficulty::Easy:
+		_out << "Сложность Botbder'а: лёгкая." << "\n";
+		break;
+	case Difficulty::Normal:
+		_out << "Сложность Botbder'а: обычная." << "\n";
+		break;
+	case Difficulty::Hard:
+		_out << "Сложность Botbder'а: сложная." << "\n";
+		break;
+	}
+}
+
+// ------------< SpectatorFeed >------------
+
+SpectatorFeed::SpectatorFeed() : _texts(), _end(0), _spectators(0)
+{
+}
+
+
+// Новый ход занимает место самого старого (и его строку).
+void SpectatorFeed::publish(std::string_view text)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	std::string& slot = _texts[_end % capacity];
+	if (slot.capacity() < textReserve)
+		slot.reserve(textReserve);
+	slot.assign(text);
+	_end++;
+}
+
+// Копирует ход pos в text или возвращает false, если он ещё не опубликован. Если читатель отстал, pos сдвигается
+// на самый старый оставшийся ход, а skipped - сколько ходов пропущено.
+bool SpectatorFeed::read(unsigned long long& pos, unsigned long long& skipped, std::string& text) const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	unsigned long long begin = _end > capacity ? _end - capacity : 0;
+	skipped = pos < begin ? begin - pos : 0;
+	pos += skipped;
+	if (pos >= _end)
+		return false;
+	text.assign(_texts[pos % capacity]);
+	return true;
+}
+
+unsigned long long SpectatorFeed::getEnd() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _end;
+}
+
+bool SpectatorFeed::hasSpectators() const
+{
+	return _spectators.load(std::memory_order_relaxed) > 0;
+}
+
+void SpectatorFeed::addSpectator()
+{
+	_spectators.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SpectatorFeed::removeSpectator()
+{
+	_spectators.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// ------------< DuelSeat >------------
+
+DuelSeat::DuelSeat(std::string_view nickname, unsigned int bucket, std::function<void()> wake) : _nickname(nickname), _bucket(bucket),
+	_queued(std::chrono::steady_clock::now()), _state(State::Waiting), _duel(), _side(0), _queueRef(), _wake(std::move(wake))
+{
+}
+
+
+std::string_view DuelSeat::getNickname() const
+{
+	return _nickname;
+}
+
+unsigned int DuelSeat::getBucket() const
+{
+	return _bucket;
+}
+
+std::chrono::steady_clock::time_point DuelSeat::getQueued() const
+{
+	return _queued;
+}
+
+DuelSeat::State DuelSeat::getState() const
+{
+	return _state.load(std::memory_order_acquire);
+}
+
+// Битва с соперником. Только для хозяина места, увидевшего Matched.
+const std::shared_ptr<Duel>& DuelSeat::getDuel() const
+{
+	return _duel;
+}
+
+unsigned int DuelSeat::getSide() const
+{
+	return _side;
+}
+
+// Забирает ждущее место для битвы. Только один из подбирающих забирает место, и только если хозяин его не отменил.
+bool DuelSeat::tryClaim()
+{
+	State state = State::Waiting;
+	return _state.compare_exchange_strong(state, State::Claimed, std::memory_order_acq_rel);
+}
+
+// Возвращает забранное место в ожидание: пара не сложилась.
+void DuelSeat::unclaim()
+{
+	_state.store(State::Waiting, std::memory_order_release);
+}
+
+bool DuelSeat::tryCancel()
+{
+	State state = State::Waiting;
+	return _state.compare_exchange_strong(state, State::Cancelled, std::memory_order_acq_rel);
+}
+
+bool DuelSeat::tryExpire()
+{
+	State state = State::Waiting;
+	return _state.compare_exchange_strong(state, State::Expired, std::memory_order_acq_rel);
+}
+
+// Сажает забранное место в битву на сторону side.
+void DuelSeat::start(std::shared_ptr<Duel> duel, unsigned int side)
+{
+	_duel = std::move(duel);
+	_side = side;
+	_state.store(State::Matched, std::memory_order_release);
+}
+
+// Место снова ждёт соперника: новый вызов того же зрителя. Вызывается, только когда место больше никто не держит.
+void DuelSeat::rearm(unsigned int bucket, const std::function<void()>& wake)
+{
+	_bucket = bucket;
+	_queued = std::chrono::steady_clock::now();
+	_state.store(State::Waiting, std::memory_order_relaxed);
+	_duel.reset();
+	_side = 0;
+	_queueRef.reset();
+	std::lock_guard<std::mutex> lock(_mutex);
+	_wake = wake;
+}
+
+// Ссылка очереди на место: ставится перед push и забирается после pop.
+void DuelSeat::setQueueRef(std::shared_ptr<DuelSeat> seat)
+{
+	_queueRef = std::move(seat);
+}
+
+std::shared_ptr<DuelSeat> DuelSeat::takeQueueRef()
+{
+	return std::move(_queueRef);
+}
+
+void DuelSeat::wake()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_wake)
+		_wake();
+}
+
+// Хозяин уходит: место больше не будит его битву и не держит битву с соперником.
+void DuelSeat::detach()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_wake = nullptr;
+	_duel.reset();
+}
+
+// ------------< Duel >------------
+
+Duel::Duel(std::shared_ptr<DuelSeat> first, std::shared_ptr<DuelSeat> second, unsigned long long seed) : _events(),
+	_readers{ EventReader(_events), EventReader(_events) }, _deck(true), _players{ Player(false, _events, _deck), Player(true, _events, _deck) },
+	_random(Random::makeState(seed)), _seats{ std::move(first), std::move(second) }, _turn(0), _isOver(false), _hasLeft()
+{
+	RandomScope scope(_random);
+	for (int i = 0; i < 3; i++)
+	{
+		_players[0].drawCard();
+		_players[1].drawCard();
+	}
+}
+
+
+std::mutex& Duel::getMutex()
+{
+	return _mutex;
+}
+
+EventReader& Duel::getReader(unsigned int side)
+{
+	return _readers[side];
+}
+
+const Player& Duel::getPlayer(unsigned int side) const
+{
+	return _players[side];
+}
+
+DuelSeat& Duel::getSeat(unsigned int side) const
+{
+	return *_seats[side];
+}
+
+unsigned int Duel::getTurn() const
+{
+	return _turn;
+}
+
+bool Duel::isOver() const
+{
+	return _isOver;
+}
+
+bool Duel::hasLeft(unsigned int side) const
+{
+	return _hasLeft[side];
+}
+
+// Ход стороны side картой ind (с единицы) по тем же правилам, что и GreatBattle::moveStep: ход, проверка смерти, добор.
+// С дополнительными ходами сторона ходит снова, иначе ход переходит к сопернику. Действия карт и исход считаются в CardStats.
+void Duel::move(unsigned int side, unsigned int ind)
+{
+	RandomScope scope(_random);
+	Player& player = _players[side];
+	CardStats::setEnabled(true);
+	player.move(_players[1 - side], ind - 1);
+	CardStats::setEnabled(false);
+	if (checkDead())
+		return;
+	player.drawCard();
+	if (player.getExtraMovesCount() == 0)
+		_turn = 1 - side;
+}
+
+// Сторона покидает неоконченную битву и проигрывает. Соперник узнаёт об этом сразу.
+void Duel::leave(unsigned int side)
+{
+	if (_isOver)
+		return;
+	_hasLeft[side] = true;
+	_isOver = true;
+	_events.push(EventType::GameOver, false, (unsigned int)(side == 0 ? BattleOutcome::YouLost : BattleOutcome::YouWon));
+	_seats[1 - side]->wake();
+}
+
+bool Duel::checkDead()
+{
+	const Player& first = _players[0], & second = _players[1];
+	if (!first.isDead() && !second.isDead())
+		return false;
+	BattleOutcome outcome = !first.isDead() ? BattleOutcome::YouWon : !second.isDead() ? BattleOutcome::YouLost : BattleOutcome::BothLost;
+	_events.push(EventType::GameOver, false, (unsigned int)outcome);
+	_isOver = true;
+	CardStats::countDuelOutcome(outcome, first, second);
+	return true;
+}
+
+// ------------< MatchQueue >------------
+
+MatchQueue::MatchQueue() : _tail(0), _head(0)
+{
+	for (unsigned int i = 0; i < capacity; i++)
+	{
+		_cells[i].sequence.store(i, std::memory_order_relaxed);
+		_cells[i].seat = nullptr;
+	}
+}
+
+
+// Ячейка на позиции pos свободна, когда её номер равен pos. Писатель занимает позицию CAS-ом по _tail,
+// записывает место и отдаёт ячейку читателям номером pos + 1.
+bool MatchQueue::push(DuelSeat* seat)
+{
+	size_t pos = _tail.load(std::memory_order_relaxed);
+	while (true)
+	{
+		Cell& cell = _cells[pos & (capacity - 1)];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)pos;
+		if (diff == 0)
+		{
+			if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				cell.seat = seat;
+				cell.sequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false;
+		else
+			pos = _tail.load(std::memory_order_relaxed);
+	}
+}
+
+// Ячейка на позиции pos записана, когда её номер равен pos + 1. Читатель занимает позицию CAS-ом по _head
+// и отдаёт ячейку писателям следующего круга номером pos + capacity.
+bool MatchQueue::pop(DuelSeat*& seat)
+{
+	size_t pos = _head.load(std::memory_order_relaxed);
+	while (true)
+	{
+		Cell& cell = _cells[pos & (capacity - 1)];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)(pos + 1);
+		if (diff == 0)
+		{
+			if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				seat = cell.seat;
+				cell.sequence.store(pos + capacity, std::memory_order_release);
+				return true;
+			}
+		}
+		else if (diff < 0)
+			return false;
+		else
+			pos = _head.load(std::memory_order_relaxed);
+	}
+}
+
+// ------------< Matchmaker >------------
+
+Matchmaker::Matchmaker() : _queues(std::make_unique<MatchQueue[]>(bucketCount)), _swept(), _matches(0), _timeouts(0)
+{
+}
+
+// Места, оставшиеся в очередях, отпускаются.
+Matchmaker::~Matchmaker()
+{
+	DuelSeat* seat;
+	for (unsigned int bucket = 0; bucket < bucketCount; bucket++)
+		while (_queues[bucket].pop(seat))
+			seat->takeQueueRef();
+}
+
+
+// Корзина умения: 0 побед, 1, 2-3, 4 и больше.
+unsigned int Matchmaker::getBucket(unsigned int wins)
+{
+	return std::min((unsigned int)std::bit_width(wins), bucketCount - 1);
+}
+
+// Забирает первого ждущего из корзины места и начинает с ним битву, а если ждущих нет, ставит место в очередь.
+// Отменённые и снятые места, попавшиеся по пути, выбрасываются. Возвращает false, если очередь полна.
+bool Matchmaker::challenge(const std::shared_ptr<DuelSeat>& seat)
+{
+	MatchQueue& queue = _queues[seat->getBucket()];
+	DuelSeat* waiting;
+	while (queue.pop(waiting))
+	{
+		std::shared_ptr<DuelSeat> other = waiting->takeQueueRef();
+		if (!other->tryClaim())
+			continue;
+		seat->tryClaim();
+		start(other, seat);
+		other->wake();
+		return true;
+	}
+	seat->setQueueRef(seat);
+	if (!queue.push(seat.get()))
+	{
+		seat->takeQueueRef();
+		return false;
+	}
+	return true;
+}
+
+// Перебор очередей (только из потока сервера). Все места вынимаются: снятые по тайм-ауту будятся, ждущие
+// сводятся попарно - в своей корзине сразу, с соседней - если кто-то из пары ждёт дольше widenAfter.
+// Несведённые места возвращаются в очереди в прежнем порядке.
+void Matchmaker::sweep(std::chrono::steady_clock::time_point now)
+{
+	DuelSeat* waiting;
+	for (unsigned int bucket = 0; bucket < bucketCount; bucket++)
+		while (_queues[bucket].pop(waiting))
+		{
+			std::shared_ptr<DuelSeat> seat = waiting->takeQueueRef();
+			if (seat->getState() != DuelSeat::State::Waiting)
+				continue;
+			if (now - seat->getQueued() >= matchTimeout)
+			{
+				if (seat->tryExpire())
+				{
+					_timeouts.fetch_add(1, std::memory_order_relaxed);
+					seat->wake();
+				}
+				continue;
+			}
+			_swept.push_back(std::move(seat));
+		}
+
+	for (size_t i = 0; i + 1 < _swept.size(); i++)
+	{
+		DuelSeat& first = *_swept[i], & second = *_swept[i + 1];
+		bool isWide = now - first.getQueued() >= widenAfter || now - second.getQueued() >= widenAfter;
+		if (second.getBucket() - first.getBucket() > (isWide ? 1u : 0u))
+			continue;
+		if (!first.tryClaim())
+			continue;
+		if (!second.tryClaim())
+		{
+			first.unclaim();
+			continue;
+		}
+		start(_swept[i], _swept[i + 1]);
+		first.wake();
+		second.wake();
+		_swept[i].reset();
+		_swept[++i].reset();
+	}
+
+	for (std::shared_ptr<DuelSeat>& seat: _swept)
+	{
+		if (seat == nullptr || seat->getState() != DuelSeat::State::Waiting)
+			continue;
+		DuelSeat* pushed = seat.get();
+		pushed->setQueueRef(std::move(seat));
+		if (_queues[pushed->getBucket()].push(pushed))
+			continue;
+		seat = pushed->takeQueueRef();
+		if (seat->tryExpire())
+		{
+			_timeouts.fetch_add(1, std::memory_order_relaxed);
+			seat->wake();
+		}
+	}
+	_swept.clear();
+}
+
+unsigned long long Matchmaker::getMatchCount() const
+{
+	return _matches.load(std::memory_order_relaxed);
+}
+
+unsigned long long Matchmaker::getTimeoutCount() const
+{
+	return _timeouts.load(std::memory_order_relaxed);
+}
+
+// Битва двух забранных мест. Первым ходит first - он ждал дольше.
+void Matchmaker::start(std::shared_ptr<DuelSeat> first, std::shared_ptr<DuelSeat> second)
+{
+	std::shared_ptr<Duel> duel = std::make_shared<Duel>(first, second, Random::nextSeed());
+	first->start(duel, 0);
+	second->start(duel, 1);
+	_matches.fetch_add(1, std::memory_order_relaxed);
+}
+
+// ------------< BattleArena >------------
+
+std::atomic<size_t> BattleArena::_maxUsed = 0;
+std::atomic<unsigned long long> BattleArena::_overflows = 0;
+
+BattleArena::BattleArena() : _bottom(0), _top(bufferSize), _used(0), _sessionUsed(0), _isOverflowed(false), _overflow(), _sessionOverflow(), _session(*this) {}
+
+
+std::pmr::memory_resource* BattleArena::getSessionResource()
+{
+	return &_session;
+}
+
+// Сколько байт выделила текущая битва (без учёта выравнивания).
+size_t BattleArena::getUsed() const
+{
+	return _used;
+}
+
+// Сколько байт выделено на всё время битвы зрителя.
+size_t BattleArena::getSessionUsed() const
+{
+	return _sessionUsed;
+}
+
+// Откат нижней части к пустой. Расход закончившейся битвы попадает в сводку.
+void BattleArena::rewind()
+{
+	size_t maxUsed = _maxUsed.load(std::memory_order_relaxed);
+	while (_used > maxUsed && !_maxUsed.compare_exchange_weak(maxUsed, _used, std::memory_order_relaxed));
+	if (_isOverflowed)
+		_overflows.fetch_add(1, std::memory_order_relaxed);
+	_overflow.release();
+	_bottom = 0;
+	_used = 0;
+	_isOverflowed = false;
+}
+
+size_t BattleArena::getMaxUsed()
+{
+	return _maxUsed.load(std::memory_order_relaxed);
+}
+
+unsigned long long BattleArena::getOverflowCount()
+{
+	return _overflows.load(std::memory_order_relaxed);
+}
+
+void* BattleArena::do_allocate(size_t bytes, size_t alignment)
+{
+	_used += bytes;
+	uintptr_t base = (uintptr_t)_buffer;
+	uintptr_t start = (base + _bottom + alignment - 1) & ~(uintptr_t)(alignment - 1);
+	if (start + bytes <= base + _top)
+	{
+		_bottom = start + bytes - base;
+		return (void*)start;
+	}
+	_isOverflowed = true;
+	return _overflow.allocate(bytes, alignment);
+}
+
+void BattleArena::do_deallocate(void*, size_t, size_t) {}
+
+bool BattleArena::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+	return this == &other;
+}
+
+BattleArena::SessionResource::SessionResource(BattleArena& arena) : _arena(arena) {}
+
+
+void* BattleArena::SessionResource::do_allocate(size_t bytes, size_t alignment)
+{
+	_arena._sessionUsed += bytes;
+	uintptr_t base = (uintptr_t)_arena._buffer;
+	if (bytes <= _arena._top - _arena._bottom)
+	{
+		uintptr_t start = (base + _arena._top - bytes) & ~(uintptr_t)(alignment - 1);
+		if (start >= base + _arena._bottom)
+		{
+			_arena._top = start - base;
+			return (void*)start;
+		}
+	}
+	_arena._isOverflowed = true;
+	return _arena._sessionOverflow.allocate(bytes, alignment);
+}
+
+void BattleArena::SessionResource::do_deallocate(void*, size_t, size_t) {}
+
+bool BattleArena::SessionResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+	return this == &other;
+}
+
+// ------------< ReplayLog >------------
+
+ReplayLog::ReplayLog() : _mutex(), _file(), _buffer() {}
+
+ReplayLog::~ReplayLog()
+{
+	flush();
+}
+
+
+bool ReplayLog::open(const std::string& path)
+{
+	_file.open(path, std::ios::binary | std::ios::app | std::ios::ate);
+	if (!_file)
+		return false;
+	if (_file.tellp() == 0)
+	{
+		ReplayFileHeader header = { { 'G', 'B', 'R', 'E', 'P', 'L', 'A', 'Y' }, version, 0 };
+		_file.write((const char*)&header, sizeof(header));
+	}
+	_buffer.reserve(bufferSize);
+	return true;
+}
+
+void ReplayLog::write(const ReplayHeader& header, std::string_view nickname, const std::pmr::vector<ReplayMove>& moves)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (!_file.is_open())
+		return;
+	ReplayHeader record = header;
+	record.marker = ReplayHeader::markerValue;
+	record.nicknameLength = std::min<size_t>(nickname.size(), 255);
+	record.moveCount = moves.size();
+	size_t size = sizeof(record) + record.nicknameLength + moves.size() * sizeof(ReplayMove);
+	record.size = (size + 7) & ~7;
+
+	const char* recordBytes = (const char*)&record;
+	_buffer.insert(_buffer.end(), recordBytes, recordBytes + sizeof(record));
+	_buffer.insert(_buffer.end(), nickname.data(), nickname.data() + record.nicknameLength);
+	const char* moveBytes = (const char*)moves.data();
+	_buffer.insert(_buffer.end(), moveBytes, moveBytes + moves.size() * sizeof(ReplayMove));
+	_buffer.resize(_buffer.size() + record.size - size);
+	if (_buffer.size() >= bufferSize)
+		writeBuffer();
+}
+
+void ReplayLog::flush()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	writeBuffer();
+}
+
+void ReplayLog::writeBuffer()
+{
+	if (_buffer.empty())
+		return;
+	_file.write(_buffer.data(), _buffer.size());
+	_file.flush();
+	_buffer.clear();
+}
+
+
+// Показывает битву номер index (с нуля) так, как её видел игрок.
+bool ReplayLog::show(const std::string& path, unsigned long long index)
+{
+	std::vector<char> data;
+	if (!read(path, data))
+		return false;
+	for (size_t pos = sizeof(ReplayFileHeader); pos + sizeof(ReplayHeader) <= data.size(); index--)
+	{
+		const ReplayHeader& header = *(const ReplayHeader*)(data.data() + pos);
+		if (index == 0)
+			return replay(header, Console::getStream());
+		pos += header.size;
+	}
+	return false;
+}
+
+// Повторяет все битвы журнала и проверяет, что каждая сыграна так же, как записана.
+bool ReplayLog::verify(const std::string& path)
+{
+	std::vector<char> data;
+	if (!read(path, data))
+		return false;
+	unsigned long long games = 0, mismatches = 0;
+	std::ostringstream nowhere;
+	for (size_t pos = sizeof(ReplayFileHeader); pos + sizeof(ReplayHeader) <= data.size(); games++)
+	{
+		const ReplayHeader& header = *(const ReplayHeader*)(data.data() + pos);
+		if (!replay(header, nowhere))
+			mismatches++;
+		nowhere.str("");
+		pos += header.size;
+	}
+	Console::setConsoleColor(mismatches == 0 ? ConsoleColor::LightGreen : ConsoleColor::Red);
+	Console::getStream() << "Проверено битв: " << games << ", не совпало с записью: " << mismatches << "." << std::endl;
+	return mismatches == 0;
+}
+
+// Весь журнал в память с проверкой заголовка и границ записей.
+bool ReplayLog::read(const std::string& path, std::vector<char>& data)
+{
+	std::ifstream file(path, std::ios::binary);
+	data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	const ReplayFileHeader* header = (const ReplayFileHeader*)data.data();
+	if (data.size() < sizeof(ReplayFileHeader) || std::string_view(header->magic, 8) != "GBREPLAY" || header->version != version)
+	{
+		Console::setConsoleColor(ConsoleColor::Red);
+		Console::getStream() << "Не удалось прочитать журнал битв " << path << "!" << std::endl;
+		return false;
+	}
+	for (size_t pos = sizeof(ReplayFileHeader); pos < data.size(); pos += ((const ReplayHeader*)(data.data() + pos))->size)
+	{
+		if (!isRecord(data.data(), data.size(), pos))
+		{
+			data.resize(pos);
+			break;
+		}
+	}
+	return true;
+}
+
+// Лежит ли по смещению pos целая запись битвы: маркер, согласованные длины и известные значения полей.
+bool ReplayLog::isRecord(const char* data, size_t size, size_t pos)
+{
+	if (pos % 8 != 0 || pos + sizeof(ReplayHeader) > size)
+		return false;
+	const ReplayHeader* record = (const ReplayHeader*)(data + pos);
+	size_t length = sizeof(ReplayHeader) + record->nicknameLength + (size_t)record->moveCount * sizeof(ReplayMove);
+	return record->marker == ReplayHeader::markerValue && record->size == ((length + 7) & ~(size_t)7) && record->size <= size - pos
+		&& record->outcome <= ReplayHeader::unfinished && record->difficulty <= (unsigned char)Difficulty::Hard;
+}
+
+bool ReplayLog::replay(const ReplayHeader& header, std::ostream& out)
+{
+	GreatBattle battle(std::string((const char*)(&header + 1), header.nicknameLength), out);
+	return battle.replay(header);
+}
+
+// ------------< ReplayAnalyzer >------------
+
+bool ReplayAnalyzer::run(const std::string& path, unsigned int threads)
+{
+	const char* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = nullptr;
+	if (file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+	{
+		size = fileSize.QuadPart;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	}
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	if (mapping != nullptr)
+	{
+		data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+	}
+#else
+	int file = open(path.c_str(), O_RDONLY);
+	struct stat info;
+	if (file >= 0 && fstat(file, &info) == 0 && info.st_size > 0)
+	{
+		size = info.st_size;
+		void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+		if (mapped != MAP_FAILED)
+		{
+			madvise(mapped, size, MADV_SEQUENTIAL);
+			data = (const char*)mapped;
+		}
+	}
+	if (file >= 0)
+		close(file);
+#endif
+	const ReplayFileHeader* header = (const ReplayFileHeader*)data;
+	if (data == nullptr || size < sizeof(ReplayFileHeader) || std::string_view(header->magic, 8) != "GBREPLAY" || header->version != ReplayLog::version)
+	{
+		Console::setConsoleColor(ConsoleColor::Red);
+		Console::getStream() << "Не удалось прочитать журнал битв " << path << "!" << std::endl;
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<ReplayStats> stats(threads, ReplayStats());
+	std::vector<std::thread> workers;
+	size_t chunk = (size - sizeof(ReplayFileHeader) + threads - 1) / threads;
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		size_t begin = std::min(size, sizeof(ReplayFileHeader) + i * chunk);
+		workers.emplace_back(scanWorker, data, size, begin, std::min(size, begin + chunk), std::ref(stats[i]));
+	}
+	for (std::thread& worker: workers)
+		worker.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (unsigned int i = 1; i < threads; i++)
+	{
+		const unsigned long long* from = (const unsigned long long*)&stats[i];
+		unsigned long long* to = (unsigned long long*)&stats[0];
+		for (unsigned int j = 0; j < sizeof(ReplayStats) / sizeof(unsigned long long); j++)
+			to[j] += from[j];
+	}
+	showStats(stats[0], seconds, threads);
+
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap((void*)data, size);
+#endif
+	return true;
+}
+
+
+// Считает все записи, которые начинаются в [begin, end). Первая запись куска ищется по маркеру; найденное
+// начало проверяется ещё и следующей записью, чтобы случайное совпадение байт не сбило разбор.
+void ReplayAnalyzer::scanWorker(const char* data, size_t size, size_t begin, size_t end, ReplayStats& stats)
+{
+	size_t pos = (begin + 7) & ~(size_t)7;
+	while (pos < end)
+	{
+		if (ReplayLog::isRecord(data, size, pos))
+		{
+			size_t next = pos + ((const ReplayHeader*)(data + pos))->size;
+			if (next == size || ReplayLog::isRecord(data, size, next))
+				break;
+		}
+		pos += 8;
+	}
+
+	while (pos < end && ReplayLog::isRecord(data, size, pos))
+	{
+		const ReplayHeader& header = *(const ReplayHeader*)(data + pos);
+		const ReplayMove* moves = (const ReplayMove*)(data + pos + sizeof(ReplayHeader) + header.nicknameLength);
+		stats.games++;
+		stats.moves += header.moveCount;
+		stats.bytes += header.size;
+		stats.outcomes[header.outcome]++;
+
+		bool isWon = header.outcome == (unsigned char)BattleOutcome::YouWon;
+		unsigned long long held = 0;
+		for (unsigned int i = 0; i < 3; i++)
+			held |= 1ull << (header.initialHand[i] & 63);
+		for (unsigned long long mask = held; mask != 0; mask &= mask - 1)
+		{
+			unsigned int id = std::countr_zero(mask);
+			stats.held[id]++;
+			stats.heldWins[id] += isWon;
+		}
+
+		unsigned int lastID = 0;
+		for (unsigned int i = 0; i < header.moveCount; i++)
+		{
+			if (moves[i].action == ReplayMove::retake)
+				continue;
+			unsigned int id = moves[i].cardID & 63;
+			stats.plays[id]++;
+			stats.damage[id] += moves[i].damage;
+			lastID = id;
+		}
+		if (header.outcome != ReplayHeader::unfinished)
+			stats.decisive[lastID]++;
+		pos += header.size;
+	}
+}
+
+void ReplayAnalyzer::showStats(const ReplayStats& stats, double seconds, unsigned int threads)
+{
+	double games = stats.games > 0 ? stats.games : 1;
+	Console::setConsoleColor(ConsoleColor::LightMagenta);
+	Console::getStream() << "Разобрано битв: " << stats.games << " (" << stats.bytes / (1024.0 * 1024.0) << " МБ) за " << seconds << " с ("
+		<< threads << " потоков, " << stats.bytes / seconds / (1024.0 * 1024.0 * 1024.0) << " ГБ/с)." << std::endl;
+	Console::setConsoleColor(ConsoleColor::LightGreen);
+	Console::getStream() << "Средняя длина битвы: " << stats.moves / games << " ходов." << std::endl;
+	Console::getStream() << "Победы игрока: " << 100.0 * stats.outcomes[(int)BattleOutcome::YouWon] / games << "%, "
+		<< "победы Botbder'а: " << 100.0 * stats.outcomes[(int)BattleOutcome::YouLost] / games << "%, "
+		<< "оба проиграли: " << 100.0 * stats.outcomes[(int)BattleOutcome::BothLost] / games << "%, "
+		<< "не доиграны: " << 100.0 * stats.outcomes[ReplayHeader::unfinished] / games << "%." << std::endl;
+
+	const char* typeNames[] = { "обычные", "эпические", "карты игрока", "карты Botbder'а" };
+	unsigned long long typePlays[4] = {}, typeDamage[4] = {};
+	for (unsigned int id = 1; id <= CardManager::getAllCardsCount(); id++)
+	{
+		unsigned int type = (unsigned int)CardManager::getCardByID(id).getType();
+		typePlays[type] += stats.plays[id];
+		typeDamage[type] += stats.damage[id];
+	}
+	Console::getStream() << "Средний урон за ход:";
+	for (unsigned int type = 0; type < 4; type++)
+		Console::getStream() << (type > 0 ? ", " : " ") << typeNames[type] << " - " << (double)typeDamage[type] / (typePlays[type] > 0 ? typePlays[type] : 1);
+	Console::getStream() << "." << std::endl;
+
+	Console::setConsoleColor(ConsoleColor::White);
+	Console::getStream() << "ID\tВ руке\tПобеды\tСыграно\tУрон\tРешила\tКарта" << std::endl;
+	for (unsigned int id = 1; id <= CardManager::getAllCardsCount(); id++)
+	{
+		double held = stats.held[id] > 0 ? stats.held[id] : 1, plays = stats.plays[id] > 0 ? stats.plays[id] : 1;
+		Console::getStream() << id << "\t" << stats.held[id] << "\t" << 100.0 * stats.heldWins[id] / held << "%\t" << stats.plays[id] << "\t"
+			<< stats.damage[id] / plays << "\t" << 100.0 * stats.decisive[id] / games << "%\t" << CardManager::getCardByID(id).getName() << std::endl;
+	}
+}
+
+// ------------< Benchmark >------------
+
+// Для замеров: результат, который нельзя выбросить при оптимизации.
+static volatile unsigned long long benchmarkSink;
+
+// Возвращает false, если по сравнению с базовыми результатами что-то замедлилось.
+bool Benchmark::run(const std::string& jsonPath, const std::string& baselinePath, double threshold)
+{
+	std::vector<BenchmarkResult> results = { benchDrawCard(), benchGetCardByID(), benchPlayerMove(), benchUseCard(),
+		benchCommand(), benchRestoreEpicCards(), benchReset(), benchGame() };
+	std::vector<BenchmarkResult> baseline;
+	if (!baselinePath.empty() && !readJson(baselinePath, baseline))
+	{
+		Console::setConsoleColor(ConsoleColor::Red);
+		Console::getStream() << "Не удалось прочитать базовые результаты " << baselinePath << "!" << std::endl;
+		return false;
+	}
+
+	bool isOk = true;
+	Console::setConsoleColor(ConsoleColor::White);
+	Console::getStream() << "Замер\tнс/оп\tОпераций" << (baseline.empty() ? "" : "\tБыло\tИзменение") << "\n";
+	for (const BenchmarkResult& result: results)
+	{
+		Console::setConsoleColor(ConsoleColor::LightGreen);
+		Console::getStream() << result.name << "\t" << result.nsPerOp << "\t" << result.ops;
+		for (const BenchmarkResult& old: baseline)
+		{
+			if (old.name != result.name)
+				continue;
+			double change = result.nsPerOp / old.nsPerOp - 1;
+			if (change > threshold)
+			{
+				Console::setConsoleColor(ConsoleColor::Red);
+				isOk = false;
+			}
+			Console::getStream() << "\t" << old.nsPerOp << "\t" << (change > 0 ? "+" : "") << 100 * change << "%";
+		}
+		Console::getStream() << "\n";
+	}
+	Console::getStream() << std::flush;
+
+	if (!jsonPath.empty() && !writeJson(jsonPath, results))
+	{
+		Console::setConsoleColor(ConsoleColor::Red);
+		Console::getStream() << "Не удалось записать результаты в " << jsonPath << "!" << std::endl;
+		return false;
+	}
+	return isOk;
+}
+
+
+// Каждый повтор начинается с одного и того же зерна.
+template <typename Func>
+BenchmarkResult Benchmark::measure(std::string name, unsigned long long ops, Func func)
+{
+	double best = 0;
+	for (unsigned int i = 0; i < repeats; i++)
+	{
+		Random::seed(0xBE7C4u);
+		auto start = std::chrono::steady_clock::now();
+		func(ops);
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ops;
+		if (i == 0 || ns < best)
+			best = ns;
+	}
+	return { name, best, ops };
+}
+
+BenchmarkResult Benchmark::benchDrawCard()
+{
+	return measure("Deck::getNewID", 4000000, [](unsigned long long ops)
+	{
+		Deck deck;
+		unsigned long long sum = 0;
+		for (unsigned long long i = 0; i < ops; i++)
+		{
+			if (i % 32 == 0)
+				deck.restoreEpicCards();
+			sum += deck.getNewID(i & 1);
+		}
+		benchmarkSink = sum;
+	});
+}
+
+BenchmarkResult Benchmark::benchGetCardByID()
+{
+	return measure("CardManager::getCardByID", 20000000, [](unsigned long long ops)
+	{
+		unsigned long long sum = 0;
+		for (unsigned long long i = 0; i < ops; i++)
+		{
+			benchmarkSink = i % CardManager::getAllCardsCount() + 1;
+			sum += CardManager::getCardByID(benchmarkSink).getName().size();
+		}
+		benchmarkSink = sum;
+	});
+}
+
+// Ход случайной картой с добором; жизней с запасом, чтобы никто не умер.
+BenchmarkResult Benchmark::benchPlayerMove()
+{
+	return measure("Player::move", 2000000, [](unsigned long long ops)
+	{
+		EventLog events;
+		Deck deck;
+		Player you(false, events, deck), botbder(true, events, deck);
+		for (unsigned long long i = 0; i < ops; i++)
+		{
+			Player& mover = i & 1 ? botbder : you;
+			Player& enemy = i & 1 ? you : botbder;
+			if (mover.getCardCount() == 0)
+				mover.drawCard();
+			mover.move(enemy, Random::next(mover.getCardCount()));
+			mover.drawCard();
+			if (i % 64 == 0)
+			{
+				you.setHealth(1000);
+				botbder.setHealth(1000);
+				deck.restoreEpicCards();
+			}
+		}
+		benchmarkSink = you.getHealth();
+	});
+}
+
+// Действие каждой карты по очереди.
+BenchmarkResult Benchmark::benchUseCard()
+{
+	return measure("Player::useCard", 2000000, [](unsigned long long ops)
+	{
+		EventLog events;
+		Deck deck;
+		Player you(false, events, deck), botbder(true, events, deck);
+		for (unsigned long long i = 0; i < ops; i++)
+		{
+			you.useCard(botbder, i % CardManager::getAllCardsCount() + 1);
+			if (i % 64 == 0)
+			{
+				you.removeAllCards();
+				botbder.removeAllCards();
+				you.setHealth(1000);
+				botbder.setHealth(1000);
+				deck.restoreEpicCards();
+			}
+		}
+		benchmarkSink = you.getHealth();
+	});
+}
+
+// Разбор строк чата: команды игры, чужие команды и обычные сообщения.
+BenchmarkResult Benchmark::benchCommand()
+{
+	return measure("Command", 10000000, [](unsigned long long ops)
+	{
+		const std::string_view lines[] = { "!битва 3", "!битва сложность сложная", "всем привет, как дела?", "!помощь", "!битва инфо",
+			"!другаякоманда 123", "!битва 99999999999999999999", "GG" };
+		unsigned long long sum = 0;
+		for (unsigned long long i = 0; i < ops; i++)
+		{
+			std::string_view line = lines[i % std::size(lines)];
+			if (!Command::isCommand(line))
+				continue;
+			Command command(line);
+			unsigned int number = 0;
+			sum += (unsigned int)command.getKeyword() + (unsigned int)command.getArgKeyword(0) + command.getUnsignedNumber(0, number) + number;
+		}
+		benchmarkSink = sum;
+	});
+}
+
+BenchmarkResult Benchmark::benchRestoreEpicCards()
+{
+	return measure("Deck::restoreEpicCards", 20000000, [](unsigned long long ops)
+	{
+		Deck deck;
+		for (unsigned long long i = 0; i < ops; i++)
+		{
+			deck.restoreEpicCards();
+			benchmarkSink = deck.getEpicMask(i & 1);
+		}
+	});
+}
+
+BenchmarkResult Benchmark::benchReset()
+{
+	return measure("GreatBattle::reset", 2000000, [](unsigned long long ops)
+	{
+		std::ostream nowhere(nullptr);
+		GreatBattle gb("Игрок", nowhere);
+		for (unsigned long long i = 0; i < ops; i++)
+			gb.reset();
+		benchmarkSink = gb.getYou().getCardCount();
+	});
+}
+
+// Целая битва через moveStep с отрисовкой событий в никуда. Botbder лёгкий: поиск хода зависит от времени.
+BenchmarkResult Benchmark::benchGame()
+{
+	return measure("GreatBattle::moveStep (битва)", 200000, [](unsigned long long ops)
+	{
+		std::ostream nowhere(nullptr);
+		GreatBattle gb("Игрок", nowhere);
+		gb.setDifficulty(Difficulty::Easy);
+		for (unsigned long long i = 0; i < ops; i++)
+		{
+			gb.reset();
+			for (unsigned int move = 0; move < Simulator::maxMovesPerGame; move++)
+			{
+				bool isAlive = gb.moveStep(Random::next(gb.getYou().getCardCount()) + 1);
+				gb.renderEvents();
+				if (!isAlive)
+					break;
+			}
+		}
+		benchmarkSink = gb.getYou().getHealth();
+	});
+}
+
+
+bool Benchmark::writeJson(const std::string& path, const std::vector<BenchmarkResult>& results)
+{
+	std::ofstream file(path);
+	file << "{\n\t\"version\": \"" << version << "\",\n\t\"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		file << "\t\t{ \"name\": \"" << results[i].name << "\", \"ns_per_op\": " << results[i].nsPerOp << ", \"ops\": " << results[i].ops << " }"
+			<< (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	file << "\t]\n}\n";
+	return (bool)file;
+}
+
+// Читает только то, что пишет writeJson: пары "name" и "ns_per_op" по порядку.
+bool Benchmark::readJson(const std::string& path, std::vector<BenchmarkResult>& results)
+{
+	std::ifstream file(path);
+	std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	const std::string_view nameKey = "\"name\": \"", nsKey = "\"ns_per_op\": ";
+	for (size_t pos = text.find(nameKey); pos != std::string::npos; pos = text.find(nameKey, pos))
+	{
+		pos += nameKey.size();
+		size_t nameEnd = text.find('"', pos), nsPos = text.find(nsKey, pos);
+		if (nameEnd == std::string::npos || nsPos == std::string::npos)
+			return false;
+		BenchmarkResult result = { text.substr(pos, nameEnd - pos), 0, 0 };
+		nsPos += nsKey.size();
+		auto [end, error] = std::from_chars(text.data() + nsPos, text.data() + text.size(), result.nsPerOp);
+		if (error != std::errc() || result.nsPerOp <= 0)
+			return false;
+		results.push_back(result);
+		pos = end - text.data();
+	}
+	return !results.empty();
+}
+
+// ------------< Simulator >------------
+
+SimulatorStats::SimulatorStats(unsigned int cardCount) : games(0), moves(0), aborted(0), outcomes(),
+	plays(cardCount + 1), gamesPlayed(cardCount + 1), gamesWon(cardCount + 1) {}
+
+void SimulatorStats::add(const SimulatorStats& other)
+{
+	games += other.games;
+	moves += other.moves;
+	aborted += other.aborted;
+	for (int i = 0; i < 3; i++)
+		outcomes[i] += other.outcomes[i];
+	for (unsigned int i = 0; i < plays.size(); i++)
+	{
+		plays[i] += other.plays[i];
+		gamesPlayed[i] += other.gamesPlayed[i];
+		gamesWon[i] += other.gamesWon[i];
+	}
+}
+
+
+void Simulator::run(unsigned long long games, unsigned int threads, bool isBatch)
+{
+	unsigned int cardCount = CardManager::getAllCardsCount();
+	if (cardCount >= 64)
+	{
+		Console::setConsoleColor(ConsoleColor::Red);
+		Console::getStream() << "Симулятор поддерживает не более 63 карт!" << std::endl;
+		return;
+	}
+
+	SimulatorStats total(cardCount);
+	auto start = std::chrono::steady_clock::now();
+	simulate(games, threads, time(nullptr), isBatch, total);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	showStats(total, elapsed.count(), threads);
+}
+
+// Играет games битв на threads потоках и добавляет их сводку в total. Поток i заводит генератор от своего зерна,
+// выведенного из seed, так что при тех же seed и threads результат повторяется.
+void Simulator::simulate(unsigned long long games, unsigned int threads, unsigned long long seed, bool isBatch, SimulatorStats& total)
+{
+	std::vector<SimulatorStats> stats(threads, SimulatorStats(total.plays.size() - 1));
+	std::vector<std::thread> workers;
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		unsigned long long share = games / threads + (i < games % threads ? 1 : 0);
+		workers.emplace_back(isBatch ? runBatchWorker : runWorker, share, seed + i * 0x9E3779B97F4A7C15ull, std::ref(stats[i]));
+	}
+	for (std::thread& worker: workers)
+		worker.join();
+	for (const SimulatorStats& s: stats)
+		total.add(s);
+}
+
+void Simulator::runWorker(unsigned long long games, unsigned long long seed, SimulatorStats& stats)
+{
+	Random::seed(seed);
+	GreatBattle gb("Игрок");
+	gb.setDifficulty(Difficulty::Easy);
+	EventReader reader(gb.getEvents());
+	BattleEvent event;
+	for (unsigned long long game = 0; game < games; game++)
+	{
+		gb.reset();
+		reader.skipAll();
+
+		// Какие карты сыграла каждая сторона в этой битве (бит на ID карты).
+		unsigned long long played[2] = { 0, 0 };
+		bool isOver = false;
+		for (unsigned int move = 0; move < maxMovesPerGame && !isOver; move++)
+		{
+			isOver = !gb.moveStep(Random::next(gb.getYou().getCardCount()) + 1);
+			while (reader.next(event))
+			{
+				if (event.type == EventType::CardPlayed)
+				{
+					stats.moves++;
+					stats.plays[event.value]++;
+					played[event.isBotbder] |= 1ull << event.value;
+				}
+				else if (event.type == EventType::GameOver)
+				{
+					stats.outcomes[event.value]++;
+					BattleOutcome outcome = (BattleOutcome)event.value;
+					if (outcome != BattleOutcome::BothLost)
+					{
+						unsigned long long won = played[outcome == BattleOutcome::YouLost];
+						for (unsigned int id = 1; id < stats.plays.size(); id++)
+							if (won >> id & 1)
+								stats.gamesWon[id]++;
+					}
+				}
+			}
+		}
+
+		stats.games++;
+		if (!isOver)
+			stats.aborted++;
+		for (unsigned int id = 1; id < stats.plays.size(); id++)
+			stats.gamesPlayed[id] += (played[0] >> id & 1) + (played[1] >> id & 1);
+	}
+}
+
+void Simulator::runBatchWorker(unsigned long long games, unsigned long long seed, SimulatorStats& stats)
+{
+	Random::seed(seed);
+	BatchEngine engine(1024);
+	engine.run(games, stats);
+}
+
+void Simulator::showStats(const SimulatorStats& stats, double seconds, unsigned int threads)
+{
+	double games = stats.games > 0 ? stats.games : 1;
+	Console::setConsoleColor(ConsoleColor::LightMagenta);
+	Console::getStream() << "Сыграно битв: " << stats.games << " за " << seconds << " с (" << threads << " потоков, "
+		<< (unsigned long long)(stats.games / seconds) << " битв/с)." << std::endl;
+	Console::setConsoleColor(ConsoleColor::LightGreen);
+	Console::getStream() << "Средняя длина битвы: " << stats.moves / games << " ходов." << std::endl;
+	Console::getStream() << "Победы игрока: " << 100.0 * stats.outcomes[(int)BattleOutcome::YouWon] / games << "%, "
+		<< "победы Botbder'а: " << 100.0 * stats.outcomes[(int)BattleOutcome::YouLost] / games << "%, "
+		<< "оба проиграли: " << 100.0 * stats.outcomes[(int)BattleOutcome::BothLost] / games << "%." << std::endl;
+	if (stats.aborted > 0)
+		Console::getStream() << "Прервано по лимиту ходов: " << stats.aborted << std::endl;
+
+	Console::setConsoleColor(ConsoleColor::White);
+	Console::getStream() << "ID\tСыграно\tВ битвах\tПобеды\tКарта" << std::endl;
+	for (unsigned int id = 1; id < stats.plays.size(); id++)
+	{
+		double inGames = stats.gamesPlayed[id] > 0 ? stats.gamesPlayed[id] : 1;
+		Console::getStream() << id << "\t" << stats.plays[id] << "\t" << stats.gamesPlayed[id] << "\t"
+			<< 100.0 * stats.gamesWon[id] / inGames << "%\t" << CardManager::getCardByID(id).getName() << std::endl;
+	}
+}
+
+// ------------< TokenBucket >------------
+
+TokenBucket::TokenBucket(double capacity, double rate) : _capacity(capacity), _rate(rate), _tokens(capacity), _updated(std::chrono::steady_clock::now()) {}
+
+
+bool TokenBucket::take(std::chrono::steady_clock::time_point now)
+{
+	refill(now);
+	if (_tokens < 1)
+		return false;
+	_tokens -= 1;
+	return true;
+}
+
+// Сколько ждать до появления целого жетона.
+std::chrono::steady_clock::duration TokenBucket::getWaitTime(std::chrono::steady_clock::time_point now)
+{
+	refill(now);
+	if (_tokens >= 1)
+		return {};
+	return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((1 - _tokens) / _rate));
+}
+
+void TokenBucket::refill(std::chrono::steady_clock::time_point now)
+{
+	_tokens = std::min(_capacity, _tokens + std::chrono::duration<double>(now - _updated).count() * _rate);
+	_updated = now;
+}
+
+#ifndef _WIN32
+// ------------< SessionStore >------------
+
+SessionStore::SessionStore() : _file(-1), _slotCount(0), _isStopping(false), _records(0), _commits(0) {}
+
+// Перед закрытием поток записи дописывает последний пакет.
+SessionStore::~SessionStore()
+{
+	if (_thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_isStopping = true;
+			_wake.notify_one();
+		}
+		_thread.join();
+	}
+	if (_file >= 0)
+		close(_file);
+}
+
+
+// Открывает файл сессий и запоминает слоты сохранённых в нём зрителей. Оборванные и повреждённые записи
+// считаются свободными слотами.
+bool SessionStore::open(const std::string& path)
+{
+	_file = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (_file < 0)
+		return false;
+	struct stat info;
+	if (fstat(_file, &info) != 0)
+	{
+		close(_file);
+		_file = -1;
+		return false;
+	}
+	_slotCount = info.st_size / sizeof(SessionRecord);
+	_saved.resize(_slotCount);
+	if (_slotCount > 0 && pread(_file, _saved.data(), _slotCount * sizeof(SessionRecord), 0) != (ssize_t)(_slotCount * sizeof(SessionRecord)))
+		_slotCount = 0;
+	_saved.resize(_slotCount);
+	for (unsigned int slot = 0; slot < _slotCount; slot++)
+	{
+		SessionRecord& record = _saved[slot];
+		bool isValid = record.marker == SessionRecord::markerValue && record.checksum == getChecksum(record)
+			&& record.nicknameLength <= SessionRecord::maxNicknameLength;
+		if (!isValid || !_slots.try_emplace(std::string(record.nickname, record.nicknameLength), slot).second)
+		{
+			record = {};
+			_freeSlots.push_back(slot);
+		}
+		// Без контрольной суммы запись совпадает со снимком битвы, пока битва не изменится.
+		record.checksum = 0;
+	}
+	_thread = std::thread(&SessionStore::runWriter, this);
+	return true;
+}
+
+// Назначает зрителю слот: его прежний, если зритель сохранён, иначе свободный. Если у слота есть запись
+// этого зрителя, она копируется в record. Вызывается только из потока сервера.
+bool SessionStore::load(std::string_view nickname, unsigned int& slot, SessionRecord& record)
+{
+	slot = noSlot;
+	if (_file < 0 || nickname.size() > SessionRecord::maxNicknameLength)
+		return false;
+	auto found = _slots.find(nickname);
+	if (found == _slots.end())
+	{
+		if (!_freeSlots.empty())
+		{
+			slot = _freeSlots.back();
+			_freeSlots.pop_back();
+		}
+		else
+			slot = _slotCount++;
+		_slots.try_emplace(std::string(nickname), slot);
+		return false;
+	}
+	slot = found->second;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		record = slot < _saved.size() ? _saved[slot] : SessionRecord{};
+	}
+	bool isValid = record.marker == SessionRecord::markerValue && std::string_view(record.nickname, record.nicknameLength) == nickname;
+	if (!isValid)
+		record = {};
+	return isValid;
+}
+
+// Ставит запись слота в пакет. Вызывается из воркеров и потока сервера.
+void SessionStore::save(unsigned int slot, const SessionRecord& record)
+{
+	if (slot == noSlot)
+		return;
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (slot >= _saved.size())
+		_saved.resize(slot + 1);
+	_saved[slot] = record;
+	if (slot >= _pendingPos.size())
+		_pendingPos.resize(slot + 1);
+	unsigned int& pos = _pendingPos[slot];
+	if (pos != 0)
+	{
+		_pending[pos - 1].record = record;
+		return;
+	}
+	_pending.push_back({ slot, record });
+	pos = _pending.size();
+	if (pos == 1)
+		_wake.notify_one();
+}
+
+// Зритель вышел из игры: его слот очищается и становится свободным. Вызывается только из потока сервера.
+void SessionStore::release(std::string_view nickname, unsigned int slot)
+{
+	if (slot == noSlot)
+		return;
+	auto found = _slots.find(nickname);
+	if (found != _slots.end() && found->second == slot)
+		_slots.erase(found);
+	_freeSlots.push_back(slot);
+	save(slot, SessionRecord{});
+}
+
+unsigned long long SessionStore::getRecordCount() const
+{
+	return _records.load(std::memory_order_relaxed);
+}
+
+unsigned long long SessionStore::getCommitCount() const
+{
+	return _commits.load(std::memory_order_relaxed);
+}
+
+// Поток записи: забирает весь накопившийся пакет, пишет записи по порядку слотов и завершает пакет одним fdatasync.
+void SessionStore::runWriter()
+{
+	std::vector<PendingRecord> batch;
+	std::chrono::steady_clock::time_point committed;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wake.wait(lock, [this] { return !_pending.empty() || _isStopping; });
+			_wake.wait_until(lock, committed + commitInterval, [this] { return _isStopping; });
+			if (_pending.empty())
+				return;
+			batch.swap(_pending);
+			for (const PendingRecord& pending: batch)
+				_pendingPos[pending.slot] = 0;
+		}
+		std::sort(batch.begin(), batch.end(), [](const PendingRecord& a, const PendingRecord& b) { return a.slot < b.slot; });
+		for (PendingRecord& pending: batch)
+		{
+			if (pending.record.marker != 0)
+				pending.record.checksum = getChecksum(pending.record);
+			if (pwrite(_file, &pending.record, sizeof(pending.record), (off_t)pending.slot * sizeof(pending.record)) != sizeof(pending.record))
+				std::cerr << "Не удалось сохранить сессию в слот " << pending.slot << std::endl;
+		}
+		fdatasync(_file);
+		committed = std::chrono::steady_clock::now();
+		_records.fetch_add(batch.size(), std::memory_order_relaxed);
+		_commits.fetch_add(1, std::memory_order_relaxed);
+		batch.clear();
+	}
+}
+
+// FNV-1a по всем байтам записи после самой суммы.
+unsigned int SessionStore::getChecksum(const SessionRecord& record)
+{
+	const unsigned char* bytes = (const unsigned char*)&record;
+	unsigned int hash = 2166136261u;
+	for (size_t i = sizeof(record.checksum); i < sizeof(record); i++)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	return hash;
+}
+
+// ------------< SessionScheduler >------------
+
+SessionScheduler::SessionScheduler(unsigned int workers) : _pending(0), _isStopping(false), _eventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+	_nextWorker(0), _steals(0)
+{
+	for (unsigned int i = 0; i < workers; i++)
+		_workers.push_back(std::make_unique<Worker>());
+	for (unsigned int i = 0; i < workers; i++)
+		_threads.emplace_back(&SessionScheduler::runWorker, this, i, Random::nextSeed());
+}
+
+SessionScheduler::~SessionScheduler()
+{
+	stop();
+	if (_eventFd >= 0)
+		close(_eventFd);
+}
+
+
+// Останавливает воркеров. Сессии, оставшиеся в очередях, не выполняются: сервер уже закрывается.
+// После остановки submit только ставит сессию в очередь.
+void SessionScheduler::stop()
+{
+	_isStopping = true;
+	for (std::unique_ptr<Worker>& worker: _workers)
+	{
+		std::lock_guard<std::mutex> lock(worker->mutex);
+		worker->wake.notify_one();
+	}
+	for (std::thread& thread: _threads)
+		thread.join();
+	_threads.clear();
+}
+
+
+int SessionScheduler::getEventFd() const
+{
+	return _eventFd;
+}
+
+unsigned int SessionScheduler::getWorkerCount() const
+{
+	return _workers.size();
+}
+
+unsigned long long SessionScheduler::getStealCount() const
+{
+	return _steals.load(std::memory_order_relaxed);
+}
+
+// Воркер для новой сессии - по кругу.
+unsigned int SessionScheduler::assignWorker()
+{
+	return _nextWorker++ % _workers.size();
+}
+
+// Ставит сессию в очередь её воркера. Сессия должна быть отмечена как isScheduled.
+void SessionScheduler::submit(ChatSession& session)
+{
+	Worker& worker = *_workers[session.worker];
+	bool isSleeping;
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.queue.push_back(&session);
+		_pending++;
+		isSleeping = worker.isSleeping;
+		if (isSleeping)
+			worker.wake.notify_one();
+	}
+	if (!isSleeping)
+		wakeIdle();
+}
+
+// Будит один спящий воркер, чтобы он украл сессию у занятого.
+void SessionScheduler::wakeIdle()
+{
+	for (std::unique_ptr<Worker>& worker: _workers)
+	{
+		std::lock_guard<std::mutex> lock(worker->mutex);
+		if (worker->isSleeping)
+		{
+			worker->wake.notify_one();
+			return;
+		}
+	}
+}
+
+// Забирает список выполненных сессий. Сначала гасится eventfd, потом берётся список, чтобы не потерять сигнал
+// о сессии, выполненной между этими шагами.
+void SessionScheduler::takeCompleted(std::vector<ChatSession*>& sessions)
+{
+	unsigned long long count;
+	while (read(_eventFd, &count, sizeof(count)) < 0 && errno == EINTR);
+	std::lock_guard<std::mutex> lock(_completedMutex);
+	sessions.swap(_completed);
+}
+
+// Генератор потока воркера заводится от зерна из генератора сервера: иначе все воркеры начинали бы
+// с одного и того же состояния, одинакового после каждого перезапуска.
+void SessionScheduler::runWorker(unsigned int ind, unsigned long long seed)
+{
+	Random::seed(seed);
+	Worker& worker = *_workers[ind];
+	// Буферы команд и вывода живут всё время воркера, чтобы не выделять память на каждую сессию. Команды
+	// копируются в них из сессии под её мьютексом и выполняются уже без него.
+	std::string commands, result;
+	while (!_isStopping)
+	{
+		ChatSession* session = take(ind);
+		if (session != nullptr)
+		{
+			runSession(*session, commands, result);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(worker.mutex);
+		while (worker.head == worker.queue.size() && _pending == 0 && !_isStopping)
+		{
+			worker.isSleeping = true;
+			worker.wake.wait(lock);
+			worker.isSleeping = false;
+		}
+	}
+}
+
+// Своя очередь берётся с головы, чужая - с хвоста, чтобы хозяин и вор реже сталкивались на одной сессии.
+ChatSession* SessionScheduler::take(unsigned int ind)
+{
+	ChatSession* session = nullptr;
+	{
+		Worker& worker = *_workers[ind];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		if (worker.head < worker.queue.size())
+			session = worker.queue[worker.head++];
+		if (worker.head == worker.queue.size())
+		{
+			worker.queue.clear();
+			worker.head = 0;
+		}
+	}
+	for (unsigned int i = 1; i < _workers.size() && session == nullptr; i++)
+	{
+		Worker& victim = *_workers[(ind + i) % _workers.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (victim.head < victim.queue.size())
+		{
+			session = victim.queue.back();
+			victim.queue.pop_back();
+			session->worker = ind;
+			_steals.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	if (session != nullptr)
+		_pending--;
+	return session;
+}
+
+// Выполняет команды сессии, пока они не кончатся. Вывод битвы на каждую команду склеивается в одну строку
+// через " | " и отдаётся серверу после каждой пачки команд.
+void SessionScheduler::runSession(ChatSession& session, std::string& commands, std::string& result)
+{
+	while (true)
+	{
+		{
+			std::lock_guard<std::mutex> lock(session.mutex);
+			if (!result.empty())
+				session.result.append(session.result.empty() ? "" : " | ").append(result);
+			result.clear();
+			session.isFinished = session.isClosed;
+			session.isInDuel = session.battle->isInDuel();
+			if (session.commands.empty())
+			{
+				complete(session);
+				session.isScheduled = false;
+				return;
+			}
+			commands.assign(session.commands);
+			session.commands.clear();
+		}
+
+		std::string_view input = commands;
+		size_t pos;
+		while ((pos = input.find('\n')) != std::string_view::npos)
+		{
+			session.isClosed = !session.battle->handleInput(input.substr(0, pos));
+			input.remove_prefix(pos + 1);
+
+			std::string_view output = session.output.view();
+			size_t end;
+			while ((end = output.find('\n')) != std::string_view::npos)
+			{
+				if (end > 0)
+					result.append(result.empty() ? "" : " | ").append(output.substr(0, end));
+				output.remove_prefix(end + 1);
+			}
+			session.output.str("");
+		}
+		commands.clear();
+		saveSession(session);
+	}
+}
+
+// Отдаёт сессию на сохранение, если её битва изменилась с прошлого сохранения. Вышедший зритель не сохраняется:
+// его слот освобождает сервер.
+void SessionScheduler::saveSession(ChatSession& session)
+{
+	if (session.store == nullptr || session.isClosed)
+		return;
+	SessionRecord record = {};
+	if (!session.battle->save(record) || std::memcmp(&record, &session.saved, sizeof(record)) == 0)
+		return;
+	session.saved = record;
+	session.store->save(session.slot, record);
+}
+
+// Отдаёт сессию серверу (вызывается под мьютексом сессии). Сессия попадает в список выполненных один раз,
+// а eventfd будится, только когда список был пуст.
+void SessionScheduler::complete(ChatSession& session)
+{
+	if (session.isCompleted)
+		return;
+	session.isCompleted = true;
+	bool wasEmpty;
+	{
+		std::lock_guard<std::mutex> lock(_completedMutex);
+		wasEmpty = _completed.empty();
+		_completed.push_back(&session);
+	}
+	unsigned long long count = 1;
+	if (wasEmpty)
+		while (write(_eventFd, &count, sizeof(count)) < 0 && errno == EINTR);
+}
+
+// ------------< ChatServer >------------
+
+size_t NicknameHash::operator()(std::string_view nickname) const
+{
+	return std::hash<std::string_view>()(nickname);
+}
+
+
+ChatServer::ChatServer(std::string channel, std::string nickname, std::string password, unsigned int messagesPer30s, unsigned int workers,
+	ReplayLog* replayLog, SessionStore* sessionStore)
+	: _channel(channel), _nickname(nickname), _password(password), _replayLog(replayLog), _sessionStore(sessionStore), _socket(-1), _epoll(-1), _readBuffer(readSize), _outputPos(0),
+	_isWaitingOutput(false), _matchmaker(), _swept(std::chrono::steady_clock::now()), _evicted(_swept), _scheduler(workers), _sendLimit(messagesPer30s, messagesPer30s / 30.0), _stats(), _shownStats(), _statsShown(std::chrono::steady_clock::now()),
+	_shownLatency(std::make_unique<LatencyTotals>())
+{
+	if (!_channel.empty() && _channel[0] != '#')
+		_channel = "#" + _channel;
+}
+
+// Сессии удаляются, пока планировщик ещё жив: битва, вышедшая из битвы с соперником, будит его сессию через schedule.
+ChatServer::~ChatServer()
+{
+	_scheduler.stop();
+	_sessions.clear();
+	if (_socket >= 0)
+		close(_socket);
+	if (_epoll >= 0)
+		close(_epoll);
+}
+
+
+bool ChatServer::connect(const char* host, const char* port)
+{
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* addresses;
+	if (getaddrinfo(host, port, &hints, &addresses) != 0)
+		return false;
+	for (addrinfo* address = addresses; address != nullptr && _socket < 0; address = address->ai_next)
+	{
+		_socket = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+		if (_socket >= 0 && ::connect(_socket, address->ai_addr, address->ai_addrlen) != 0)
+		{
+			close(_socket);
+			_socket = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+	if (_socket < 0)
+		return false;
+
+	fcntl(_socket, F_SETFL, fcntl(_socket, F_GETFL) | O_NONBLOCK);
+	_epoll = epoll_create1(0);
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = _socket;
+	if (_epoll < 0 || epoll_ctl(_epoll, EPOLL_CTL_ADD, _socket, &event) != 0)
+		return false;
+	event.data.fd = _scheduler.getEventFd();
+	if (epoll_ctl(_epoll, EPOLL_CTL_ADD, _scheduler.getEventFd(), &event) != 0)
+		return false;
+
+	if (!_password.empty())
+		send("PASS", _password);
+	send("NICK", _nickname);
+	send("JOIN", _channel);
+	return writeOutput();
+}
+
+// Цикл обработки событий сокета. Завершается, когда сервер закрыл соединение.
+void ChatServer::run()
+{
+	epoll_event events[8];
+	while (true)
+	{
+		int count = epoll_wait(_epoll, events, 8, getTimeout(std::chrono::steady_clock::now()));
+		if (count < 0 && errno != EINTR)
+			return;
+		for (int i = 0; i < count; i++)
+		{
+			if (events[i].data.fd == _scheduler.getEventFd())
+			{
+				handleCompleted();
+				continue;
+			}
+			if ((events[i].events & EPOLLIN) && !readInput())
+				return;
+			if (events[i].events & (EPOLLERR | EPOLLHUP))
+				return;
+		}
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now >= _swept + Matchmaker::sweepInterval)
+		{
+			_matchmaker.sweep(now);
+			_swept = now;
+		}
+		if (now >= _evicted + evictInterval)
+		{
+			evictIdle(now);
+			_evicted = now;
+		}
+		flushReplies(now);
+		showStats(now);
+		if (LatencyStats::takeDumpRequest())
+		{
+			LatencyTotals totals;
+			LatencyStats::collect(totals);
+			std::cerr << "Задержки с запуска сервера:" << "\n";
+			LatencyStats::show(totals, std::cerr);
+			std::cerr << std::flush;
+		}
+		if (!writeOutput())
+			return;
+	}
+}
+
+unsigned int ChatServer::getSessionCount() const
+{
+	return _sessions.size();
+}
+
+
+// Читает всё, что есть в сокете, и разбирает полные строки. Возвращает false, если соединение закрыто.
+bool ChatServer::readInput()
+{
+	while (true)
+	{
+		ssize_t count = recv(_socket, _readBuffer.data(), readSize, 0);
+		if (count > 0)
+			_input.append(_readBuffer.data(), count);
+		if (count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			return false;
+		if (count < 0)
+			break;
+	}
+
+	std::string_view input = _input;
+	size_t pos;
+	while ((pos = input.find('\n')) != std::string_view::npos)
+	{
+		std::string_view line = input.substr(0, pos);
+		if (!line.empty() && line.back() == '\r')
+			line.remove_suffix(1);
+		handleLine(line);
+		input.remove_prefix(pos + 1);
+	}
+	// Слишком длинная строка без конца - мусор, а не IRC.
+	if (input.size() > maxLineLength)
+		input = {};
+	_input.erase(0, _input.size() - input.size());
+	return true;
+}
+
+// Отправляет накопленный вывод, сколько примет сокет; остаток ждёт EPOLLOUT.
+bool ChatServer::writeOutput()
+{
+	while (_outputPos < _output.size())
+	{
+		ssize_t count = ::send(_socket, _output.data() + _outputPos, _output.size() - _outputPos, MSG_NOSIGNAL);
+		if (count < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return false;
+			setWaitingOutput(true);
+			return true;
+		}
+		_outputPos += count;
+	}
+	_output.clear();
+	_outputPos = 0;
+	setWaitingOutput(false);
+	return true;
+}
+
+// Строка IRC: [@теги] [:префикс] команда параметры [:последний параметр].
+void ChatServer::handleLine(std::string_view line)
+{
+	if (!line.empty() && line[0] == '@')
+		line.remove_prefix(std::min(line.find(' '), line.size() - 1) + 1);
+	std::string_view prefix;
+	if (!line.empty() && line[0] == ':')
+	{
+		size_t pos = std::min(line.find(' '), line.size());
+		prefix = line.substr(1, pos - 1);
+		line.remove_prefix(std::min(pos + 1, line.size()));
+	}
+	size_t pos = std::min(line.find(' '), line.size());
+	std::string_view command = line.substr(0, pos), params = line.substr(std::min(pos + 1, line.size()));
+
+	if (command == "PING")
+		send("PONG", params);
+	else if (command == "PRIVMSG")
+	{
+		size_t textPos = params.find(" :");
+		if (textPos != std::string_view::npos)
+			handleMessage(prefix.substr(0, prefix.find('!')), params.substr(textPos + 2));
+	}
+}
+
+// Команда зрителя уходит в его сессию. Если сессия не ждёт воркера и не выполняется, она ставится в очередь.
+void ChatServer::handleMessage(std::string_view nickname, std::string_view text)
+{
+	if (!Command::isCommand(text) || Command(text).getKeyword() == Keyword::None || nickname.empty())
+		return;
+	_stats.received++;
+
+	auto found = _sessions.find(nickname);
+	if (found == _sessions.end())
+	{
+		found = _sessions.try_emplace(std::string(nickname)).first;
+		ChatSession& session = found->second;
+		std::string output;
+		output.reserve(ChatSession::outputReserve);
+		session.output.str(std::move(output));
+		session.battle = std::make_unique<GreatBattle>(found->first, session.output);
+		session.battle->setReplayLog(_replayLog);
+		session.battle->setMatchmaker(&_matchmaker, [this, &session] { schedule(session, GreatBattle::wakeLine); });
+		session.battle->setFeed(&session.feed);
+		session.worker = _scheduler.assignWorker();
+		session.nickname = found->first;
+		session.store = _sessionStore;
+		if (_sessionStore->load(session.nickname, session.slot, session.saved))
+			session.battle->restore(session.saved);
+	}
+	ChatSession& session = found->second;
+	session.active = std::chrono::steady_clock::now();
+	if (!session.isWaiting)
+	{
+		session.received = session.active;
+		session.isWaiting = true;
+	}
+	Command command(text);
+	if (command.getKeyword() == Keyword::Battle && command.getArgKeyword(0) == Keyword::Watch)
+		watch(session, command.getArg(1));
+	else
+		schedule(session, text);
+}
+
+// Добавляет строку в команды сессии и ставит сессию воркеру, если она не ждёт и не выполняется.
+// Вызывается и из воркеров: так битва будит битву соперника.
+void ChatServer::schedule(ChatSession& session, std::string_view line)
+{
+	bool isIdle;
+	{
+		std::lock_guard<std::mutex> lock(session.mutex);
+		session.commands.append(line).push_back('\n');
+		isIdle = !session.isScheduled;
+		session.isScheduled = true;
+	}
+	if (isIdle)
+		_scheduler.submit(session);
+}
+
+// Подписывает зрителя на трансляцию битвы другого зрителя (пустой ник - отписывает). Трансляция идёт с
+// следующего хода.
+void ChatServer::watch(ChatSession& session, std::string_view nickname)
+{
+	unwatch(session);
+	if (!nickname.empty() && nickname[0] == '@')
+		nickname.remove_prefix(1);
+	auto found = _sessions.find(nickname);
+	if (nickname.empty())
+		addReply(session, { "Трансляция выключена." });
+	else if (found == _sessions.end() || &found->second == &session)
+		addReply(session, { "Зритель ", nickname, " сейчас не сражается." });
+	else
+	{
+		ChatSession& target = found->second;
+		target.spectators.push_back(&session);
+		target.feed.addSpectator();
+		session.watched = &target;
+		session.watchPos = target.feed.getEnd();
+		session.watchSkipped = 0;
+		addReply(session, { "Вы смотрите битву ", target.nickname, "." });
+	}
+	queueReply(session);
+}
+
+// Дописывает строку из частей в ответ зрителю. Ответ - в пуле сессии, поэтому под её мьютексом.
+void ChatServer::addReply(ChatSession& session, std::initializer_list<std::string_view> parts)
+{
+	std::lock_guard<std::mutex> lock(session.mutex);
+	if (!session.reply.empty())
+		session.reply.append(" | ");
+	for (std::string_view part: parts)
+		session.reply.append(part);
+}
+
+void ChatServer::unwatch(ChatSession& session)
+{
+	if (session.watched == nullptr)
+		return;
+	std::vector<ChatSession*>& spectators = session.watched->spectators;
+	spectators.erase(std::find(spectators.begin(), spectators.end(), &session));
+	session.watched->feed.removeSpectator();
+	session.watched = nullptr;
+}
+
+// Забирает вывод выполненных сессий в ответы зрителям. Зрители трансляции, у которых появились новые ходы,
+// только встают в очередь ответов: сами ходы берутся из трансляции при сборке сообщения.
+void ChatServer::handleCompleted()
+{
+	_scheduler.takeCompleted(_completed);
+	for (ChatSession* session: _completed)
+	{
+		if (!session->spectators.empty())
+		{
+			unsigned long long end = session->feed.getEnd();
+			for (ChatSession* spectator: session->spectators)
+				if (spectator->watchPos < end)
+					queueReply(*spectator);
+		}
+		bool isFinished;
+		{
+			std::lock_guard<std::mutex> lock(session->mutex);
+			session->isCompleted = false;
+			if (!session->result.empty())
+				session->reply.append(session->reply.empty() ? "" : " | ").append(session->result);
+			session->result.clear();
+			isFinished = session->isFinished;
+		}
+		if (!session->reply.empty())
+			queueReply(*session);
+		else if (isFinished)
+			tryRemove(*session);
+	}
+	_completed.clear();
+}
+
+// Удаляет сессию вышедшего зрителя, если её не держат ни воркер, ни список выполненных, ни очередь ответов.
+bool ChatServer::tryRemove(ChatSession& session)
+{
+	if (session.isQueued)
+		return false;
+	{
+		std::lock_guard<std::mutex> lock(session.mutex);
+		if (!session.isFinished || session.isScheduled || session.isCompleted)
+			return false;
+	}
+	_sessionStore->release(session.nickname, session.slot);
+	remove(session);
+	return true;
+}
+
+// Выгружает сессии зрителей, молчащих дольше idleTimeout.
+void ChatServer::evictIdle(std::chrono::steady_clock::time_point now)
+{
+	for (auto it = _sessions.begin(); it != _sessions.end(); )
+	{
+		ChatSession& session = (it++)->second;
+		if (now - session.active >= idleTimeout && tryEvict(session))
+			_stats.evicted++;
+	}
+}
+
+// Сохраняет битву сессии и удаляет сессию из памяти, оставляя зрителю его слот: следующее сообщение прочитает битву
+// из сохранения. Сессию не трогаем, пока её держат воркер, список выполненных или очередь ответов, и пока битва
+// стоит в подборе или идёт с соперником. Всё это проверяется под мьютексом сессии: битву вне подбора ставит воркеру
+// только сам сервер, так что после проверки сессия останется свободной и без мьютекса.
+bool ChatServer::tryEvict(ChatSession& session)
+{
+	if (session.isQueued)
+		return false;
+	{
+		std::lock_guard<std::mutex> lock(session.mutex);
+		if (session.isFinished || session.isScheduled || session.isCompleted || session.isInDuel)
+			return false;
+	}
+	SessionRecord record = {};
+	if (session.battle->save(record) && std::memcmp(&record, &session.saved, sizeof(record)) != 0)
+		_sessionStore->save(session.slot, record);
+	remove(session);
+	return true;
+}
+
+// Удаляет сессию из таблицы: отписывает её от трансляции, которую она смотрела, и сообщает её зрителям,
+// что трансляция окончена.
+void ChatServer::remove(ChatSession& session)
+{
+	unwatch(session);
+	for (ChatSession* spectator: session.spectators)
+	{
+		spectator->watched = nullptr;
+		addReply(*spectator, { "Трансляция битвы ", session.nickname, " окончена." });
+		queueReply(*spectator);
+	}
+	_sessions.erase(_sessions.find(session.nickname));
+}
+
+void ChatServer::queueReply(ChatSession& session)
+{
+	if (session.isQueued)
+		return;
+	session.isQueued = true;
+	_replyQueue.push_back(session.nickname);
+}
+
+// Собирает ответы из очереди в сообщения чата и отправляет их, пока позволяет ограничитель частоты.
+void ChatServer::flushReplies(std::chrono::steady_clock::time_point now)
+{
+	while (!_replyQueue.empty() && _sendLimit.take(now))
+	{
+		_message.clear();
+		while (!_replyQueue.empty())
+		{
+			auto found = _sessions.find(_replyQueue.front());
+			if (!packReply(found->second, found->first, now))
+				break;
+			_replyQueue.pop_front();
+			found->second.isQueued = false;
+			tryRemove(found->second);
+		}
+		if (_message.empty())
+			continue;
+		send("PRIVMSG", _channel, _message);
+		_stats.messages++;
+	}
+}
+
+// Дописывает ответ зрителя в собираемое сообщение. Если ответ не влезает целиком, в пустое сообщение идёт
+// его начало (по границе строки вывода или символа), а остаток ждёт следующего сообщения. Возвращает,
+// ушёл ли ответ целиком.
+bool ChatServer::packReply(ChatSession& session, std::string_view nickname, std::chrono::steady_clock::time_point now)
+{
+	if (session.reply.empty())
+		return packFeed(session, nickname);
+	size_t length = (_message.empty() ? 0 : 3) + 1 + nickname.size() + 1;
+	if (length + session.reply.size() > maxMessageLength)
+	{
+		if (length >= maxMessageLength)
+		{
+			session.reply.clear();
+			return true;
+		}
+		if (!_message.empty())
+			return false;
+		size_t cut = session.reply.rfind(" | ", maxMessageLength - length);
+		if (cut == std::string::npos || cut == 0)
+		{
+			cut = maxMessageLength - length;
+			while (cut > 0 && ((unsigned char)session.reply[cut] & 0xC0) == 0x80)
+				cut--;
+		}
+		_message.append("@").append(nickname).append(" ").append(session.reply, 0, cut);
+		session.reply.erase(0, cut + (session.reply.compare(cut, 3, " | ") == 0 ? 3 : 0));
+		return false;
+	}
+
+	_message.append(_message.empty() ? "" : " // ").append("@").append(nickname).append(" ").append(session.reply);
+	session.reply.clear();
+	// Ответ только на ход соперника (без сообщения зрителя) в задержку не входит.
+	if (!session.isWaiting)
+		return packFeed(session, nickname);
+	session.isWaiting = false;
+	std::chrono::steady_clock::duration delay = now - session.received;
+	_stats.replies++;
+	_stats.totalDelay += delay;
+	_stats.maxDelay = std::max(_stats.maxDelay, delay);
+	if (LatencyStats::isEnabled())
+		LatencyStats::record(LatencyPoint::Reply, delay);
+	return packFeed(session, nickname);
+}
+
+// Дописывает в собираемое сообщение новые ходы трансляции, которую смотрит зритель. Ход копируется из трансляции
+// в переиспользуемый буфер сервера и оттуда в сообщение. Отставшему зрителю старые ходы не достаются - вместо них
+// пометка о пропуске. Возвращает, ушли ли все ходы.
+bool ChatServer::packFeed(ChatSession& session, std::string_view nickname)
+{
+	if (session.watched == nullptr)
+		return true;
+	unsigned long long skipped;
+	while (session.watched->feed.read(session.watchPos, skipped, _feedText))
+	{
+		session.watchSkipped += skipped;
+		std::string_view note = session.watchSkipped > 0 ? "(часть ходов пропущена) " : "";
+		size_t length = (_message.empty() ? 0 : 4) + 1 + nickname.size() + 1 + note.size();
+		size_t size = _feedText.size();
+		if (length + size > maxMessageLength)
+		{
+			if (!_message.empty() && length < maxMessageLength)
+				return false;
+			size = length < maxMessageLength ? maxMessageLength - length : 0;
+			while (size > 0 && ((unsigned char)_feedText[size] & 0xC0) == 0x80)
+				size--;
+		}
+		_message.append(_message.empty() ? "" : " // ").append("@").append(nickname).append(" ").append(note)
+			.append(_feedText, 0, size);
+		session.watchPos++;
+		session.watchSkipped = 0;
+	}
+	return true;
+}
+
+// Строка протокола IRC. text, если он есть, идёт последним параметром после " :" и может содержать пробелы.
+void ChatServer::send(std::string_view command, std::string_view argument, std::string_view text)
+{
+	_output.append(command).append(" ").append(argument);
+	if (!text.empty())
+		_output.append(" :").append(text);
+	_output.append("\r\n");
+}
+
+void ChatServer::setWaitingOutput(bool isWaiting)
+{
+	if (_isWaitingOutput == isWaiting)
+		return;
+	_isWaitingOutput = isWaiting;
+	epoll_event event = {};
+	event.events = isWaiting ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	event.data.fd = _socket;
+	epoll_ctl(_epoll, EPOLL_CTL_MOD, _socket, &event);
+}
+
+// Сколько миллисекунд ждать событий сокета: до следующего жетона, если есть неотправленные ответы, и до вывода статистики.
+int ChatServer::getTimeout(std::chrono::steady_clock::time_point now)
+{
+	std::chrono::steady_clock::duration wait = std::min(_statsShown + statsInterval, _swept + Matchmaker::sweepInterval) - now;
+	if (!_replyQueue.empty())
+		wait = std::min(wait, _sendLimit.getWaitTime(now));
+	return std::max(0, (int)std::chrono::ceil<std::chrono::milliseconds>(wait).count());
+}
+
+// Раз в statsInterval выводит в stderr, сколько сообщений пришло и ушло и какова задержка ответов и участков хода за это время,
+// сбрасывает на диск журнал битв и переписывает файл статистики карт.
+void ChatServer::showStats(std::chrono::steady_clock::time_point now)
+{
+	if (now < _statsShown + statsInterval)
+		return;
+	_replayLog->flush();
+	if (!CardStats::writePrometheus(metricsPath))
+		std::cerr << "Не удалось записать статистику карт в " << metricsPath << std::endl;
+	unsigned long long replies = _stats.replies - _shownStats.replies;
+	if (_stats.received != _shownStats.received || replies > 0)
+	{
+		double averageDelay = replies > 0 ? std::chrono::duration<double, std::milli>(_stats.totalDelay - _shownStats.totalDelay).count() / replies : 0;
+		std::cerr << "Сессий: " << _sessions.size() << ", команд: " << _stats.received - _shownStats.received
+			<< ", ответов: " << replies << " в " << _stats.messages - _shownStats.messages << " сообщениях"
+			<< ", в очереди: " << _replyQueue.size() << ", воркеров: " << _scheduler.getWorkerCount()
+			<< ", краж сессий: " << _scheduler.getStealCount() << ", выгружено молчащих: " << _stats.evicted - _shownStats.evicted
+			<< ", битв зрителей: " << _matchmaker.getMatchCount() << " (соперник не нашёлся: " << _matchmaker.getTimeoutCount() << ")"
+			<< ", задержка ответа: средняя " << averageDelay << " мс, максимальная "
+			<< std::chrono::duration<double, std::milli>(_stats.maxDelay).count() << " мс"
+			<< ", память битвы: наибольший расход " << BattleArena::getMaxUsed() << " байт (не влезли в буфер: " << BattleArena::getOverflowCount() << ")"
+			<< ", сохранено сессий: " << _sessionStore->getRecordCount() << " за " << _sessionStore->getCommitCount() << " fdatasync" << "\n";
+		std::unique_ptr<LatencyTotals> latency = std::make_unique<LatencyTotals>();
+		LatencyStats::collect(*latency);
+		LatencyStats::show(*latency - *_shownLatency, std::cerr);
+		std::cerr << std::flush;
+		_shownLatency = std::move(latency);
+	}
+	_shownStats = _stats;
+	_stats.maxDelay = {};
+	_statsShown = now;
+}
+#endif
+
+// ------------< Card >------------
+
+constexpr Card::Card() : _type(CardType::Common), _name("???"), _description("Вы забудете о моём существовании."),
+_move(nullptr), _nextMove(nullptr), _delay(1), _duration(1) {}
+
+constexpr Card::Card(CardType type, std::string_view name, std::string_view description, MoveFunc move, MoveFunc nextMove,
+	unsigned int delay, unsigned int duration) :
+	_type(type), _name(name), _description(description), _move(move), _nextMove(nextMove), _delay(delay), _duration(duration) {}
+
+
+constexpr CardType Card::getType() const
+{
+	return _type;
+}
+
+constexpr std::string_view Card::getName() const
+{
+	return _name;
+}
+
+constexpr std::string_view Card::getDescription() const
+{
+	return _description;
+}
+
+constexpr bool Card::hasNextMove() const
+{
+	return _nextMove != nullptr;
+}
+
+constexpr unsigned int Card::getDelay() const
+{
+	return _delay;
+}
+
+constexpr unsigned int Card::getDuration() const
+{
+	return _duration;
+}
+
+
+void Card::move(Player& player, Player& enemy) const
+{
+	if (_move)
+		_move(player, enemy);
+}
+
+void Card::nextMove(Player& player, Player& enemy) const
+{
+	if (_nextMove)
+		_nextMove(player, enemy);
+}
+
+// ------------< CardManager >------------
+
+// Все карты Великой битвы. ID карты - её номер в таблице, начиная с 1.
+constexpr Card CardManager::_availableCards[] =
+{
+	// Эпические карты.
+	Card(CardType::Epic, "Конструктор Парадоксов (Посох Мудреца)",
+		"Наносит случайным образом 4 ед. урона вам, противнику или обоим сразу.",
+		[](Player& p, Player& e)
+		{
+			int d3 = Random::next(3);
+			switch (d3)
+			{
+			case 0:
+				p.damage(4);
+				break;
+			case 1:
+				e.damage(4);
+				break;
+			case 2:
+				p.damage(4);
+				e.damage(4);
+				break;
+			}
+		},
+		nullptr
+		),
+	Card(CardType::Epic, "Курохай (Катана Изаму)",
+		"Наносит противнику 1 ед. урона и еще 2 ед. урона на следующий ход.",
+		[](Player& p, Player& e)
+		{
+			e.damage(1);
+		},
+		[](Player& p, Player& e)
+		{
+			e.damage(2);
+		}
+	),
+	Card(CardType::Epic, "Меч Земли (Клинок Трискелиона)",
+		"Наносит 2 ед. урона и добавляет вам 1 жизнь.",
+		[](Player& p, Player& e)
+		{
+			e.damage(2);
+			p.heal(1);
+		},
+		nullptr
+	),
+	Card(CardType::Epic, "Меч Небес (Клинок Трискелиона)",
+		"Наносит случайным образом 1, 2 или 3 ед. урона.",
+		[](Player& p, Player& e)
+		{
+			e.damage(Random::next(3) + 1);
+		},
+		nullptr
+	),
+	Card(CardType::Epic, "Меч Морей (Клинок Трискелиона)",
+		"Наносит 2 ед. урона, противник пропускает ход.",
+		[](Player& p, Player& e)
+		{
+			e.damage(2);
+			p.addExtraMoves(1);
+		},
+		nullptr
+	),
+	Card(CardType::Epic, "Алое Пламя (Перстень Зариака)",
+		"В следующий ход нанесет 2 ед. урона противнику.",
+		nullptr,
+		[](Player& p, Player& e)
+		{
+			e.damage(2);
+		}
+	),
+	Card(CardType::Epic, "Доспех Чёрной Розы (Броня Лорда Рейвена)",
+		"Добавляет вам 2 жизни.",
+		[](Player& p, Player& e)
+		{
+			p.heal(2);
+		},
+		nullptr
+	),
+	Card(CardType::Epic, "Яропламень (Меч Князя Велемира)",
+		"Наносит 3 ед. урона.",
+		[](Player& p, Player& e)
+		{
+			e.damage(3);
+		},
+		nullptr
+	),
+	Card(CardType::Epic, "Глаз Суккуба (Амулет Мизерис)",
+		"Противник пропускает 2 хода.",
+		[](Player& p, Player& e)
+		{
+			p.addExtraMoves(2);
+		},
+		nullptr
+	),
+
+	// Обычные карты.
+	Card(CardType::Common, "Алмазный меч", "Наносит 1 ед. урона.",
+		[](Player& p, Player& e) { e.damage(1); }, nullptr),
+	Card(CardType::Common, "Рунический щит", "Добавляет 2 жизни.",
+		[](Player& p, Player& e) { p.heal(2); }, nullptr),
+	Card(CardType::Common, "Костяной лук", "Наносит 1 или 2 ед. урона.",
+		[](Player& p, Player& e) { e.damage(Random::next(2) + 1); }, nullptr),
+	Card(CardType::Common, "Зелье лечения", "Восстанавливает 1 жизнь.",
+		[](Player& p, Player& e) { p.heal(1); }, nullptr),
+	Card(CardType::Common, "Зелье регенерации", "Восстанавливает 1 жизнь в следующий ваш ход.",
+		nullptr, [](Player& p, Player& e) { p.heal(1); }),
+	Card(CardType::Common, "TNT", "Наносит вам и противнику 3 ед. урона.",
+		[](Player& p, Player& e) { p.damage(3); e.damage(3); }, nullptr),
+	Card(CardType::Common, "Деревянный топор", "С вероятность 30% наносит 1 ед. урона.",
+		[](Player& p, Player& e) { if (Random::next(10) < 3) e.damage(1); }, nullptr),
+	Card(CardType::Common, "MRU-пушка", "Наносит 3 ед. урона.",
+		[](Player& p, Player& e) { e.damage(3); }, nullptr),
+	Card(CardType::Common, "Бумеранг", "Наносит 1 ед. урона, предмет не теряется после использования.",
+		[](Player& p, Player& e) { e.damage(1); p.addNewCard(CardManager::boomerangID); }, nullptr),
+	Card(CardType::Common, "Алмазная броня", "Добавляет 1 жизнь.",
+		[](Player& p, Player& e) { p.heal(1); }, nullptr),
+	Card(CardType::Common, "Ведро лавы", "Наносит вам и противнику 1 ед. урона.",
+		[](Player& p, Player& e) { p.damage(1); e.damage(1); }, nullptr),
+	Card(CardType::Common, "Хитрый механизм", "Вы или противник пропускает ход, определяется случайным образом.",
+		[](Player& p, Player& e) { if (Random::next(2) == 0) p.addExtraMoves(1); else e.addExtraMoves(1); }, nullptr),
+	Card(CardType::Common, "Блок булыжника", "Ничего не делает, просто занимает место и пропадает при использовании.",
+		nullptr, nullptr),
+	Card(CardType::Common, "Ихориевый меч", "Наносит 4 ед. урона.",
+		[](Player& p, Player& e) { e.damage(4); }, nullptr),
+	Card(CardType::Common, "Золотой меч", "Наносит 1 ед урона с вероятностью в 50%.",
+		[](Player& p, Player& e) { if (Random::next(2) == 0) e.damage(1); }, nullptr),
+	Card(CardType::Common, "Посох тауматурга", "Наносит 2 ед. урона.",
+		[](Player& p, Player& e) { e.damage(2); }, nullptr),
+	Card(CardType::Common, "Кровавый меч", "Наносит 1 ед урона и восстанавливает вам 1 жизнь.",
+		[](Player& p, Player& e) { e.damage(1); p.heal(1); }, nullptr),
+	Card(CardType::Common, "Жертвенный кинжал", "Наносит вам 1 ед. урона.",
+		[](Player& p, Player& e) { p.damage(1); }, nullptr),
+	Card(CardType::Common, "Снежок", "Противник пропускает ход, с 50% вероятности наносит 1 ед. урона.",
+		[](Player& p, Player& e) { p.addExtraMoves(1); if (Random::next(2) == 0) e.damage(1); }, nullptr),
+	Card(CardType::Common, "Взрывное зелье исцеления", "Восстанавливает вам и противнику 1 ед. здоровья.",
+		[](Player& p, Player& e) { p.heal(1); e.heal(1); }, nullptr),
+	Card(CardType::Common, "Верстак", "Вы получаете две карты.",
+		[](Player& p, Player& e) { p.drawCard(); p.drawCard(); }, nullptr),
+
+	Card(CardType::Common, "Взрывное зелье отравления", "Наносит 1 ед. урона вам и противнику в следующий ваш ход.",
+		nullptr, [](Player& p, Player& e) { p.damage(1); e.damage(1); }),
+	Card(CardType::Common, "Взрывное зелье урона", "Наносит вам и противнику 1 ед. урона.",
+		[](Player& p, Player& e) { p.damage(1); e.damage(1); }, nullptr),
+	Card(CardType::Common, "Варочная стойка", "Даёт два случайных зелья.",
+		[](Player& p, Player& e)
+		{
+			p.addNewCard(CardManager::potionIDs[Random::next(std::size(CardManager::potionIDs))]);
+			p.addNewCard(CardManager::potionIDs[Random::next(std::size(CardManager::potionIDs))]);
+		}, nullptr),
+
+	// Карты игрока.
+	Card(CardType::Player, "Непонятная ерунда", "Активирует эффект случайного предмета.",
+		[](Player& p, Player& e)
+		{
+			p.applyCard(e, p.getDeck().getRandomID(false));
+		}, nullptr),
+
+	// Карты Botbder'а.
+	Card(CardType::Botbder, "Краш", "Игрок пропускает ход и получает 1 ед. урона.",
+		[](Player& p, Player& e) { p.addExtraMoves(1); e.damage(1); }, nullptr),
+	Card(CardType::Botbder, "ID-конфликт", "Заменяет игроку один предмет на другой случайный.",
+		[](Player& p, Player& e) { e.generateIDConflict(); }, nullptr),
+	Card(CardType::Botbder, "Дисконнект", "Игрок пропускает два хода.",
+		[](Player& p, Player& e) { p.addExtraMoves(2); }, nullptr),
+};
+
+constexpr Card CardManager::_unknownCard;
+
+constexpr const Card& CardManager::getCardByID(unsigned int id)
+{
+	if (1 <= id && id <= std::size(_availableCards))
+		return _availableCards[id - 1];
+	return _unknownCard;
+}
+
+constexpr unsigned int CardManager::getAllCardsCount()
+{
+	return std::size(_availableCards);
+}
+
+const DrawTable& CardManager::getDrawTable(bool isBotbder)
+{
+	return _drawTables[isBotbder];
+}
+
+constexpr unsigned long long CardManager::getEpicMask()
+{
+	unsigned long long mask = 0;
+	for (unsigned int id = 1; id <= getAllCardsCount(); id++)
+		if (getCardByID(id).getType() == CardType::Epic)
+			mask |= 1ull << id;
+	return mask;
+}
+
+constexpr DrawTable CardManager::makeDrawTable(bool isBotbder)
+{
+	DrawTable table = {};
+	for (unsigned int id = 1; id <= getAllCardsCount(); id++)
+	{
+		CardType type = getCardByID(id).getType();
+		if (type == CardType::Common || type == (isBotbder ? CardType::Botbder : CardType::Player))
+			table.ids[table.size++] = id;
+	}
+	return table;
+}
+
+constexpr DrawTable CardManager::_drawTables[2] = { makeDrawTable(false), makeDrawTable(true) };
+
+// Карты, выдающие другие карты по ID, должны ссылаться на то, что задумано.
+static_assert(CardManager::getAllCardsCount() < 64, "ID карт должны помещаться в маску колоды");
+static_assert(CardManager::getCardByID(CardManager::boomerangID).getName() == "Бумеранг");
+static_assert(CardManager::getCardByID(CardManager::potionIDs[0]).getName() == "Зелье лечения");
+static_assert(CardManager::getCardByID(CardManager::potionIDs[1]).getName() == "Зелье регенерации");
+static_assert(CardManager::getCardByID(CardManager::potionIDs[2]).getName() == "Взрывное зелье исцеления");
+static_assert(CardManager::getCardByID(CardManager::potionIDs[3]).getName() == "Взрывное зелье отравления");
+static_assert(CardManager::getCardByID(CardManager::potionIDs[4]).getName() == "Взрывное зелье урона");
+static_assert([]
+{
+	for (unsigned int id = 1; id <= CardManager::getAllCardsCount(); id++)
+	{
+		const Card& card = CardManager::getCardByID(id);
+		if (card.getDelay() == 0 || card.getDelay() >= EffectWheel::size || card.getDuration() == 0)
+			return false;
+	}
+	return true;
+}(), "Отложенный эффект должен срабатывать не раньше следующего хода и помещаться в колесо эффектов");
+// Раскладка PlayerRecord: число эффектов в ячейке колеса - 2 бита, ячейки колеса - в одном байте,
+// эффект - байт из ID карты (6 бит) и оставшихся ходов (2 бита).
+static_assert(EffectWheel::slotCapacity <= 3 && EffectWheel::size <= 4, "Колесо эффектов должно помещаться в effectCounts записи игрока");
+static_assert([]
+{
+	for (unsigned int id = 1; id <= CardManager::getAllCardsCount(); id++)
+		if (CardManager::getCardByID(id).getDuration() > 3)
+			return false;
+	return true;
+}(), "Длительность отложенного эффекта должна помещаться в 2 бита записи игрока");
+
+// ------------< CardStats >------------
+
+std::mutex CardStats::_mutex;
+std::vector<std::unique_ptr<CardStatsBlock>> CardStats::_blocks;
+thread_local CardStatsBlock* CardStats::_block = nullptr;
+thread_local bool CardStats::_isEnabled = false;
+thread_local unsigned int CardStats::_health = 0;
+thread_local unsigned int CardStats::_enemyHealth = 0;
+thread_local unsigned int CardStats::_extraMoves = 0;
+
+bool CardStats::isEnabled()
+{
+	return _isEnabled;
+}
+
+void CardStats::setEnabled(bool isEnabled)
+{
+	_isEnabled = isEnabled;
+}
+
+// Блок потока заводится при первом счёте. Мьютекс берётся только здесь и при сборе суммы.
+CardStatsBlock& CardStats::getBlock()
+{
+	if (_block == nullptr)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_blocks.push_back(std::make_unique<CardStatsBlock>());
+		_block = _blocks.back().get();
+	}
+	return *_block;
+}
+
+// Счётчик пишет только его поток, поэтому хватает обычных чтения и записи без атомарного сложения.
+void CardStats::add(std::atomic<unsigned long long>& counter, unsigned long long value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void CardStats::startTurn(const Player& player, const Player& enemy)
+{
+	_health = player.getHealth();
+	_enemyHealth = enemy.getHealth();
+	_extraMoves = player.getExtraMovesCount();
+}
+
+// Считает действие карты id (её хода или отложенного эффекта) по тому, как изменились жизни и ходы игроков
+// с прошлого посчитанного действия. Карта, сыгранная через другую (Непонятная ерунда), считается раньше неё,
+// так что её эффект не приписывается обеим.
+void CardStats::countEffect(unsigned int id, bool isDelayed, const Player& player, const Player& enemy)
+{
+	CardCounters& counters = getBlock().cards[id];
+	add(isDelayed ? counters.delayed : counters.plays, 1);
+	if (enemy.getHealth() < _enemyHealth)
+		add(counters.damage, _enemyHealth - enemy.getHealth());
+	if (player.getHealth() < _health)
+		add(counters.selfDamage, _health - player.getHealth());
+	else if (player.getHealth() > _health)
+		add(counters.heal, player.getHealth() - _health);
+	if (player.getExtraMovesCount() > _extraMoves)
+		add(counters.extraMoves, player.getExtraMovesCount() - _extraMoves);
+	startTurn(player, enemy);
+}
+
+// Исход битвы и карты, оставшиеся в руках.
+void CardStats::countOutcome(BattleOutcome outcome, const Player& you, const Player& botbder)
+{
+	CardStatsBlock& block = getBlock();
+	add(block.outcomes[(unsigned int)outcome], 1);
+	countHands(block, outcome, you, botbder);
+}
+
+// Исход битвы зрителей между собой (outcome - для первой стороны). В исходы битв с Botbder'ом она не входит,
+// а руки считаются так же.
+void CardStats::countDuelOutcome(BattleOutcome outcome, const Player& first, const Player& second)
+{
+	CardStatsBlock& block = getBlock();
+	add(block.duels, 1);
+	countHands(block, outcome, first, second);
+}
+
+// Карты в руках к концу битвы. При взаимном поражении обе руки считаются проигравшими.
+void CardStats::countHands(CardStatsBlock& block, BattleOutcome outcome, const Player& you, const Player& enemy)
+{
+	for (unsigned int i = 0; i < you.getCardCount(); i++)
+	{
+		CardCounters& counters = block.cards[you.getCardID(i)];
+		add(outcome == BattleOutcome::YouWon ? counters.winningHands : counters.losingHands, 1);
+	}
+	for (unsigned int i = 0; i < enemy.getCardCount(); i++)
+	{
+		CardCounters& counters = block.cards[enemy.getCardID(i)];
+		add(outcome == BattleOutcome::YouLost ? counters.winningHands : counters.losingHands, 1);
+	}
+}
+
+void CardStats::collect(CardStatsTotals& totals)
+{
+	totals = {};
+	std::lock_guard<std::mutex> lock(_mutex);
+	for (const std::unique_ptr<CardStatsBlock>& block: _blocks)
+	{
+		for (unsigned int id = 0; id < std::size(block->cards); id++)
+		{
+			const CardCounters& counters = block->cards[id];
+			CardTotals& card = totals.cards[id];
+			card.plays += counters.plays.load(std::memory_order_relaxed);
+			card.delayed += counters.delayed.load(std::memory_order_relaxed);
+			card.damage += counters.damage.load(std::memory_order_relaxed);
+			card.selfDamage += counters.selfDamage.load(std::memory_order_relaxed);
+			card.heal += counters.heal.load(std::memory_order_relaxed);
+			card.extraMoves += counters.extraMoves.load(std::memory_order_relaxed);
+			card.winningHands += counters.winningHands.load(std::memory_order_relaxed);
+			card.losingHands += counters.losingHands.load(std::memory_order_relaxed);
+		}
+		for (unsigned int i = 0; i < std::size(block->outcomes); i++)
+			totals.outcomes[i] += block->outcomes[i].load(std::memory_order_relaxed);
+		totals.duels += block->duels.load(std::memory_order_relaxed);
+	}
+}
+
+// Пишет сумму счётчиков в текстовом формате Prometheus (для textfile-сборщика node_exporter).
+// Файл пишется рядом и переименовывается, чтобы сборщик никогда не прочитал его наполовину.
+bool CardStats::writePrometheus(const std::string& path)
+{
+	CardStatsTotals totals;
+	collect(totals);
+
+	std::string text;
+	auto addMetric = [&](std::string_view name, std::string_view help, unsigned long long CardTotals::* field)
+	{
+		text.append("# HELP greatbattle_card_").append(name).append(" ").append(help).append("\n");
+		text.append("# TYPE greatbattle_card_").append(name).append(" counter\n");
+		for (unsigned int id = 1; id <= CardManager::getAllCardsCount(); id++)
+		{
+			text.append("greatbattle_card_").append(name).append("{id=\"").append(std::to_string(id)).append("\",card=\"");
+			for (char c: CardManager::getCardByID(id).getName())
+			{
+				if (c == '"' || c == '\\')
+					text += '\\';
+				text += c;
+			}
+			text.append("\"} ").append(std::to_string(totals.cards[id].*field)).append("\n");
+		}
+	};
+	addMetric("plays_total", "Сколько раз карта сыграна.", &CardTotals::plays);
+	addMetric("delayed_total", "Сколько раз сработал отложенный эффект карты.", &CardTotals::delayed);
+	addMetric("damage_total", "Урон противнику от карты.", &CardTotals::damage);
+	addMetric("self_damage_total", "Урон своему игроку от карты.", &CardTotals::selfDamage);
+	addMetric("heal_total", "Вылеченные картой жизни.", &CardTotals::heal);
+	addMetric("extra_moves_total", "Дополнительные ходы от карты.", &CardTotals::extraMoves);
+	addMetric("winning_hands_total", "Сколько раз карта была в руке победителя в конце битвы.", &CardTotals::winningHands);
+	addMetric("losing_hands_total", "Сколько раз карта была в руке проигравшего в конце битвы.", &CardTotals::losingHands);
+
+	constexpr std::string_view outcomes[] = { "you_lost", "you_won", "both_lost" };
+	text.append("# HELP greatbattle_battles_total Законченные битвы по исходу.\n# TYPE greatbattle_battles_total counter\n");
+	for (unsigned int i = 0; i < std::size(outcomes); i++)
+		text.append("greatbattle_battles_total{outcome=\"").append(outcomes[i]).append("\"} ").append(std::to_string(totals.outcomes[i])).append("\n");
+	text.append("# HELP greatbattle_duels_total Законченные битвы зрителей между собой.\n# TYPE greatbattle_duels_total counter\n");
+	text.append("greatbattle_duels_total ").append(std::to_string(totals.duels)).append("\n");
+
+	std::string tempPath = path + ".tmp";
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		file.write(text.data(), text.size());
+		file.close();
+		if (!file)
+			return false;
+	}
+	return std::rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+// ------------< LatencyStats >------------
+
+unsigned int LatencyHistogram::getBucket(unsigned long long ns)
+{
+	if (ns < (1u << subBucketBits))
+		return (unsigned int)ns;
+	unsigned int exponent = std::bit_width(ns) - 1;
+	unsigned int bucket = ((exponent - subBucketBits + 1) << subBucketBits) + ((ns >> (exponent - subBucketBits)) & ((1u << subBucketBits) - 1));
+	return std::min(bucket, bucketCount - 1);
+}
+
+// Наибольшее значение, попадающее в корзину.
+unsigned long long LatencyHistogram::getBucketValue(unsigned int bucket)
+{
+	if (bucket < (1u << subBucketBits))
+		return bucket;
+	unsigned int shift = (bucket >> subBucketBits) - 1;
+	unsigned long long low = (unsigned long long)((1u << subBucketBits) + (bucket & ((1u << subBucketBits) - 1))) << shift;
+	return low + (1ull << shift) - 1;
+}
+
+// Значение, не меньше которого percentile (от 0 до 1) всех замеров.
+unsigned long long LatencyHistogram::getPercentile(double percentile) const
+{
+	unsigned long long rank = (unsigned long long)std::ceil(percentile * count), seen = 0;
+	for (unsigned int i = 0; i < bucketCount; i++)
+	{
+		seen += counts[i];
+		if (seen >= rank && seen > 0)
+			return getBucketValue(i);
+	}
+	return 0;
+}
+
+unsigned long long LatencyHistogram::getMax() const
+{
+	for (unsigned int i = bucketCount; i > 0; i--)
+		if (counts[i - 1] > 0)
+			return getBucketValue(i - 1);
+	return 0;
+}
+
+LatencyTotals LatencyTotals::operator-(const LatencyTotals& other) const
+{
+	LatencyTotals result = *this;
+	for (unsigned int point = 0; point < std::size(points); point++)
+	{
+		for (unsigned int i = 0; i < LatencyHistogram::bucketCount; i++)
+			result.points[point].counts[i] -= other.points[point].counts[i];
+		result.points[point].count -= other.points[point].count;
+		result.points[point].total -= other.points[point].total;
+	}
+	return result;
+}
+
+bool LatencyStats::_isEnabled = false;
+volatile std::sig_atomic_t LatencyStats::_isDumpRequested = 0;
+std::mutex LatencyStats::_mutex;
+std::vector<std::unique_ptr<LatencyBlock>> LatencyStats::_blocks;
+thread_local LatencyBlock* LatencyStats::_block = nullptr;
+
+bool LatencyStats::isEnabled()
+{
+	return _isEnabled;
+}
+
+void LatencyStats::setEnabled(bool isEnabled)
+{
+	_isEnabled = isEnabled;
+}
+
+LatencyBlock& LatencyStats::getBlock()
+{
+	if (_block == nullptr)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_blocks.push_back(std::make_unique<LatencyBlock>());
+		_block = _blocks.back().get();
+	}
+	return *_block;
+}
+
+// Как и в CardStats, счётчик пишет только его поток, так что атомарное сложение не нужно.
+void LatencyStats::record(LatencyPoint point, std::chrono::steady_clock::duration duration)
+{
+	unsigned long long ns = std::max(0ll, (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+	LatencyBlock::Point& counters = getBlock().points[(unsigned int)point];
+	std::atomic<unsigned long long>& count = counters.counts[LatencyHistogram::getBucket(ns)];
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	counters.total.store(counters.total.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+}
+
+void LatencyStats::collect(LatencyTotals& totals)
+{
+	totals = {};
+	std::lock_guard<std::mutex> lock(_mutex);
+	for (const std::unique_ptr<LatencyBlock>& block: _blocks)
+	{
+		for (unsigned int point = 0; point < std::size(totals.points); point++)
+		{
+			LatencyHistogram& histogram = totals.points[point];
+			for (unsigned int i = 0; i < LatencyHistogram::bucketCount; i++)
+			{
+				unsigned long long count = block->points[point].counts[i].load(std::memory_order_relaxed);
+				histogram.counts[i] += count;
+				histogram.count += count;
+			}
+			histogram.total += block->points[point].total.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+// По строке на участок, где были замеры: число замеров, среднее, p50, p99, p999 и максимум в микросекундах.
+void LatencyStats::show(const LatencyTotals& totals, std::ostream& out)
+{
+	constexpr std::string_view names[] = { "разбор команды", "ход игрока", "ход Botbder'а", "ответ Botbder'а",
+		"отрисовка", "обработка строки", "ожидание отправки" };
+	static_assert(std::size(names) == (unsigned int)LatencyPoint::Count);
+
+	char line[256];
+	for (unsigned int point = 0; point < std::size(totals.points); point++)
+	{
+		const LatencyHistogram& histogram = totals.points[point];
+		if (histogram.count == 0)
+			continue;
+		std::snprintf(line, sizeof(line), ": %llu, среднее %.1f, p50 %.1f, p99 %.1f, p999 %.1f, макс. %.1f мкс",
+			histogram.count, histogram.total / 1000.0 / histogram.count, histogram.getPercentile(0.5) / 1000.0,
+			histogram.getPercentile(0.99) / 1000.0, histogram.getPercentile(0.999) / 1000.0, histogram.getMax() / 1000.0);
+		out << names[point] << line << "\n";
+	}
+}
+
+// Обработчик сигнала только ставит флаг, а выводит гистограммы основной цикл сервера.
+void LatencyStats::requestDump(int)
+{
+	_isDumpRequested = 1;
+}
+
+bool LatencyStats::takeDumpRequest()
+{
+	if (!_isDumpRequested)
+		return false;
+	_isDumpRequested = 0;
+	return true;
+}
+
+// ------------< LatencyTimer >------------
+
+LatencyTimer::LatencyTimer(LatencyPoint point) : _point(point), _isRunning(LatencyStats::isEnabled())
+{
+	if (_isRunning)
+		_start = std::chrono::steady_clock::now();
+}
+
+LatencyTimer::~LatencyTimer()
+{
+	stop();
+}
+
+void LatencyTimer::stop()
+{
+	if (!_isRunning)
+		return;
+	LatencyStats::record(_point, std::chrono::steady_clock::now() - _start);
+	_isRunning = false;
+}
+
+// ------------< BatchEngine >------------
+
+// Простые карты - по названиям, чтобы не зависеть от их порядка в CardManager. Каждая карта каталога должна быть
+// ровно в одной из таблиц простых и сложных карт (проверяется hasAllCardEffects).
+constexpr BatchEngine::NamedEffects BatchEngine::_simpleCards[] =
+{
+	//                                            урон себе/врагу, лечение себе/врагу, ходы себе/врагу, шанс и урон бонуса;
+	//                                            при использовании, на следующем ходу; возврат карты, карт и зелий в руку
+	{ "Курохай (Катана Изаму)",                    { 0, 1, 0, 0, 0, 0, 0, 0 }, { 0, 2, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Меч Земли (Клинок Трискелиона)",            { 0, 2, 1, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Меч Морей (Клинок Трискелиона)",            { 0, 2, 0, 0, 1, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Алое Пламя (Перстень Зариака)",             { 0, 0, 0, 0, 0, 0, 0, 0 }, { 0, 2, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Доспех Чёрной Розы (Броня Лорда Рейвена)",  { 0, 0, 2, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Яропламень (Меч Князя Велемира)",           { 0, 3, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Глаз Суккуба (Амулет Мизерис)",             { 0, 0, 0, 0, 2, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Алмазный меч",                              { 0, 1, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Рунический щит",                            { 0, 0, 2, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Костяной лук",                              { 0, 1, 0, 0, 0, 0, 5, 1 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Зелье лечения",                             { 0, 0, 1, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Зелье регенерации",                         { 0, 0, 0, 0, 0, 0, 0, 0 }, { 0, 0, 1, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "TNT",                                       { 3, 3, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Деревянный топор",                          { 0, 0, 0, 0, 0, 0, 3, 1 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "MRU-пушка",                                 { 0, 3, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Бумеранг",                                  { 0, 1, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, true, 0, 0 },
+	{ "Алмазная броня",                            { 0, 0, 1, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Ведро лавы",                                { 1, 1, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Блок булыжника",                            { 0, 0, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Ихориевый меч",                             { 0, 4, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Золотой меч",                               { 0, 0, 0, 0, 0, 0, 5, 1 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Посох тауматурга",                          { 0, 2, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Кровавый меч",                              { 0, 1, 1, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Жертвенный кинжал",                         { 1, 0, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Снежок",                                    { 0, 0, 0, 0, 1, 0, 5, 1 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Взрывное зелье исцеления",                  { 0, 0, 1, 1, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Верстак",                                   { 0, 0, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 2, 0 },
+	{ "Взрывное зелье отравления",                 { 0, 0, 0, 0, 0, 0, 0, 0 }, { 1, 1, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Взрывное зелье урона",                      { 1, 1, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Варочная стойка",                           { 0, 0, 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 2 },
+	{ "Краш",                                      { 0, 1, 0, 0, 1, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+	{ "Дисконнект",                                { 0, 0, 0, 0, 2, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0, 0, 0 }, false, 0, 0 },
+};
+
+// Сложные карты: случайные эффекты на несколько исходов и чужие карты. Их ядро считает скалярно.
+constexpr std::string_view BatchEngine::_complexCards[] =
+{
+	"Конструктор Парадоксов (Посох Мудреца)",
+	"Меч Небес (Клинок Трискелиона)",
+	"Хитрый механизм",
+	"Непонятная ерунда",
+	"ID-конфликт",
+};
+
+constexpr CardEffects BatchEngine::getCardEffects(unsigned int id)
+{
+	if (id == 0 || id > CardManager::getAllCardsCount())
+		return { false, false, 0, 0, {}, {} };
+	for (const NamedEffects& card: _simpleCards)
+		if (CardManager::getCardByID(id).getName() == card.name)
+			return { false, card.keepsCard, card.drawCards, card.drawPotions, card.move, card.nextMove };
+	return { true, false, 0, 0, {}, {} };
+}
+
+// Каждая карта каталога - ровно в одной из таблиц, и в таблицах нет названий, которых нет в каталоге.
+constexpr bool BatchEngine::hasAllCardEffects()
+{
+	for (unsigned int id = 1; id <= CardManager::getAllCardsCount(); id++)
+	{
+		unsigned int count = 0;
+		for (const NamedEffects& card: _simpleCards)
+			count += CardManager::getCardByID(id).getName() == card.name;
+		for (std::string_view name: _complexCards)
+			count += CardManager::getCardByID(id).getName() == name;
+		if (count != 1)
+			return false;
+	}
+	return std::size(_simpleCards) + std::size(_complexCards) == CardManager::getAllCardsCount();
+}
+
+static_assert(BatchEngine::hasAllCardEffects(), "Таблицы простых и сложных карт BatchEngine должны покрывать весь каталог карт");
+
+// Эффекты с отложенным действием (nextMove) ядро применяет только для простых карт - проверим, что сложных таких нет.
+static_assert([]
+{
+	for (unsigned int id = 1; id <= CardManager::getAllCardsCount(); id++)
+		if (BatchEngine::getCardEffects(id).isComplex && CardManager::getCardByID(id).hasNextMove())
+			return false;
+	return true;
+}(), "Карта с отложенным эффектом должна быть в таблице простых карт BatchEngine");
+
+// Ядро помнит для стороны битвы один отложенный эффект на следующий ход - другие эффекты ему неизвестны.
+static_assert([]
+{
+	for (unsigned int id = 1; id <= CardManager::getAllCardsCount(); id++)
+		if (CardManager::getCardByID(id).hasNextMove() && (CardManager::getCardByID(id).getDelay() != 1 || CardManager::getCardByID(id).getDuration() != 1))
+			return false;
+	return true;
+}(), "BatchEngine умеет только отложенные эффекты на один следующий ход");
+
+constexpr CardEffects BatchEngine::_effects[64] =
+{
+#define EFFECTS_ROW(i) getCardEffects(i), getCardEffects(i + 1), getCardEffects(i + 2), getCardEffects(i + 3), \
+	getCardEffects(i + 4), getCardEffects(i + 5), getCardEffects(i + 6), getCardEffects(i + 7)
+	EFFECTS_ROW(0), EFFECTS_ROW(8), EFFECTS_ROW(16), EFFECTS_ROW(24),
+	EFFECTS_ROW(32), EFFECTS_ROW(40), EFFECTS_ROW(48), EFFECTS_ROW(56)
+#undef EFFECTS_ROW
+};
+
+BatchEngine::BatchEngine(unsigned int lanes) : _lanes(lanes), _health(2 * lanes), _extraMoves(2 * lanes), _prevCardID(2 * lanes),
+	_hands(2 * lanes), _decks(lanes), _mover(lanes), _cardID(lanes), _isActive(lanes), _moves(lanes), _rolls(lanes),
+	_played(2 * lanes)
+{
+	for (unsigned int lane = 0; lane < lanes; lane++)
+		_rolls[lane] = Random::next(0xFFFFFFFF) | 1;
+}
+
+
+void BatchEngine::run(unsigned long long games, SimulatorStats& stats)
+{
+	unsigned long long started = 0;
+	unsigned int active = 0;
+	for (unsigned int lane = 0; lane < _lanes; lane++)
+	{
+		_isActive[lane] = started < games;
+		if (_isActive[lane])
+		{
+			startGame(lane);
+			started++;
+			active++;
+		}
+	}
+
+	while (active > 0)
+	{
+		chooseCards(stats);
+		applySimpleCards();
+		for (unsigned int lane = 0; lane < _lanes; lane++)
+			if (_isActive[lane] && _effects[_cardID[lane]].isComplex)
+				applyComplexCard(lane);
+
+		// Проверка конца битвы, добор карт и передача хода. Карты, выданные простыми картами, добираются здесь же -
+		// при случайных ходах порядок карт в руке не важен.
+		for (unsigned int lane = 0; lane < _lanes; lane++)
+		{
+			if (!_isActive[lane])
+				continue;
+			unsigned int self = 2 * lane + _mover[lane];
+			bool isOver = _health[2 * lane] == 0 || _health[2 * lane + 1] == 0;
+			if (!isOver)
+			{
+				const CardEffects& effects = _effects[_cardID[lane]];
+				for (unsigned int i = 0; i <= effects.drawCards; i++)
+					_hands[self].add(_decks[lane].getNewID(_mover[lane]));
+				for (unsigned int i = 0; i < effects.drawPotions; i++)
+					_hands[self].add(CardManager::potionIDs[Random::next(std::size(CardManager::potionIDs))]);
+				if (_extraMoves[self] == 0)
+					_mover[lane] ^= 1;
+			}
+			if (isOver || _moves[lane] >= Simulator::maxMovesPerGame)
+			{
+				finishGame(lane, stats);
+				if (started < games)
+				{
+					startGame(lane);
+					started++;
+				}
+				else
+				{
+					_isActive[lane] = false;
+					_cardID[lane] = 0;
+					active--;
+				}
+			}
+		}
+	}
+}
+
+
+void BatchEngine::startGame(unsigned int lane)
+{
+	_decks[lane].restoreEpicCards();
+	for (unsigned int side = 0; side < 2; side++)
+	{
+		_health[2 * lane + side] = 5;
+		_extraMoves[2 * lane + side] = 0;
+		_prevCardID[2 * lane + side] = 0;
+		_hands[2 * lane + side].clear();
+		_played[2 * lane + side] = 0;
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		_hands[2 * lane].add(_decks[lane].getNewID(false));
+		_hands[2 * lane + 1].add(_decks[lane].getNewID(true));
+	}
+	_mover[lane] = 0;
+	_moves[lane] = 0;
+}
+
+void BatchEngine::finishGame(unsigned int lane, SimulatorStats& stats)
+{
+	bool isYouDead = _health[2 * lane] == 0, isBotbderDead = _health[2 * lane + 1] == 0;
+	stats.games++;
+	if (!isYouDead && !isBotbderDead)
+		stats.aborted++;
+	else if (isYouDead && isBotbderDead)
+		stats.outcomes[(int)BattleOutcome::BothLost]++;
+	else
+	{
+		stats.outcomes[(int)(isYouDead ? BattleOutcome::YouLost : BattleOutcome::YouWon)]++;
+		for (unsigned long long won = _played[2 * lane + isYouDead]; won != 0; won &= won - 1)
+			stats.gamesWon[std::countr_zero(won)]++;
+	}
+	for (unsigned int side = 0; side < 2; side++)
+		for (unsigned long long played = _played[2 * lane + side]; played != 0; played &= played - 1)
+			stats.gamesPlayed[std::countr_zero(played)]++;
+}
+
+// Ходящая сторона каждой битвы выбирает случайную карту из руки.
+void BatchEngine::chooseCards(SimulatorStats& stats)
+{
+	for (unsigned int lane = 0; lane < _lanes; lane++)
+	{
+		if (!_isActive[lane])
+			continue;
+		unsigned int self = 2 * lane + _mover[lane];
+		Hand& hand = _hands[self];
+		unsigned int ind = Random::next(hand.size());
+		unsigned int id = hand.get(ind);
+		if (!_effects[id].keepsCard)
+			hand.swapRemove(ind);
+		if (_extraMoves[self] > 0)
+			_extraMoves[self]--;
+		_cardID[lane] = id;
+		_played[self] |= 1ull << id;
+		_moves[lane]++;
+		stats.moves++;
+		stats.plays[id]++;
+	}
+}
+
+// Ядро для простых карт: эффект карты, затем отложенный эффект предыдущей карты. Без ветвлений внутри цикла,
+// сложные карты и пустые битвы отсекаются маской. Урон не опускает здоровье ниже нуля, как в Player::damage.
+void BatchEngine::applySimpleCards()
+{
+	unsigned int* health = _health.data();
+	unsigned int* extraMoves = _extraMoves.data();
+	unsigned char* prevCardID = _prevCardID.data();
+	unsigned int* rolls = _rolls.data();
+	for (unsigned int lane = 0; lane < _lanes; lane++)
+	{
+		unsigned int self = 2 * lane + _mover[lane], enemy = self ^ 1;
+		const CardEffects& effects = _effects[_cardID[lane]];
+		const CardEffect& move = effects.move;
+		const CardEffect& next = _effects[prevCardID[self]].nextMove;
+		unsigned int mask = effects.isComplex ? 0 : 1;
+
+		// xorshift32 на каждую битву - бросок для бонусного урона.
+		unsigned int roll = rolls[lane];
+		roll ^= roll << 13;
+		roll ^= roll >> 17;
+		roll ^= roll << 5;
+		rolls[lane] = roll;
+		unsigned int bonus = ((unsigned long long)roll * 10 >> 32) < move.bonusChance ? move.bonusDamage : 0;
+
+		unsigned int selfHealth = health[self], enemyHealth = health[enemy];
+		selfHealth -= std::min(selfHealth, mask * move.selfDamage);
+		enemyHealth -= std::min(enemyHealth, mask * (move.enemyDamage + bonus));
+		selfHealth += mask * move.selfHeal;
+		enemyHealth += mask * move.enemyHeal;
+		selfHealth -= std::min(selfHealth, mask * next.selfDamage);
+		enemyHealth -= std::min(enemyHealth, mask * next.enemyDamage);
+		selfHealth += mask * next.selfHeal;
+		enemyHealth += mask * next.enemyHeal;
+		health[self] = selfHealth;
+		health[enemy] = enemyHealth;
+
+		extraMoves[self] += mask * (move.selfExtraMoves + next.selfExtraMoves);
+		extraMoves[enemy] += mask * (move.enemyExtraMoves + next.enemyExtraMoves);
+		prevCardID[self] = mask ? _cardID[lane] : prevCardID[self];
+	}
+}
+
+// Скалярный путь: сторона битвы переносится в настоящих игроков, карта применяется как в Player::useCard.
+void BatchEngine::applyComplexCard(unsigned int lane)
+{
+	unsigned int self = 2 * lane + _mover[lane], enemy = self ^ 1;
+	Player player(self & 1, _scratchEvents, _decks[lane]), adversary(enemy & 1, _scratchEvents, _decks[lane]);
+	loadPlayer(player, self);
+	loadPlayer(adversary, enemy);
+	player.useCard(adversary, _cardID[lane]);
+	storePlayer(player, self);
+	storePlayer(adversary, enemy);
+}
+
+void BatchEngine::loadPlayer(Player& player, unsigned int side) const
+{
+	player.removeAllCards();
+	for (unsigned int i = 0; i < _hands[side].size(); i++)
+		player.addNewCard(_hands[side].get(i));
+	player.setHealth(_health[side]);
+	player.setExtraMovesCount(_extraMoves[side]);
+	player.setPendingCardID(_prevCardID[side]);
+}
+
+void BatchEngine::storePlayer(const Player& player, unsigned int side)
+{
+	_hands[side].clear();
+	for (unsigned int i = 0; i < player.getCardCount(); i++)
+		_hands[side].add(player.getCardID(i));
+	_health[side] = player.getHealth();
+	_extraMoves[side] = player.getExtraMovesCount();
+	_prevCardID[side] = player.getPendingCardID();
+}
+
+// ------------< BattleState >------------
+
+BattleState::BattleState(const Player& you, const Player& botbder, const Deck& deck, bool isBotbderTurn, EventLog& events) :
+	_you(you), _botbder(botbder), _deck(deck), _isBotbderTurn(isBotbderTurn)
+{
+	_you.bind(events, _deck);
+	_botbder.bind(events, _deck);
+}
+
+BattleState::BattleState(const BattleState& other) : _you(other._you), _botbder(other._botbder), _deck(other._deck),
+	_isBotbderTurn(other._isBotbderTurn)
+{
+	_you.bind(_you.getEvents(), _deck);
+	_botbder.bind(_botbder.getEvents(), _deck);
+}
+
+BattleState& BattleState::operator=(const BattleState& other)
+{
+	_you = other._you;
+	_botbder = other._botbder;
+	_deck = other._deck;
+	_isBotbderTurn = other._isBotbderTurn;
+	_you.bind(_you.getEvents(), _deck);
+	_botbder.bind(_botbder.getEvents(), _deck);
+	return *this;
+}
+
+
+bool BattleState::isOver() const
+{
+	return _you.isDead() || _botbder.isDead();
+}
+
+bool BattleState::isBotbderTurn() const
+{
+	return _isBotbderTurn;
+}
+
+const Player& BattleState::getPlayer(bool isBotbder) const
+{
+	return isBotbder ? _botbder : _you;
+}
+
+const Deck& BattleState::getDeck() const
+{
+	return _deck;
+}
+
+// Результат для Botbder'а: 1 - победа, 0 - поражение, 0.5 - оба проиграли. Для незаконченной битвы - оценка по жизням.
+float BattleState::getBotbderValue() const
+{
+	if (_you.isDead())
+		return _botbder.isDead() ? 0.5f : 1.0f;
+	if (_botbder.isDead())
+		return 0.0f;
+	return (float)_botbder.getHealth() / (_you.getHealth() + _botbder.getHealth());
+}
+
+constexpr ZobristKeys makeZobristKeys()
+{
+	ZobristKeys keys = {};
+	unsigned long long seed = 0x5EED0F6A7EBA771Eull;
+	auto next = [&seed]()
+	{
+		seed += 0x9E3779B97F4A7C15ull;
+		unsigned long long z = seed;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	};
+	for (int side = 0; side < 2; side++)
+	{
+		for (unsigned long long& key: keys.health[side])
+			key = next();
+		for (unsigned long long& key: keys.extraMoves[side])
+			key = next();
+		for (auto& ids: keys.effects[side])
+			for (unsigned long long& key: ids)
+				key = next();
+		for (auto& counts: keys.cards[side])
+			for (unsigned long long& key: counts)
+				key = next();
+		for (unsigned long long& key: keys.epics[side])
+			key = next();
+	}
+	keys.botbderTurn = next();
+	return keys;
+}
+
+constexpr ZobristKeys zobristKeys = makeZobristKeys();
+
+// Хеш не зависит от порядка карт в руке - рука хешируется как мультимножество.
+unsigned long long BattleState::getHash() const
+{
+	unsigned long long hash = _isBotbderTurn ? zobristKeys.botbderTurn : 0;
+	for (int side = 0; side < 2; side++)
+	{
+		const Player& player = side ? _botbder : _you;
+		hash ^= zobristKeys.health[side][std::min(player.getHealth(), 31u)];
+		hash ^= zobristKeys.extraMoves[side][std::min(player.getExtraMovesCount(), 7u)];
+		// Отложенные эффекты - по ходу срабатывания; число оставшихся ходов эффекта подмешивается поворотом ключа.
+		const EffectWheel& effects = player.getEffects();
+		for (unsigned int delay = 0; delay < EffectWheel::size; delay++)
+			for (unsigned int i = 0; i < effects.getCount(delay); i++)
+				hash ^= std::rotl(zobristKeys.effects[side][delay][effects.get(delay, i).cardID], effects.get(delay, i).turns - 1);
+		unsigned char counts[64] = {};
+		for (unsigned int i = 0; i < player.getCardCount(); i++)
+		{
+			unsigned int id = player.getCardID(i);
+			hash ^= zobristKeys.cards[side][id][counts[id]++];
+		}
+		for (unsigned long long epics = _deck.getEpicMask(side); epics != 0; epics &= epics - 1)
+			hash ^= zobristKeys.epics[side][std::countr_zero(epics)];
+	}
+	return hash;
+}
+
+
+// Один ход по тем же правилам, что и в GreatBattle::moveStep: ход картой, проверка смерти, добор,
+// а ход переходит к противнику, если у ходившего не осталось дополнительных ходов.
+void BattleState::applyMove(unsigned int ind)
+{
+	Player& mover = _isBotbderTurn ? _botbder : _you;
+	Player& enemy = _isBotbderTurn ? _you : _botbder;
+	mover.move(enemy, ind);
+	if (isOver())
+		return;
+	mover.drawCard();
+	if (mover.getExtraMovesCount() == 0)
+		_isBotbderTurn = !_isBotbderTurn;
+}
+
+// ------------< BotbderAI >------------
+
+thread_local std::vector<SearchEntry> BotbderAI::_table;
+thread_local EventLog BotbderAI::_scratchEvents;
+thread_local unsigned long long BotbderAI::_rootKey = 0;
+thread_local unsigned short BotbderAI::_generation = 0;
+
+SearchLimits BotbderAI::getLimits(Difficulty difficulty)
+{
+	switch (difficulty)
+	{
+	case Difficulty::Easy:
+		return { 0.0, 0 };
+	case Difficulty::Normal:
+		return { 0.001, 100000 };
+	case Difficulty::Hard:
+		return { 0.05, 10000000 };
+	}
+	return { 0.0, 0 };
+}
+
+// Возвращает номер карты в руке ходящего (с единицы), как его принимает GreatBattle::botbderMove.
+// Если передан cardValues (по элементу на ID карты), туда пишутся оценки ходов, для остальных карт - -1.
+// Если поиск не успел ни одной итерации, ход выбирается по оценке после одного хода.
+unsigned int BotbderAI::chooseCard(const BattleState& state, SearchLimits limits, float* cardValues)
+{
+	const Player& mover = state.getPlayer(state.isBotbderTurn());
+	if (mover.getCardCount() <= 1 && !cardValues)
+		return 1;
+	if (_table.empty())
+		_table.resize(tableSize);
+	_rootKey = state.getHash();
+	_generation++;
+
+	auto start = std::chrono::steady_clock::now();
+	std::chrono::duration<double> budget(limits.seconds);
+	for (unsigned long long i = 0; i < limits.iterations; i++)
+	{
+		if (i % 32 == 0 && std::chrono::steady_clock::now() - start > budget)
+			break;
+		BattleState copy = state;
+		search(copy, 0);
+	}
+
+	bool isNew;
+	const SearchEntry& root = _table[probe(state, isNew)];
+	if (cardValues)
+		std::fill(cardValues, cardValues + 64, -1.0f);
+	if (root.visits == 0)
+		return chooseGreedy(state) + 1;
+	unsigned int best = 0;
+	for (unsigned int a = 1; a < root.actionCount; a++)
+		if (root.actionVisits[a] > root.actionVisits[best])
+			best = a;
+	if (cardValues)
+	{
+		for (unsigned int a = 0; a < root.actionCount; a++)
+			if (root.actionVisits[a] > 0)
+				cardValues[root.actionIDs[a]] = root.actionValues[a] / root.actionVisits[a];
+	}
+	return findCard(mover, root.actionIDs[best]) + 1;
+}
+
+EventLog& BotbderAI::getScratchEvents()
+{
+	return _scratchEvents;
+}
+
+
+// Одна итерация UCT: спуск по таблице до нового состояния, случайная доигровка и обновление статистики.
+float BotbderAI::search(BattleState& state, unsigned int depth)
+{
+	if (state.isOver())
+		return state.getBotbderValue();
+	if (depth >= maxDepth)
+		return rollout(state);
+
+	bool isNew;
+	unsigned int slot = probe(state, isNew);
+	if (isNew)
+		return rollout(state);
+
+	SearchEntry& entry = _table[slot];
+	unsigned long long key = entry.key;
+	bool isBotbder = state.isBotbderTurn();
+	unsigned int action = 0;
+	float bestScore = -1.0f;
+	float logVisits = std::log((float)entry.visits + 1.0f);
+	for (unsigned int a = 0; a < entry.actionCount; a++)
+	{
+		if (entry.actionVisits[a] == 0)
+		{
+			action = a;
+			break;
+		}
+		float value = entry.actionValues[a] / entry.actionVisits[a];
+		float score = (isBotbder ? value : 1.0f - value) + 0.7f * std::sqrt(logVisits / entry.actionVisits[a]);
+		if (score > bestScore)
+		{
+			bestScore = score;
+			action = a;
+		}
+	}
+
+	unsigned char id = entry.actionIDs[action];
+	state.applyMove(findCard(state.getPlayer(isBotbder), id));
+	float value = search(state, depth + 1);
+
+	// Пока считали глубже, запись могла быть вытеснена другим состоянием.
+	SearchEntry& updated = _table[slot];
+	if (updated.key == key && updated.actionIDs[action] == id)
+	{
+		updated.visits++;
+		updated.actionVisits[action]++;
+		updated.actionValues[action] += value;
+	}
+	return value;
+}
 
-	for (int i = 1; i <= CardManager::getAllCardsCount(); i++)
-		showCard(i, i);
+float BotbderAI::rollout(BattleState& state)
+{
+	for (unsigned int i = 0; i < maxRolloutMoves && !state.isOver(); i++)
+		state.applyMove(Random::next(state.getPlayer(state.isBotbderTurn()).getCardCount()));
+	return state.getBotbderValue();
 }
 
-void GreatBattle::showInfo() const
+// Находит (или заводит заново) запись состояния в его корзине. Ходы записи - различные карты в руке ходящего.
+unsigned int BotbderAI::probe(const BattleState& state, bool& isNew)
 {
-	Console::setConsoleColor(ConsoleColor::LightGreen);
-	std::cout << "Ваше здоровье: " << _you.getHealth() << " ед." << std::endl;
-	std::cout << "Ваши карты: " << std::endl;
-	for (int i = 0; i < _you.getCardCount(); i++)
-		showCard(i + 1, _you.getCardID(i));
+	unsigned long long key = state.getHash();
+	unsigned int bucket = (unsigned int)(key % (tableSize / bucketSize)) * bucketSize, slot = tableSize;
+	for (unsigned int i = bucket; i < bucket + bucketSize; i++)
+	{
+		SearchEntry& entry = _table[i];
+		if (entry.key == key && entry.actionCount != 0)
+		{
+			entry.generation = _generation;
+			isNew = false;
+			return i;
+		}
+		if (entry.key == _rootKey && entry.actionCount != 0)
+			continue;
+		if (slot == tableSize || isCheaper(entry, _table[slot]))
+			slot = i;
+	}
+	isNew = true;
+
+	SearchEntry& entry = _table[slot];
+	const Player& mover = state.getPlayer(state.isBotbderTurn());
+	entry.key = key;
+	entry.visits = 0;
+	entry.generation = _generation;
+	entry.actionCount = 0;
+	unsigned long long seen = 0;
+	for (unsigned int i = 0; i < mover.getCardCount(); i++)
+	{
+		unsigned int id = mover.getCardID(i);
+		if (seen >> id & 1)
+			continue;
+		seen |= 1ull << id;
+		entry.actionIDs[entry.actionCount] = id;
+		entry.actionVisits[entry.actionCount] = 0;
+		entry.actionValues[entry.actionCount] = 0.0f;
+		entry.actionCount++;
+	}
+	return slot;
 }
 
-void GreatBattle::showAdversary() const
+// Вытеснить entry дешевле, чем other: сначала пустые записи, потом записи прошлых поисков, потом менее посещённые.
+bool BotbderAI::isCheaper(const SearchEntry& entry, const SearchEntry& other)
 {
-	Console::setConsoleColor(ConsoleColor::LightGreen);
-	std::cout << "Здоровье Botbder'а: " << _botbder.getHealth() << " ед." << std::endl;
+	if ((entry.actionCount == 0) != (other.actionCount == 0))
+		return entry.actionCount == 0;
+	bool isOld = entry.generation != _generation, isOtherOld = other.generation != _generation;
+	if (isOld != isOtherOld)
+		return isOld;
+	return entry.visits < other.visits;
 }
 
+unsigned int BotbderAI::findCard(const Player& player, unsigned int id)
+{
+	for (unsigned int i = 0; i < player.getCardCount(); i++)
+		if (player.getCardID(i) == id)
+			return i;
+	return 0;
+}
 
-void GreatBattle::showCard(unsigned int i, unsigned int id) const
+// Номер карты (с нуля), после хода которой состояние лучше всего для ходящего: по одному случайному исходу
+// на каждую различную карту.
+unsigned int BotbderAI::chooseGreedy(const BattleState& state)
 {
-	Card card = CardManager::getCardByID(id);
-	switch (card.getType())
+	bool isBotbder = state.isBotbderTurn();
+	const Player& mover = state.getPlayer(isBotbder);
+	unsigned int best = 0;
+	float bestValue = -1.0f;
+	unsigned long long seen = 0;
+	for (unsigned int i = 0; i < mover.getCardCount(); i++)
 	{
-	case CardType::Epic:
-		Console::setConsoleColor(ConsoleColor::LightMagenta);
-		break;
-	case CardType::Common:
-		Console::setConsoleColor(ConsoleColor::Yellow);
-		break;
-	case CardType::Player:
-		Console::setConsoleColor(ConsoleColor::LightCyan);
-		break;
-	case CardType::Botbder:
-		Console::setConsoleColor(ConsoleColor::Cyan);
-		break;
+		unsigned int id = mover.getCardID(i);
+		if (seen >> id & 1)
+			continue;
+		seen |= 1ull << id;
+		BattleState copy = state;
+		copy.applyMove(i);
+		float value = isBotbder ? copy.getBotbderValue() : 1.0f - copy.getBotbderValue();
+		if (value > bestValue)
+		{
+			bestValue = value;
+			best = i;
+		}
 	}
-	std::cout << i << ") " << card.getName() << " - " << card.getDescription() << std::endl;
+	return best;
 }
 
+// ------------< ChanceScript >------------
 
-bool GreatBattle::moveStep(unsigned int i)
+ChanceScript::ChanceScript() : _choices(), _options(), _probabilities(), _weights(), _count(0), _pos(0), _isDrawCollapsed(false),
+	_isTruncated(false) {}
+
+
+// Начать проигрывание очередного сочетания выборов.
+void ChanceScript::start(bool isDrawCollapsed)
 {
-	playerMove(i);
-	if (checkDead())
-		return false;
-	_you.addNewCard(CardManager::getNewID(false));
-	if (_you.getExtraMovesCount() > 0)
-		return true;
+	_pos = 0;
+	_isDrawCollapsed = isDrawCollapsed;
+	_isTruncated = false;
+}
 
-	do
+bool ChanceScript::advance()
+{
+	_count = _pos;
+	while (_count > 0)
 	{
-		botbderMove(rand() % _botbder.getCardCount() + 1);
-		if (checkDead())
+		unsigned int i = _count - 1;
+		if (_choices[i] + 1 < _options[i])
 		{
-			return false;
+			_choices[i]++;
+			return true;
 		}
-		_botbder.addNewCard(CardManager::getNewID(true));
-	} while (_botbder.getExtraMovesCount() > 0);
+		_count--;
+	}
+	return false;
+}
+
+unsigned int ChanceScript::next(unsigned int n)
+{
+	if (_pos >= maxChoices)
+	{
+		_isTruncated = true;
+		return 0;
+	}
+	if (_pos >= _count)
+	{
+		_choices[_pos] = 0;
+		_count = _pos + 1;
+	}
+	_options[_pos] = n;
+	_weights[_pos] = nullptr;
+	_probabilities[_pos] = 1.0 / n;
+	return _choices[_pos++];
+}
+
+unsigned int ChanceScript::choose(const unsigned int* weights, unsigned int n)
+{
+	if (_pos >= maxChoices)
+	{
+		_isTruncated = true;
+		return 0;
+	}
+	unsigned int choice = next(n);
+	unsigned int total = 0;
+	for (unsigned int i = 0; i < n; i++)
+		total += weights[i];
+	_probabilities[_pos - 1] = (double)weights[choice] / total;
+	return choice;
+}
+
+double ChanceScript::getProbability() const
+{
+	double probability = 1.0;
+	for (unsigned int i = 0; i < _pos; i++)
+		probability *= _probabilities[i];
+	return probability;
+}
+
+bool ChanceScript::isDrawCollapsed() const
+{
+	return _isDrawCollapsed;
+}
+
+// Были ли в этом сочетании выборы сверх maxChoices (они не перебирались, а взяты первыми).
+bool ChanceScript::isTruncated() const
+{
+	return _isTruncated;
+}
+
+// ------------< BattleSolver >------------
+
+thread_local std::vector<SolverEntry> BattleSolver::_table;
+thread_local std::vector<SolverOutcome> BattleSolver::_outcomes[BattleSolver::maxDepth + 1];
+thread_local unsigned short BattleSolver::_generation = 0;
+thread_local std::chrono::steady_clock::time_point BattleSolver::_deadline;
+thread_local unsigned int BattleSolver::_nodes = 0;
+thread_local bool BattleSolver::_isAborted = false;
+
+// Пишет в cardChances (по элементу на ID карты) шансы ходящего на победу после хода каждой картой его руки.
+// Возвращает, на сколько ходов вперёд удалось досчитать за отведённое время.
+unsigned int BattleSolver::analyze(const BattleState& state, double seconds, float* cardChances)
+{
+	if (_table.empty())
+		_table.resize(tableSize);
+	_generation++;
+	_deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+	_isAborted = false;
+
+	bool isBotbder = state.isBotbderTurn();
+	const Player& mover = state.getPlayer(isBotbder);
+	std::fill(cardChances, cardChances + 64, 0.0f);
+	float chances[64] = {};
+	unsigned int reached = 0;
+	for (unsigned int depth = 1; depth <= maxDepth && !_isAborted; depth++)
+	{
+		unsigned long long done = 0;
+		for (unsigned int i = 0; i < mover.getCardCount() && !_isAborted; i++)
+		{
+			unsigned int id = mover.getCardID(i);
+			if (done >> id & 1)
+				continue;
+			done |= 1ull << id;
+			WinChances result = expect(state, i, depth);
+			chances[id] = isBotbder ? result.botbder : result.you;
+		}
+		// Недосчитанная глубина не показывается: шансы остаются от прошлой глубины (или нулевыми, если не досчитана и первая).
+		if (_isAborted)
+			break;
+		std::copy(chances, chances + 64, cardChances);
+		reached = depth;
+	}
+	return reached;
+}
+
+
+WinChances BattleSolver::solve(const BattleState& state, unsigned int depth)
+{
+	if (state.isOver() || depth == 0)
+		return evaluate(state);
+
+	unsigned long long key = state.getHash();
+	SolverEntry& entry = _table[key % tableSize];
+	if (entry.key == key && entry.depth >= depth)
+	{
+		entry.generation = _generation;
+		return entry.chances;
+	}
+
+	bool isBotbder = state.isBotbderTurn();
+	const Player& mover = state.getPlayer(isBotbder);
+	WinChances best = { -1.0f, -1.0f };
+	unsigned long long done = 0;
+	for (unsigned int i = 0; i < mover.getCardCount(); i++)
+	{
+		unsigned int id = mover.getCardID(i);
+		if (done >> id & 1)
+			continue;
+		done |= 1ull << id;
+		WinChances result = expect(state, i, depth);
+		if (_isAborted)
+			return result;
+		float mine = isBotbder ? result.botbder : result.you, theirs = isBotbder ? result.you : result.botbder;
+		float bestMine = isBotbder ? best.botbder : best.you, bestTheirs = isBotbder ? best.you : best.botbder;
+		if (mine > bestMine || (mine == bestMine && theirs < bestTheirs))
+			best = result;
+	}
+
+	SolverEntry& slot = _table[key % tableSize];
+	if (slot.key == key || slot.generation != _generation || slot.depth <= depth)
+		slot = { key, best, (unsigned short)depth, _generation };
+	return best;
+}
+
+// Ожидаемые шансы после хода картой ind: все случайные исходы хода перебираются по сценарию,
+// одинаковые состояния склеиваются, и для каждого различного исхода решается оставшаяся битва.
+// Обрезанные исходы не доигрываются: их вероятность получает оценку по жизням до хода.
+WinChances BattleSolver::expect(const BattleState& state, unsigned int ind, unsigned int depth)
+{
+	if (++_nodes % 256 == 0 && std::chrono::steady_clock::now() > _deadline)
+		_isAborted = true;
+	if (_isAborted)
+		return { 0.0f, 0.0f };
+
+	std::vector<SolverOutcome>& outcomes = _outcomes[depth];
+	outcomes.clear();
+	ChanceScript script;
+	double truncated = 0;
+	Random::setScript(&script);
+	do
+	{
+		script.start(depth == 1);
+		BattleState child = state;
+		child.applyMove(ind);
+		if (script.isTruncated())
+			truncated += script.getProbability();
+		else
+			outcomes.push_back({ child.getHash(), script.getProbability(), child });
+	} while (script.advance());
+	Random::setScript(nullptr);
+
+	std::sort(outcomes.begin(), outcomes.end(), [](const SolverOutcome& a, const SolverOutcome& b) { return a.hash < b.hash; });
+	WinChances result = { 0.0f, 0.0f };
+	if (truncated > 0)
+	{
+		WinChances chances = evaluate(state);
+		result = { (float)(truncated * chances.you), (float)(truncated * chances.botbder) };
+	}
+	for (unsigned int i = 0; i < outcomes.size(); )
+	{
+		double probability = 0;
+		unsigned int j = i;
+		for (; j < outcomes.size() && outcomes[j].hash == outcomes[i].hash; j++)
+			probability += outcomes[j].probability;
+		WinChances chances = solve(outcomes[i].state, depth - 1);
+		result.you += probability * chances.you;
+		result.botbder += probability * chances.botbder;
+		i = j;
+	}
+	return result;
+}
+
+// Точный исход законченной битвы или оценка по жизням на горизонте расчёта.
+WinChances BattleSolver::evaluate(const BattleState& state)
+{
+	bool isYouDead = state.getPlayer(false).isDead(), isBotbderDead = state.getPlayer(true).isDead();
+	if (isYouDead || isBotbderDead)
+		return { isBotbderDead && !isYouDead ? 1.0f : 0.0f, isYouDead && !isBotbderDead ? 1.0f : 0.0f };
+	float botbder = state.getBotbderValue();
+	return { 1.0f - botbder, botbder };
+}
+
+// ------------< PolicyTable >------------
+
+const unsigned char* PolicyTable::_rows = nullptr;
+
+bool PolicyTable::load(const std::string& path)
+{
+	size_t size = sizeof(PolicyHeader) + rowCount * rowSize;
+	const void* data = nullptr;
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = nullptr;
+	if (GetFileSizeEx(file, &fileSize) && (size_t)fileSize.QuadPart == size)
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr)
+		return false;
+	data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+#else
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+	struct stat info;
+	if (fstat(file, &info) == 0 && (size_t)info.st_size == size)
+	{
+		data = mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+		if (data == MAP_FAILED)
+			data = nullptr;
+	}
+	close(file);
+#endif
+	if (data == nullptr)
+		return false;
 
+	const PolicyHeader* header = (const PolicyHeader*)data;
+	if (std::string_view(header->magic, 8) != "GBPOLICY" || header->version != version || header->rowCount != rowCount)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap((void*)data, size);
+#endif
+		return false;
+	}
+	_rows = (const unsigned char*)(header + 1);
 	return true;
 }
 
-void GreatBattle::playerMove(unsigned int ind)
+bool PolicyTable::isLoaded()
 {
-	Card card = CardManager::getCardByID(_you.getCardID(ind - 1));
-	Console::setConsoleColor(ConsoleColor::LightBlue);
-	std::cout << "Вы использовали карту \"" << card.getName() << "\"!" << std::endl;
-	_you.move(_botbder, ind - 1);
+	return _rows != nullptr;
+}
+
+// ID лучшей из карт на руке Botbder'а или 0, если политики нет или для этих карт нет данных.
+unsigned int PolicyTable::findCard(const BattleState& state)
+{
+	if (!_rows)
+		return 0;
+	const unsigned char* row = _rows + getRow(state) * rowSize;
+	const Player& botbder = state.getPlayer(true);
+	unsigned int best = 0, bestValue = 0;
+	for (unsigned int i = 0; i < botbder.getCardCount(); i++)
+	{
+		unsigned int id = botbder.getCardID(i);
+		if (row[id] > bestValue)
+		{
+			best = id;
+			bestValue = row[id];
+		}
+	}
+	return best;
+}
+
+unsigned int PolicyTable::getRow(const BattleState& state)
+{
+	const Player& botbder = state.getPlayer(true);
+	const Player& you = state.getPlayer(false);
+	unsigned int row = std::min(botbder.getHealth(), 7u);
+	row = row * 8 + std::min(you.getHealth(), 7u);
+	row = row * 2 + std::min(botbder.getExtraMovesCount(), 1u);
+	row = row * 2 + std::min(you.getExtraMovesCount(), 1u);
+	row = row * delayedCount + getDelayedIndex(botbder.getPendingCardID());
+	row = row * delayedCount + getDelayedIndex(you.getPendingCardID());
+	return row;
+}
+
+// Номер карты среди карт с отложенным эффектом (с единицы) или 0 для остальных карт.
+constexpr unsigned int PolicyTable::getDelayedIndex(unsigned int id)
+{
+	if (!CardManager::getCardByID(id).hasNextMove())
+		return 0;
+	unsigned int ind = 1;
+	for (unsigned int other = 1; other < id; other++)
+		if (CardManager::getCardByID(other).hasNextMove())
+			ind++;
+	return ind;
+}
+
+static_assert(PolicyTable::rowSize > CardManager::getAllCardsCount(), "ID карт должны помещаться в строку политики");
+static_assert([]
+{
+	unsigned int count = 1;
+	for (unsigned int id = 1; id <= CardManager::getAllCardsCount(); id++)
+		if (CardManager::getCardByID(id).hasNextMove())
+			count++;
+	return count;
+}() == PolicyTable::delayedCount, "delayedCount должен совпадать с числом карт с отложенным эффектом");
+
+
+void PolicyTable::build(const std::string& path, unsigned int states, double secondsPerState, unsigned int threads)
+{
+	std::vector<std::vector<double>> sums(threads, std::vector<double>(rowCount * rowSize));
+	std::vector<std::vector<unsigned int>> counts(threads, std::vector<unsigned int>(rowCount * rowSize));
+	std::vector<std::thread> workers;
+	unsigned long long seed = time(nullptr);
+	for (unsigned int i = 0; i < threads; i++)
+		workers.emplace_back(buildWorker, states / threads + (i < states % threads ? 1 : 0), secondsPerState,
+			seed + i * 0x9E3779B97F4A7C15ull, std::ref(sums[i]), std::ref(counts[i]));
+	for (std::thread& worker: workers)
+		worker.join();
+
+	std::vector<unsigned char> rows(rowCount * rowSize);
+	unsigned int filledRows = 0;
+	for (unsigned int row = 0; row < rowCount; row++)
+	{
+		bool isFilled = false;
+		for (unsigned int id = 0; id < rowSize; id++)
+		{
+			double sum = 0;
+			unsigned int count = 0;
+			for (unsigned int i = 0; i < threads; i++)
+			{
+				sum += sums[i][row * rowSize + id];
+				count += counts[i][row * rowSize + id];
+			}
+			if (count > 0)
+			{
+				rows[row * rowSize + id] = 1 + (unsigned char)std::lround(254 * sum / count);
+				isFilled = true;
+			}
+		}
+		filledRows += isFilled;
+	}
+
+	PolicyHeader header = { { 'G', 'B', 'P', 'O', 'L', 'I', 'C', 'Y' }, version, rowCount };
+	std::ofstream file(path, std::ios::binary);
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)rows.data(), rows.size());
+	Console::setConsoleColor(file ? ConsoleColor::LightGreen : ConsoleColor::Red);
+	if (file)
+		Console::getStream() << "Политика Botbder'а записана в " << path << ": заполнено " << filledRows << " строк из " << rowCount << "." << std::endl;
+	else
+		Console::getStream() << "Не удалось записать политику в " << path << "!" << std::endl;
+}
+
+// Самоигра: в каждом состоянии Botbder'а поиск оценивает все карты руки, оценки копятся в строке состояния.
+// Игрок ходит случайно.
+void PolicyTable::buildWorker(unsigned int states, double secondsPerState, unsigned long long seed,
+	std::vector<double>& sums, std::vector<unsigned int>& counts)
+{
+	Random::seed(seed);
+	GreatBattle gb("Игрок");
+	SearchLimits limits = { secondsPerState, 10000000 };
+	float cardValues[64];
+	unsigned int searched = 0;
+	while (searched < states)
+	{
+		gb.reset();
+		BattleState state = gb.getState(BotbderAI::getScratchEvents());
+		while (!state.isOver() && searched < states)
+		{
+			const Player& mover = state.getPlayer(state.isBotbderTurn());
+			if (!state.isBotbderTurn())
+			{
+				state.applyMove(Random::next(mover.getCardCount()));
+				continue;
+			}
+			unsigned int ind = BotbderAI::chooseCard(state, limits, cardValues) - 1;
+			unsigned int row = getRow(state);
+			for (unsigned int id = 0; id < rowSize; id++)
+				if (cardValues[id] >= 0)
+				{
+					sums[row * rowSize + id] += cardValues[id];
+					counts[row * rowSize + id]++;
+				}
+			searched++;
+			state.applyMove(ind);
+		}
+	}
+}
+
+// ------------< Random >------------
+
+thread_local ChanceScript* Random::_script = nullptr;
+thread_local RandomState Random::_state = { { 0x180EC6D33CFD0ABAull, 0xD5A61266F0C9392Cull, 0xA9582618E03FC9AAull, 0x39ABDC4529B1661Cull } };
+
+void Random::seed(unsigned long long seed)
+{
+	_state = makeState(seed);
+}
+
+// Состояние xoshiro заполняется через splitmix64, чтобы близкие зёрна давали несвязанные последовательности.
+RandomState Random::makeState(unsigned long long seed)
+{
+	RandomState state;
+	for (int i = 0; i < 4; i++)
+	{
+		seed += 0x9E3779B97F4A7C15ull;
+		unsigned long long z = seed;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		state.s[i] = z ^ (z >> 31);
+	}
+	return state;
+}
+
+// Зерно для нового генератора (например, для новой битвы).
+unsigned long long Random::nextSeed()
+{
+	return nextRaw();
+}
+
+unsigned int Random::next(unsigned int n)
+{
+	if (_script)
+		return _script->next(n);
+	return (unsigned int)(((nextRaw() >> 32) * n) >> 32);
+}
+
+// Выбор с весами (веса должны быть положительными).
+unsigned int Random::choose(const unsigned int* weights, unsigned int n)
+{
+	if (_script)
+		return _script->choose(weights, n);
+	unsigned int total = 0;
+	for (unsigned int i = 0; i < n; i++)
+		total += weights[i];
+	unsigned int r = next(total);
+	unsigned int ind = 0;
+	while (r >= weights[ind])
+		r -= weights[ind++];
+	return ind;
+}
+
+ChanceScript* Random::getScript()
+{
+	return _script;
+}
+
+void Random::setScript(ChanceScript* script)
+{
+	_script = script;
+}
+
+void Random::swapState(RandomState& state)
+{
+	std::swap(_state, state);
+}
+
+unsigned long long Random::nextRaw()
+{
+	unsigned long long* s = _state.s;
+	unsigned long long x = s[1] * 5;
+	unsigned long long result = ((x << 7) | (x >> 57)) * 9;
+	unsigned long long t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = (s[3] << 45) | (s[3] >> 19);
+	return result;
+}
+
+// ------------< RandomScope >------------
+
+RandomScope::RandomScope(RandomState& state) : _state(state)
+{
+	Random::swapState(_state);
+}
+
+RandomScope::~RandomScope()
+{
+	Random::swapState(_state);
+}
+
+// ------------< Console >------------
+
+#ifdef _WIN32
+HANDLE Console::_hOut = GetStdHandle(STD_OUTPUT_HANDLE);
+#endif
+ConsoleBuffer Console::_buffer;
+std::ostream Console::_stream(&Console::_buffer);
+
+void Console::setRusLocale()
+{
+#ifdef _WIN32
+	SetConsoleOutputCP(1251);
+	SetConsoleCP(1251);
+#endif
+}
+
+void Console::setConsoleColor(ConsoleColor text, ConsoleColor background)
+{
+	_buffer.setColor(text, background);
+}
+
+// Поток вывода в консоль. Цвета для него задаются через setConsoleColor.
+std::ostream& Console::getStream()
+{
+	return _stream;
+}
+
+#ifdef _WIN32
+void Console::setAttribute(unsigned int color)
+{
+	SetConsoleTextAttribute(_hOut, (WORD)color);
+}
+#endif
+
+// ------------< ConsoleBuffer >------------
+
+#ifdef _WIN32
+ConsoleBuffer::ConsoleBuffer() : _buffer(), _color(~0u), _nextColor((unsigned int)ConsoleColor::White), _isAnsi(false) {}
+#else
+ConsoleBuffer::ConsoleBuffer() : _buffer(), _color(~0u), _nextColor((unsigned int)ConsoleColor::White), _isAnsi(isatty(STDOUT_FILENO)) {}
+#endif
+
+// Перед выходом цвета терминала возвращаются к обычным.
+ConsoleBuffer::~ConsoleBuffer()
+{
+	if (_isAnsi && _color != ~0u)
+		_buffer.append("\x1b[0m");
+	write();
+}
+
+
+void ConsoleBuffer::setColor(ConsoleColor text, ConsoleColor background)
+{
+	_nextColor = ((unsigned int)background << 4) | (unsigned int)text;
+}
+
+
+ConsoleBuffer::int_type ConsoleBuffer::overflow(int_type c)
+{
+	if (c != traits_type::eof())
+	{
+		applyColor();
+		_buffer.push_back((char)c);
+	}
+	return traits_type::not_eof(c);
+}
+
+std::streamsize ConsoleBuffer::xsputn(const char* s, std::streamsize n)
+{
+	applyColor();
+	_buffer.append(s, n);
+	return n;
+}
+
+int ConsoleBuffer::sync()
+{
+	write();
+	return 0;
+}
+
+
+// Цвета консоли Windows: биты синего, зелёного, красного и яркости. В ANSI порядок цветов обратный (красный,
+// зелёный, синий), яркие цвета текста - 90-97, фона - 100-107. Чёрный фон оставляется фоном терминала.
+void ConsoleBuffer::applyColor()
+{
+	if (_color == _nextColor)
+		return;
+	_color = _nextColor;
+#ifdef _WIN32
+	write();
+	Console::setAttribute(_color);
+#else
+	if (!_isAnsi)
+		return;
+	auto toAnsi = [](unsigned int color)
+	{
+		return ((color & 4) >> 2 | (color & 2) | (color & 1) << 2) + (color & 8 ? 60 : 0);
+	};
+	_buffer.append("\x1b[0;").append(std::to_string(30 + toAnsi(_color & 15)));
+	if (_color >> 4 != 0)
+		_buffer.append(";").append(std::to_string(40 + toAnsi(_color >> 4)));
+	_buffer.append("m");
+#endif
+}
+
+void ConsoleBuffer::write()
+{
+	if (_buffer.empty())
+		return;
+	std::fwrite(_buffer.data(), 1, _buffer.size(), stdout);
+	std::fflush(stdout);
+	_buffer.clear();
+}
+
+// ------------< Screen >------------
+
+Screen::Screen() : _parts(), _text(), _color(ConsoleColor::White) {}
+
+
+Screen& Screen::setColor(ConsoleColor color)
+{
+	_color = color;
+	return *this;
 }
 
-void GreatBattle::botbderMove(unsigned int ind)
+Screen& Screen::add(std::string_view text)
 {
-	Card card = CardManager::getCardByID(_botbder.getCardID(ind - 1));
-	Console::setConsoleColor(ConsoleColor::LightBlue);
-	std::cout << "Botbder использовал карту \"" << card.getName() << "\"!" << std::endl;
-	_botbder.move(_you, ind - 1);
+	if (_parts.empty() || _parts.back().color != _color)
+		_parts.push_back({ _color, "" });
+	_parts.back().text.append(text);
+	_text.append(text);
+	return *this;
 }
 
-bool GreatBattle::checkDead() const
+void Screen::show(std::ostream& out, bool isColored) const
 {
-	Console::setConsoleColor(ConsoleColor::Blue);
-	if (_you.isDead() && !_botbder.isDead())
+	if (!isColored)
 	{
-		std::cout << "Упс... Вы проиграли, " << _you.getName() << ", хе-хе!" << std::endl;
-		return true;
+		out << _text;
+		return;
 	}
-	if (!_you.isDead() && _botbder.isDead())
+	for (const ScreenPart& part: _parts)
 	{
-		std::cout << "Е-ей! Вы выиграли, " << _you.getName() << "! :D Восславим же Аркану!" << std::endl;
-		return true;
+		Console::setConsoleColor(part.color);
+		out << part.text;
 	}
-	if (_you.isDead() && _botbder.isDead())
+}
+
+// ------------< Command >------------
+
+// Строка делится по пробелам; как и раньше, два пробела подряд дают пустой аргумент.
+Command::Command(std::string_view input) : _cmd(), _args(), _argCount(0)
+{
+	size_t pos = input.find(' ');
+	_cmd = input.substr(0, pos);
+	while (pos != std::string_view::npos && _argCount < maxArgs)
 	{
-		std::cout << "Аммок меня побери, вы оба проиграли!? Ну ничёси..." << std::endl;
-		return true;
+		input.remove_prefix(pos + 1);
+		if (input.empty())
+			break;
+		pos = input.find(' ');
+		_args[_argCount++] = input.substr(0, pos);
 	}
-	return false;
 }
 
-// ------------< CardManager >------------
+// Все команды начинаются с '!' - остальные строки (обычный чат) отсекаются без разбора.
+bool Command::isCommand(std::string_view input)
+{
+	return !input.empty() && input[0] == '!';
+}
 
-std::vector<Card> CardManager::_availableCards;
-std::vector<unsigned int> CardManager::_epicCardIDs, CardManager::_forPlayerCardIDs, CardManager::_forBotbderCardIDs;
 
-void CardManager::initCards()
+std::string_view Command::getCommand() const
 {
-	initEpicCards();
-	initCommonCards();
-	initPlayerCards();
-	initBotbderCards();
+	return _cmd;
 }
 
-Card CardManager::getCardByID(unsigned int id)
+std::string_view Command::getArg(unsigned int ind) const
 {
-	if (1 <= id && id <= _availableCards.size())
-		return _availableCards[id - 1];
-	return Card();
+	if (ind >= _argCount)
+		return "";
+	return _args[ind];
 }
 
-unsigned int CardManager::getAllCardsCount()
+Keyword Command::getKeyword() const
 {
-	return _availableCards.size();
+	return findKeyword(_cmd);
 }
 
-unsigned int CardManager::getNewID(bool isBotbder)
+Keyword Command::getArgKeyword(unsigned int ind) const
 {
-	unsigned int ind, id;
-	if (isBotbder)
-	{
-		ind = rand() % _forBotbderCardIDs.size();
-		id = _forBotbderCardIDs[ind];
-		if (CardManager::getCardByID(id).getType() == CardType::Epic)
-		{
-			ind = rand() % _forBotbderCardIDs.size();
-			id = _forBotbderCardIDs[ind];
-			if (CardManager::getCardByID(id).getType() == CardType::Epic)
-				_forBotbderCardIDs.erase(_forBotbderCardIDs.begin() + ind);
-		}
-	}
-	else
-	{
-		ind = rand() % _forPlayerCardIDs.size();
-		id = _forPlayerCardIDs[ind];
-		if (CardManager::getCardByID(id).getType() == CardType::Epic)
-		{
-			ind = rand() % _forPlayerCardIDs.size();
-			id = _forPlayerCardIDs[ind];
-			if (CardManager::getCardByID(id).getType() == CardType::Epic)
-				_forPlayerCardIDs.erase(_forPlayerCardIDs.begin() + ind);
-		}
-	}
-	return id;
+	return findKeyword(getArg(ind));
 }
 
-unsigned int CardManager::getRandomID(bool isBotbder)
+unsigned int Command::getArgCount() const
 {
-	if (isBotbder)
-		return _forBotbderCardIDs[rand() % _forBotbderCardIDs.size()];
-	else
-		return _forPlayerCardIDs[rand() % _forPlayerCardIDs.size()];
+	return _argCount;
 }
 
-void CardManager::restoreEpicCards()
+// Число без знака; пустая строка, посторонние символы и переполнение числом не считаются.
+bool Command::getUnsignedNumber(unsigned int ind, unsigned int& number) const
 {
-	for (int i = 0; i < _availableCards.size(); i++)
-		if (_availableCards[i].getType() == CardType::Epic)
-		{
-			if (std::find(_forBotbderCardIDs.begin(), _forBotbderCardIDs.end(), i + 1) == _forBotbderCardIDs.end())
-				_forBotbderCardIDs.push_back(i + 1);
-			if (std::find(_forPlayerCardIDs.begin(), _forPlayerCardIDs.end(), i + 1) == _forPlayerCardIDs.end())
-				_forPlayerCardIDs.push_back(i + 1);
-		}
+	std::string_view arg = getArg(ind);
+	auto [end, error] = std::from_chars(arg.data(), arg.data() + arg.size(), number);
+	return !arg.empty() && error == std::errc() && end == arg.data() + arg.size();
 }
 
-
-void CardManager::addNewCard(CardType type, std::string name, std::string description, MoveFunc move, MoveFunc nextMove)
+// FNV-1a с примешанным seed.
+constexpr unsigned int Command::hashWord(std::string_view word, unsigned int seed)
 {
-	_availableCards.push_back(Card(type, name, description, move, nextMove));
-	unsigned int id = _availableCards.size();
-	switch (type)
-	{
-	case CardType::Epic:
-		_epicCardIDs.push_back(id);
-		_forPlayerCardIDs.push_back(id);
-		_forBotbderCardIDs.push_back(id);
-		break;
-	case CardType::Common:
-		_forPlayerCardIDs.push_back(id);
-		_forBotbderCardIDs.push_back(id);
-		break;
-	case CardType::Player:
-		_forPlayerCardIDs.push_back(id);
-		break;
-	case CardType::Botbder:
-		_forBotbderCardIDs.push_back(id);
-		break;
-	}
+	unsigned int hash = 2166136261u ^ seed;
+	for (char c: word)
+		hash = (hash ^ (unsigned char)c) * 16777619u;
+	return hash;
 }
 
-void CardManager::initEpicCards()
+constexpr KeywordTable Command::makeKeywordTable()
 {
-	addNewCard(CardType::Epic, "Конструктор Парадоксов (Посох Мудреца)",
-		"Наносит случайным образом 4 ед. урона вам, противнику или обоим сразу.",
-		[](Player& p, Player& e)
-		{
-			int d3 = rand() % 3;
-			switch (d3)
-			{
-			case 0:
-				p.damage(4);
-				break;
-			case 1:
-				e.damage(4);
-				break;
-			case 2:
-				p.damage(4);
-				e.damage(4);
-				break;
-			}
-		},
-		nullptr
-		);
-	addNewCard(CardType::Epic, "Курохай (Катана Изаму)",
-		"Наносит противнику 1 ед. урона и еще 2 ед. урона на следующий ход.",
-		[](Player& p, Player& e)
-		{
-			e.damage(1);
-		},
-		[](Player& p, Player& e)
-		{
-			e.damage(2);
-		}
-	);
-	addNewCard(CardType::Epic, "Меч Земли (Клинок Трискелиона)",
-		"Наносит 2 ед. урона и добавляет вам 1 жизнь.",
-		[](Player& p, Player& e)
-		{
-			e.damage(2);
-			p.heal(1);
-		},
-		nullptr
-	);
-	addNewCard(CardType::Epic, "Меч Небес (Клинок Трискелиона)",
-		"Наносит случайным образом 1, 2 или 3 ед. урона.",
-		[](Player& p, Player& e)
-		{
-			e.damage(rand() % 3 + 1);
-		},
-		nullptr
-	);
-	addNewCard(CardType::Epic, "Меч Морей (Клинок Трискелиона)",
-		"Наносит 2 ед. урона, противник пропускает ход.",
-		[](Player& p, Player& e)
-		{
-			e.damage(2);
-			p.addExtraMoves(1);
-		},
-		nullptr
-	);
-	addNewCard(CardType::Epic, "Алое Пламя (Перстень Зариака)",
-		"В следующий ход нанесет 2 ед. урона противнику.",
-		nullptr,
-		[](Player& p, Player& e)
+	constexpr std::string_view words[] = { "!помощь", "!выход", "!битва", "карты", "инфо", "противник", "подсказка",
+		"сложность", "лёгкая", "обычная", "сложная", "пересдать", "стат", "задержки", "вызов", "смотреть" };
+	constexpr Keyword keywords[] = { Keyword::Help, Keyword::Exit, Keyword::Battle, Keyword::Cards, Keyword::Info, Keyword::Adversary,
+		Keyword::Hint, Keyword::Difficulty, Keyword::Easy, Keyword::Normal, Keyword::Hard, Keyword::Retake,
+		Keyword::Stats, Keyword::Latency, Keyword::Challenge, Keyword::Watch };
+	static_assert(std::size(words) == std::size(keywords));
+
+	for (unsigned int seed = 0; ; seed++)
+	{
+		KeywordTable table = {};
+		table.seed = seed;
+		bool isPerfect = true;
+		for (unsigned int i = 0; i < std::size(words) && isPerfect; i++)
 		{
-			e.damage(2);
+			unsigned int ind = hashWord(words[i], seed) % KeywordTable::size;
+			isPerfect = table.keywords[ind] == Keyword::None;
+			table.words[ind] = words[i];
+			table.keywords[ind] = keywords[i];
 		}
-	);
-	addNewCard(CardType::Epic, "Доспех Чёрной Розы (Броня Лорда Рейвена)",
-		"Добавляет вам 2 жизни.",
-		[](Player& p, Player& e)
-		{
-			p.heal(2);
-		},
-		nullptr
-	);
-	addNewCard(CardType::Epic, "Яропламень (Меч Князя Велемира)",
-		"Наносит 3 ед. урона.",
-		[](Player& p, Player& e)
-		{
-			e.damage(3);
-		},
-		nullptr
-	);
-	 addNewCard(CardType::Epic, "Глаз Суккуба (Амулет Мизерис)",
-		"Противник пропускает 2 хода.",
-		[](Player& p, Player& e)
-		{
-			p.addExtraMoves(2);
-		},
-		nullptr
-	);
-}
-
-void CardManager::initCommonCards()
-{
-	addNewCard(CardType::Common, "Алмазный меч", "Наносит 1 ед. урона.",
-		[](Player& p, Player& e) { e.damage(1); }, nullptr);
-	addNewCard(CardType::Common, "Рунический щит", "Добавляет 2 жизни.",
-		[](Player& p, Player& e) { p.heal(2); }, nullptr);
-	addNewCard(CardType::Common, "Костяной лук", "Наносит 1 или 2 ед. урона.",
-		[](Player& p, Player& e) { e.damage(rand() % 2 + 1); }, nullptr);
-	addNewCard(CardType::Common, "Зелье лечения", "Восстанавливает 1 жизнь.",
-		[](Player& p, Player& e) { p.heal(1); }, nullptr);
-	addNewCard(CardType::Common, "Зелье регенерации", "Восстанавливает 1 жизнь в следующий ваш ход.",
-		nullptr, [](Player& p, Player& e) { p.heal(1); });
-	addNewCard(CardType::Common, "TNT", "Наносит вам и противнику 3 ед. урона.",
-		[](Player& p, Player& e) { p.damage(3); e.damage(3); }, nullptr);
-	addNewCard(CardType::Common, "Деревянный топор", "С вероятность 30% наносит 1 ед. урона.",
-		[](Player& p, Player& e) { if (rand() % 10 < 3) e.damage(1); }, nullptr);
-	addNewCard(CardType::Common, "MRU-пушка", "Наносит 3 ед. урона.",
-		[](Player& p, Player& e) { e.damage(3); }, nullptr);
-	addNewCard(CardType::Common, "Бумеранг", "Наносит 1 ед. урона, предмет не теряется после использования.",
-		[](Player& p, Player& e) { e.damage(1); p.addNewCard(18); }, nullptr);
-	addNewCard(CardType::Common, "Алмазная броня", "Добавляет 1 жизнь.",
-		[](Player& p, Player& e) { p.heal(1); }, nullptr);
-	addNewCard(CardType::Common, "Ведро лавы", "Наносит вам и противнику 1 ед. урона.",
-		[](Player& p, Player& e) { p.damage(1); e.damage(1); }, nullptr);
-	addNewCard(CardType::Common, "Хитрый механизм", "Вы или противник пропускает ход, определяется случайным образом.",
-		[](Player& p, Player& e) { if (rand() % 2 == 0) p.addExtraMoves(1); else e.addExtraMoves(1); }, nullptr);
-	addNewCard(CardType::Common, "Блок булыжника", "Ничего не делает, просто занимает место и пропадает при использовании.",
-		nullptr, nullptr);
-	addNewCard(CardType::Common, "Ихориевый меч", "Наносит 4 ед. урона.",
-		[](Player& p, Player& e) { e.damage(4); }, nullptr);
-	addNewCard(CardType::Common, "Золотой меч", "Наносит 1 ед урона с вероятностью в 50%.",
-		[](Player& p, Player& e) { if (rand() % 2 == 0 == 1) e.damage(1); }, nullptr);
-	addNewCard(CardType::Common, "Посох тауматурга", "Наносит 2 ед. урона.",
-		[](Player& p, Player& e) { e.damage(2); }, nullptr);
-	addNewCard(CardType::Common, "Кровавый меч", "Наносит 1 ед урона и восстанавливает вам 1 жизнь.",
-		[](Player& p, Player& e) { e.damage(1); p.heal(1); }, nullptr);
-	addNewCard(CardType::Common, "Жертвенный кинжал", "Наносит вам 1 ед. урона.",
-		[](Player& p, Player& e) { p.damage(1); }, nullptr);
-	addNewCard(CardType::Common, "Снежок", "Противник пропускает ход, с 50% вероятности наносит 1 ед. урона.",
-		[](Player& p, Player& e) { p.addExtraMoves(1); if (rand() % 2 == 0) e.damage(1); }, nullptr);
-	addNewCard(CardType::Common, "Взрывное зелье исцеления", "Восстанавливает вам и противнику 1 ед. здоровья.",
-		[](Player& p, Player& e) { p.heal(1); e.heal(1); }, nullptr);
-	addNewCard(CardType::Common, "Верстак", "Вы получаете две карты.",
-		[](Player& p, Player& e) { p.addNewCard(CardManager::getNewID(p.isBotbder()));
-								   p.addNewCard(CardManager::getNewID(p.isBotbder())); }, nullptr);
-
-	addNewCard(CardType::Common, "Взрывное зелье отравления", "Наносит 1 ед. урона вам и противнику в следующий ваш ход.",
-		nullptr, [](Player& p, Player& e) { p.damage(1); e.damage(1); });
-	addNewCard(CardType::Common, "Взрывное зелье урона", "Наносит вам и противнику 1 ед. урона.",
-		[](Player& p, Player& e) { p.damage(1); e.damage(1); }, nullptr);
-	addNewCard(CardType::Common, "Варочная стойка", "Даёт два случайных зелья.",
-		[](Player& p, Player& e)
-		{
-			int potionIDs[5] = { 13, 14, 29, 31, 32 };
-			p.addNewCard(potionIDs[rand() % 5]);
-			p.addNewCard(potionIDs[rand() % 5]);
-		}, nullptr);
+		if (isPerfect)
+			return table;
+	}
 }
 
-void CardManager::initPlayerCards()
-{
-	addNewCard(CardType::Player, "Непонятная ерунда", "Активирует эффект случайного предмета.",
-		[](Player& p, Player& e)
-		{
-			p.useCard(e, CardManager::getRandomID(false));
-		}, nullptr);
-}
+constexpr KeywordTable Command::_keywords = makeKeywordTable();
 
-void CardManager::initBotbderCards()
+constexpr Keyword Command::findKeyword(std::string_view word)
 {
-	addNewCard(CardType::Botbder, "Краш", "Игрок пропускает ход и получает 1 ед. урона.",
-		[](Player& p, Player& e) { p.addExtraMoves(1); e.damage(1); }, nullptr);
-	addNewCard(CardType::Botbder, "ID-конфликт", "Заменяет игроку один предмет на другой случайный.",
-		[](Player& p, Player& e) { e.generateIDConflict(); }, nullptr);
-	addNewCard(CardType::Botbder, "Дисконнект", "Игрок пропускает два хода.",
-		[](Player& p, Player& e) { p.addExtraMoves(2); }, nullptr);
+	unsigned int ind = hashWord(word, _keywords.seed) % KeywordTable::size;
+	if (_keywords.keywords[ind] == Keyword::None || _keywords.words[ind] != word)
+		return Keyword::None;
+	return _keywords.keywords[ind];
 }
 
-// ------------< Console >------------
+static_assert(Command::findKeyword("!битва") == Keyword::Battle && Command::findKeyword("пересдать") == Keyword::Retake);
+static_assert(Command::findKeyword("битва") == Keyword::None && Command::findKeyword("") == Keyword::None);
 
-HANDLE Console::_hOut = GetStdHandle(STD_OUTPUT_HANDLE);
+// ------------< Hand >------------
 
-void Console::setRusLocale()
+Hand::Hand() : _size(0), _ids() {}
+
+
+bool Hand::add(unsigned int id)
 {
-	SetConsoleOutputCP(1251);
-	SetConsoleCP(1251);
+	if (isFull())
+		return false;
+	_ids[_size++] = id;
+	return true;
 }
 
-void Console::setConsoleColor(ConsoleColor text, ConsoleColor background)
+// Удаление с сохранением порядка карт - номера карт в руке видит игрок.
+void Hand::remove(unsigned int ind)
 {
-	SetConsoleTextAttribute(_hOut, (WORD)(((unsigned)background << 4) | (unsigned)text));
+	for (unsigned int i = ind + 1; i < _size; i++)
+		_ids[i - 1] = _ids[i];
+	_size--;
 }
 
-// ------------< Command >------------
+// Быстрое удаление без сохранения порядка: на место карты встаёт последняя.
+void Hand::swapRemove(unsigned int ind)
+{
+	_ids[ind] = _ids[--_size];
+}
 
-Command::Command(std::string input)
+void Hand::set(unsigned int ind, unsigned int id)
 {
-	std::stringstream ss(input);
-	std::getline(ss, _cmd, ' ');
-	
-	std::string arg;
-	while (std::getline(ss, arg, ' '))
-		_args.push_back(arg);
+	_ids[ind] = id;
 }
 
+void Hand::clear()
+{
+	_size = 0;
+}
 
-std::string Command::getCommand() const
+
+unsigned int Hand::get(unsigned int ind) const
 {
-	return _cmd;
+	return _ids[ind];
 }
 
-std::string Command::getArg(unsigned int ind) const
+unsigned int Hand::size() const
 {
-	if (ind >= _args.size())
-		return "";
-	return _args[ind];
+	return _size;
 }
 
-unsigned int Command::getArgCount() const
+bool Hand::isFull() const
 {
-	return _args.size();
+	return _size == capacity;
 }
 
-bool Command::isUnsignedNumber(unsigned int ind) const
+// ------------< EffectWheel >------------
+
+EffectWheel::EffectWheel() : _now(0), _counts(), _effects() {}
+
+
+// Регистрирует эффект карты на turns ходов подряд, начиная через delay ходов (0 - в конце текущего хода).
+// Если ячейка хода заполнена, эффект теряется, как карта, не влезшая в руку.
+bool EffectWheel::schedule(unsigned int cardID, unsigned int delay, unsigned int turns)
 {
-	if (ind >= _args.size())
+	unsigned int slot = (_now + delay) % size;
+	if (_counts[slot] == slotCapacity)
 		return false;
-	std::string s = _args[ind];
-	for (char c: s)
-		if (c < '0' || c > '9')
-			return false;
+	_effects[slot][_counts[slot]++] = { (unsigned char)cardID, (unsigned char)turns };
 	return true;
 }
 
-// ------------< Player >------------
+// Переход к следующему ходу: ячейка текущего хода освобождается и становится последней в колесе.
+void EffectWheel::advance()
+{
+	_counts[_now] = 0;
+	_now = (_now + 1) % size;
+}
 
-Player::Player(bool isBotbder) : _name(""), _isBotbder(isBotbder), _health(5), _extraMoves(0), _prevCardID(0) {}
+void EffectWheel::clear()
+{
+	for (unsigned char& count: _counts)
+		count = 0;
+}
 
+unsigned int EffectWheel::getCount(unsigned int delay) const
+{
+	return _counts[(_now + delay) % size];
+}
 
-std::string Player::getName() const
+EffectWheel::Effect EffectWheel::get(unsigned int delay, unsigned int ind) const
 {
-	return _name;
+	return _effects[(_now + delay) % size][ind];
 }
 
+// ------------< Player >------------
+
+Player::Player(bool isBotbder, EventLog& events, Deck& deck) : _isBotbder(isBotbder), _health(5), _extraMoves(0),
+	_effects(), _events(&events), _deck(&deck) {}
+
+
 bool Player::isBotbder() const
 {
 	return _isBotbder;
@@ -800,10 +7366,22 @@ unsigned int Player::getExtraMovesCount() const
 	return _extraMoves;
 }
 
+// Карта, чей отложенный эффект сработает первым в конце следующего хода игрока (0 - такой нет).
+unsigned int Player::getPendingCardID() const
+{
+	return _effects.getCount(0) > 0 ? _effects.get(0, 0).cardID : 0;
+}
+
+const EffectWheel& Player::getEffects() const
+{
+	return _effects;
+}
+
 
-void Player::setName(std::string name)
+void Player::bind(EventLog& events, Deck& deck)
 {
-	_name = name;
+	_events = &events;
+	_deck = &deck;
 }
 
 void Player::setHealth(unsigned int hp)
@@ -811,116 +7389,324 @@ void Player::setHealth(unsigned int hp)
 	_health = hp;
 }
 
+void Player::setExtraMovesCount(unsigned int moves)
+{
+	_extraMoves = moves;
+}
+
+// Оставляет один отложенный эффект - карты id в конце следующего хода (для состояний, где других не бывает).
+void Player::setPendingCardID(unsigned int id)
+{
+	_effects.clear();
+	if (CardManager::getCardByID(id).hasNextMove())
+		_effects.schedule(id, 0, CardManager::getCardByID(id).getDuration());
+}
+
+void Player::clearEffects()
+{
+	_effects.clear();
+}
+
 void Player::damage(unsigned int hp)
 {
 	if (_health < hp)
 		_health = 0;
 	else
 		_health -= hp;
-	Console::setConsoleColor(ConsoleColor::LightRed);
-	std::cout << "Игроку " << _name << " был нанесён урон в " << hp << " ед." << std::endl;
+	_events->push(EventType::Damage, _isBotbder, hp);
 }
 
 void Player::heal(unsigned int hp)
 {
 	_health += hp;
-	Console::setConsoleColor(ConsoleColor::LightRed);
-	std::cout << "Игрок " << _name << " исцелился на " << hp << " ед." << std::endl;
+	_events->push(EventType::Heal, _isBotbder, hp);
 }
 
 void Player::addExtraMoves(unsigned int moves)
 {
 	_extraMoves += moves;
-	Console::setConsoleColor(ConsoleColor::LightRed);
-	std::cout << "Игрок " << _name << " получил дополнительные " << moves << " ход(а)." << std::endl;
+	_events->push(EventType::ExtraMoves, _isBotbder, moves);
 }
 
 void Player::generateIDConflict()
 {
-	unsigned int ind = rand() % _cardIDs.size();
-	_cardIDs[ind] = CardManager::getRandomID(_isBotbder);
+	if (_hand.size() == 0)
+		return;
+	unsigned int ind = Random::next(_hand.size());
+	_hand.set(ind, _deck->getRandomID(_isBotbder));
 }
 
 
 void Player::retakeCards()
 {
-	_cardIDs.clear();
+	_hand.clear();
 	for (int i = 0; i < 3; i++)
-		addNewCard(CardManager::getNewID(_isBotbder));
+		drawCard();
+}
+
+void Player::drawCard()
+{
+	addNewCard(_deck->getNewID(_isBotbder));
 }
 
 void Player::addNewCard(unsigned int id)
 {
-	_cardIDs.push_back(id);
+	if (_hand.add(id))
+		_events->push(EventType::CardDrawn, _isBotbder, id);
+}
+
+// Действие карты: её эффект сейчас и регистрация её отложенного эффекта.
+void Player::applyCard(Player& enemy, unsigned int id)
+{
+	const Card& card = CardManager::getCardByID(id);
+	card.move(*this, enemy);
+	if (CardStats::isEnabled())
+		CardStats::countEffect(id, false, *this, enemy);
+	if (card.hasNextMove())
+		_effects.schedule(id, card.getDelay(), card.getDuration());
+}
+
+// Конец хода: срабатывают отложенные эффекты этого хода. Эффект на несколько ходов регистрируется на следующий ход.
+void Player::fireEffects(Player& enemy)
+{
+	for (unsigned int i = 0; i < _effects.getCount(0); i++)
+	{
+		EffectWheel::Effect effect = _effects.get(0, i);
+		CardManager::getCardByID(effect.cardID).nextMove(*this, enemy);
+		if (CardStats::isEnabled())
+			CardStats::countEffect(effect.cardID, true, *this, enemy);
+		if (effect.turns > 1)
+			_effects.schedule(effect.cardID, 1, effect.turns - 1);
+	}
+	_effects.advance();
 }
 
+// Ход картой. В ходах битвы (не в ходах поиска) действия карт и отложенные эффекты считаются в CardStats.
 void Player::useCard(Player& enemy, unsigned int id)
 {
-	CardManager::getCardByID(id).move(*this, enemy);
-	CardManager::getCardByID(_prevCardID).nextMove(*this, enemy);
-	_prevCardID = id;
+	if (CardStats::isEnabled())
+		CardStats::startTurn(*this, enemy);
+	applyCard(enemy, id);
+	fireEffects(enemy);
 }
 
 void Player::move(Player& enemy, unsigned int ind)
 {
 	if (_extraMoves > 0)
 		_extraMoves--;
-	useCard(enemy, _cardIDs[ind]);
-	_cardIDs.erase(_cardIDs.begin() + ind);
+	// Карта уходит из руки до применения, чтобы выданные ею карты (Бумеранг) не упёрлись в полную руку.
+	unsigned int id = _hand.get(ind);
+	_hand.remove(ind);
+	_events->push(EventType::CardPlayed, _isBotbder, id);
+	useCard(enemy, id);
 }
 
 
 unsigned int Player::getCardID(unsigned int ind) const
 {
-	if (ind < _cardIDs.size())
-		return _cardIDs[ind];
+	if (ind < _hand.size())
+		return _hand.get(ind);
 	return 0;
 }
 
 unsigned int Player::getCardCount() const
 {
-	return _cardIDs.size();
+	return _hand.size();
 }
 
 void Player::removeAllCards()
 {
-	_cardIDs.clear();
-	_prevCardID = 0;
+	_hand.clear();
+	_effects.clear();
 }
 
-// ------------< Card >------------
+void Player::save(PlayerRecord& record) const
+{
+	record.health = std::min(_health, 0xFFFFu);
+	record.extraMoves = std::min(_extraMoves, 0xFFu);
+	record.cardCount = _hand.size();
+	for (unsigned int i = 0; i < _hand.size(); i++)
+		record.cards[i] = _hand.get(i);
+	record.effectCounts = 0;
+	unsigned int count = 0;
+	for (unsigned int delay = 0; delay < EffectWheel::size; delay++)
+	{
+		record.effectCounts |= _effects.getCount(delay) << (2 * delay);
+		for (unsigned int i = 0; i < _effects.getCount(delay); i++)
+		{
+			EffectWheel::Effect effect = _effects.get(delay, i);
+			record.effects[count++] = effect.cardID | (effect.turns << 6);
+		}
+	}
+}
 
-Card::Card() : _type(CardType::Common), _name("???"), _description("Вы забудете о моём существовании."),
-_move(nullptr), _nextMove(nullptr) {}
+// События вытягивания карт не пишутся: игрок уже видел эти карты до сохранения. ID карт - с 1, карты
+// с ID вне каталога пропускаются.
+void Player::load(const PlayerRecord& record)
+{
+	_health = record.health;
+	_extraMoves = record.extraMoves;
+	_hand.clear();
+	for (unsigned int i = 0; i < record.cardCount && i < Hand::capacity; i++)
+		if (record.cards[i] != 0 && record.cards[i] <= CardManager::getAllCardsCount())
+			_hand.add(record.cards[i]);
+	_effects.clear();
+	unsigned int count = 0;
+	for (unsigned int delay = 0; delay < EffectWheel::size; delay++)
+		for (unsigned int i = 0; i < ((record.effectCounts >> (2 * delay)) & 3u); i++, count++)
+			_effects.schedule(record.effects[count] & 0x3F, delay, record.effects[count] >> 6);
+}
 
-Card::Card(CardType type, std::string name, std::string description, MoveFunc move, MoveFunc nextMove) :
-	_type(type), _name(name), _description(description), _move(move), _nextMove(nextMove) {}
 
+Deck& Player::getDeck() const
+{
+	return *_deck;
+}
 
-CardType Card::getType() const
+EventLog& Player::getEvents() const
 {
-	return _type;
+	return *_events;
 }
 
-std::string Card::getName() const
+// ------------< Deck >------------
+
+Deck::Deck(bool isDuel) : _isDuel(isDuel)
 {
-	return _name;
+	restoreEpicCards();
 }
 
-std::string Card::getDescription() const
+
+void Deck::restoreEpicCards()
 {
-	return _description;
+	constexpr unsigned long long epicMask = CardManager::getEpicMask();
+	_epicMask[0] = _epicMask[1] = epicMask;
 }
 
+// Как и раньше: если выпала эпическая карта, тянем ещё раз, и только повторно выпавшая эпическая карта уходит из колоды.
+unsigned int Deck::getNewID(bool isBotbder)
+{
+	if (Random::getScript())
+		return getNewIDScripted(isBotbder);
+	bool isEpic;
+	unsigned int id = pickID(isBotbder, isEpic);
+	if (isEpic)
+	{
+		id = pickID(isBotbder, isEpic);
+		if (isEpic)
+			_epicMask[isBotbder] &= ~(1ull << id);
+	}
+	return id;
+}
 
-void Card::move(Player& player, Player& enemy) const
+// При переборе исходов оба вытягивания сводятся к одному выбору с тем же распределением: из n карт колоды
+// (k из них эпические) обычная карта выпадает с весом n + k, а каждая эпическая (и уходит из колоды) - с весом k.
+// Если исходы добора не важны (ход на горизонте расчёта), берётся просто первая карта.
+unsigned int Deck::getNewIDScripted(bool isBotbder)
 {
-	if (_move)
-		_move(player, enemy);
+	const DrawTable& table = CardManager::getDrawTable(isBotbder && !_isDuel);
+	if (Random::getScript()->isDrawCollapsed())
+		return table.ids[0];
+
+	unsigned long long mask = _epicMask[isBotbder];
+	unsigned int epicCount = std::popcount(mask), count = table.size + epicCount;
+	unsigned int ids[64], weights[64] = {};
+	for (unsigned int i = 0; i < table.size; i++)
+	{
+		ids[i] = table.ids[i];
+		weights[i] = count + epicCount;
+	}
+	for (unsigned int i = table.size; mask != 0; i++, mask &= mask - 1)
+	{
+		ids[i] = std::countr_zero(mask);
+		weights[i] = epicCount;
+	}
+	unsigned int ind = Random::choose(weights, count);
+	if (ind >= table.size)
+		_epicMask[isBotbder] &= ~(1ull << ids[ind]);
+	return ids[ind];
 }
 
-void Card::nextMove(Player& player, Player& enemy) const
+unsigned int Deck::getRandomID(bool isBotbder) const
 {
-	if (_nextMove)
-		_nextMove(player, enemy);
+	bool isEpic;
+	return pickID(isBotbder, isEpic);
+}
+
+unsigned long long Deck::getEpicMask(bool isBotbder) const
+{
+	return _epicMask[isBotbder];
+}
+
+void Deck::setEpicMask(bool isBotbder, unsigned long long mask)
+{
+	_epicMask[isBotbder] = mask & CardManager::getEpicMask();
+}
+
+// Равновероятный выбор среди обычных карт стороны и оставшихся у неё эпических карт.
+unsigned int Deck::pickID(bool isBotbder, bool& isEpic) const
+{
+	const DrawTable& table = CardManager::getDrawTable(isBotbder && !_isDuel);
+	unsigned long long mask = _epicMask[isBotbder];
+	unsigned int ind = Random::next(table.size + std::popcount(mask));
+	isEpic = ind >= table.size;
+	if (!isEpic)
+		return table.ids[ind];
+	for (ind -= table.size; ind > 0; ind--)
+		mask &= mask - 1;
+	return std::countr_zero(mask);
+}
+
+// ------------< EventLog >------------
+
+EventLog::EventLog() : _events(), _end(0) {}
+
+
+void EventLog::push(EventType type, bool isBotbder, unsigned int value)
+{
+	BattleEvent& event = _events[_end % capacity];
+	event.type = type;
+	event.isBotbder = isBotbder;
+	event.value = value;
+	_end++;
+}
+
+void EventLog::clear()
+{
+	_end = 0;
+}
+
+
+unsigned long long EventLog::getBegin() const
+{
+	return _end > capacity ? _end - capacity : 0;
+}
+
+unsigned long long EventLog::getEnd() const
+{
+	return _end;
+}
+
+const BattleEvent& EventLog::get(unsigned long long pos) const
+{
+	return _events[pos % capacity];
+}
+
+// ------------< EventReader >------------
+
+EventReader::EventReader(const EventLog& log) : _log(&log), _pos(log.getEnd()) {}
+
+
+bool EventReader::next(BattleEvent& event)
+{
+	if (_pos < _log->getBegin())
+		_pos = _log->getBegin();
+	if (_pos >= _log->getEnd())
+		return false;
+	event = _log->get(_pos++);
+	return true;
+}
+
+void EventReader::skipAll()
+{
+	_pos = _log->getEnd();
 }
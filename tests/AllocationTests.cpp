@@ -0,0 +1,208 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Счётчик выделений из общей кучи во всех потоках. Считаются только выделения, пока счётчик включён.
+static std::atomic<bool> isCounting(false);
+static std::atomic<unsigned long long> allocations(0);
+
+void* operator new(std::size_t size)
+{
+	if (isCounting.load(std::memory_order_relaxed))
+		allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size > 0 ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+#include "GreatBattle.cpp"
+#include "tests/Check.h"
+
+#include <poll.h>
+
+// Установившаяся игра не ходит в общую кучу: после разогрева битвы со зрителями трансляции и сессии чата,
+// которые ведёт SessionScheduler, играют и отвечают без единого выделения памяти.
+
+static const std::string_view commands[] = { "!битва 1", "!битва 2", "!битва 3", "!битва инфо", "!битва противник",
+	"!битва пересдать", "!битва сложность лёгкая" };
+
+static unsigned long long countAllocations(const std::function<void()>& work)
+{
+	allocations = 0;
+	isCounting = true;
+	work();
+	isCounting = false;
+	return allocations.load();
+}
+
+// Битвы в одном потоке, у каждой трансляция со зрителем. Запись битв идёт в журнал.
+static void testBattles()
+{
+	const unsigned int battleCount = 50;
+	Random::seed(1);
+	ReplayLog replayLog;
+	CHECK(replayLog.open("AllocationTests.replay"));
+	std::string output;
+	output.reserve(ChatSession::outputReserve);
+	std::ostringstream out(std::move(output));
+	std::vector<std::unique_ptr<SpectatorFeed>> feeds;
+	std::vector<std::unique_ptr<GreatBattle>> battles;
+	for (unsigned int i = 0; i < battleCount; i++)
+	{
+		feeds.push_back(std::make_unique<SpectatorFeed>());
+		feeds.back()->addSpectator();
+		battles.push_back(std::make_unique<GreatBattle>("зритель_с_длинным_ником_" + std::to_string(i), out));
+		battles.back()->setReplayLog(&replayLog);
+		battles.back()->setFeed(feeds.back().get());
+		// У лёгкого Botbder'а нет поиска с ограничением по времени, так что прогон повторяется в точности.
+		battles.back()->handleInput("!битва сложность лёгкая");
+	}
+	std::vector<unsigned long long> positions(battleCount, 0);
+	std::string text;
+	text.reserve(ChatSession::outputReserve);
+	unsigned long long published = 0;
+	auto play = [&](unsigned int count)
+	{
+		for (unsigned int i = 0; i < count; i++)
+		{
+			unsigned int ind = Random::next(battleCount);
+			battles[ind]->handleInput(commands[Random::next(std::size(commands))]);
+			out.str("");
+			unsigned long long skipped;
+			while (feeds[ind]->read(positions[ind], skipped, text))
+			{
+				positions[ind]++;
+				published++;
+			}
+		}
+	};
+
+	play(100000);
+	unsigned long long heap = countAllocations([&] { play(100000); });
+	std::cout << "Битвы: выделений за 100000 команд после разогрева: " << heap << ", ходов трансляции: " << published << std::endl;
+	CHECK(heap == 0);
+	CHECK(published > 0);
+
+	// Память битвы видна в её статистике.
+	battles[0]->handleInput("!битва стат");
+	CHECK(out.view().find("Память этой битвы: ") != std::string_view::npos);
+	CHECK(BattleArena::getMaxUsed() > 0);
+	out.str("");
+	battles.clear();
+	unlink("AllocationTests.replay");
+}
+
+// Сессии чата: команды идут через SessionScheduler, вывод собирается в ответ зрителю, как это делает сервер.
+static void testSessions()
+{
+	const unsigned int sessionCount = 32;
+	Random::seed(2);
+	SessionScheduler scheduler(2);
+	std::vector<std::string> nicknames;
+	std::vector<std::unique_ptr<ChatSession>> sessions;
+	for (unsigned int i = 0; i < sessionCount; i++)
+		nicknames.push_back("зритель_из_чата_" + std::to_string(i));
+	for (unsigned int i = 0; i < sessionCount; i++)
+	{
+		sessions.push_back(std::make_unique<ChatSession>());
+		ChatSession& session = *sessions.back();
+		std::string output;
+		output.reserve(ChatSession::outputReserve);
+		session.output.str(std::move(output));
+		session.battle = std::make_unique<GreatBattle>(nicknames[i], session.output);
+		session.nickname = nicknames[i];
+		session.slot = SessionStore::noSlot;
+		session.worker = scheduler.assignWorker();
+	}
+
+	std::vector<ChatSession*> completed;
+	completed.reserve(sessionCount);
+	unsigned long long replies = 0;
+	auto collect = [&](int timeout)
+	{
+		pollfd descriptor = { scheduler.getEventFd(), POLLIN, 0 };
+		if (poll(&descriptor, 1, timeout) <= 0)
+			return;
+		scheduler.takeCompleted(completed);
+		for (ChatSession* session: completed)
+		{
+			std::lock_guard<std::mutex> lock(session->mutex);
+			session->isCompleted = false;
+			session->reply.append(session->reply.empty() ? "" : " | ").append(session->result);
+			session->result.clear();
+			replies += !session->reply.empty();
+			session->reply.clear();
+		}
+		completed.clear();
+	};
+	auto play = [&](unsigned int rounds)
+	{
+		for (unsigned int round = 0; round < rounds; round++)
+		{
+			for (std::unique_ptr<ChatSession>& session: sessions)
+			{
+				bool isIdle;
+				{
+					std::lock_guard<std::mutex> lock(session->mutex);
+					session->commands.append(commands[Random::next(std::size(commands))]).push_back('\n');
+					isIdle = !session->isScheduled;
+					session->isScheduled = true;
+				}
+				if (isIdle)
+					scheduler.submit(*session);
+			}
+			collect(1);
+		}
+		unsigned int busy;
+		do
+		{
+			collect(10);
+			busy = 0;
+			for (std::unique_ptr<ChatSession>& session: sessions)
+			{
+				std::lock_guard<std::mutex> lock(session->mutex);
+				busy += session->isScheduled || session->isCompleted;
+			}
+		}
+		while (busy > 0);
+	};
+
+	play(2000);
+	unsigned long long heap = countAllocations([&] { play(2000); });
+	std::cout << "Сессии: выделений за " << 2000 * sessionCount << " команд после разогрева: " << heap << ", ответов: " << replies << std::endl;
+	CHECK(heap == 0);
+	CHECK(replies > 0);
+	scheduler.stop();
+}
+
+int main()
+{
+	testBattles();
+	testSessions();
+	return finishChecks("AllocationTests");
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <iostream>
+
+// Проверки тестов: проваленная проверка печатается и считается, код возврата теста - число провалов.
+inline unsigned int checkFailures = 0;
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": не выполнено " << #condition << std::endl; \
+			checkFailures++; \
+		} \
+	} while (false)
+
+inline int finishChecks(const char* name)
+{
+	if (checkFailures == 0)
+		std::cout << name << ": все проверки пройдены" << std::endl;
+	else
+		std::cout << name << ": провалено проверок: " << checkFailures << std::endl;
+	return checkFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,210 @@
+#include "GreatBattle.cpp"
+#include "tests/Check.h"
+
+#include <poll.h>
+
+// Нагрузочные проверки многопоточных частей сервера: очереди подбора MatchQueue и планировщика сессий.
+
+// Несколько писателей и читателей одновременно гоняют места через одну очередь, которая то и дело
+// заполняется. Каждое место должно выйти из очереди ровно один раз.
+static void testMatchQueueStress()
+{
+	const unsigned int producers = 4, consumers = 4, seatsPerProducer = 50000;
+	const unsigned int seatCount = producers * seatsPerProducer;
+	std::vector<std::unique_ptr<DuelSeat>> seats;
+	seats.reserve(seatCount);
+	std::unordered_map<DuelSeat*, unsigned int> indices;
+	for (unsigned int i = 0; i < seatCount; i++)
+	{
+		seats.push_back(std::make_unique<DuelSeat>("место", 0, nullptr));
+		indices.emplace(seats.back().get(), i);
+	}
+
+	MatchQueue queue;
+	std::vector<std::atomic<unsigned int>> popped(seatCount);
+	std::atomic<unsigned int> poppedCount(0), rejects(0);
+	std::vector<std::thread> threads;
+	for (unsigned int p = 0; p < producers; p++)
+		threads.emplace_back([&, p]
+		{
+			for (unsigned int i = 0; i < seatsPerProducer; i++)
+				while (!queue.push(seats[p * seatsPerProducer + i].get()))
+				{
+					rejects++;
+					std::this_thread::yield();
+				}
+		});
+	for (unsigned int c = 0; c < consumers; c++)
+		threads.emplace_back([&]
+		{
+			DuelSeat* seat;
+			while (poppedCount.load() < seatCount)
+			{
+				if (!queue.pop(seat))
+				{
+					std::this_thread::yield();
+					continue;
+				}
+				popped[indices.at(seat)]++;
+				// Читатели иногда притормаживают, чтобы очередь заполнилась.
+				if ((poppedCount.fetch_add(1) & 0x3FFF) == 0)
+					std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}
+		});
+	for (std::thread& thread: threads)
+		thread.join();
+
+	unsigned int once = 0;
+	for (std::atomic<unsigned int>& count: popped)
+		once += count.load() == 1;
+	CHECK(once == seatCount);
+	DuelSeat* seat;
+	CHECK(!queue.pop(seat));
+	std::cout << "MatchQueue: отказов полной очереди " << rejects.load() << std::endl;
+}
+
+// Писатели вместе заполняют очередь ровно до ёмкости: ни один push не должен получить отказ, а следующий -
+// должен. Затем читатели вместе опустошают её, и каждое место выходит ровно один раз.
+static void testMatchQueueFull()
+{
+	const unsigned int threadCount = 4, perThread = MatchQueue::capacity / threadCount;
+	std::vector<std::unique_ptr<DuelSeat>> seats;
+	for (unsigned int i = 0; i < MatchQueue::capacity + 1; i++)
+		seats.push_back(std::make_unique<DuelSeat>("место", 0, nullptr));
+
+	MatchQueue queue;
+	for (unsigned int round = 0; round < 3; round++)
+	{
+		std::atomic<unsigned int> rejects(0);
+		std::vector<std::thread> threads;
+		for (unsigned int t = 0; t < threadCount; t++)
+			threads.emplace_back([&, t]
+			{
+				for (unsigned int i = 0; i < perThread; i++)
+					rejects += !queue.push(seats[t * perThread + i].get());
+			});
+		for (std::thread& thread: threads)
+			thread.join();
+		threads.clear();
+		CHECK(rejects.load() == 0);
+		CHECK(!queue.push(seats[MatchQueue::capacity].get()));
+
+		std::vector<std::vector<DuelSeat*>> taken(threadCount);
+		for (unsigned int t = 0; t < threadCount; t++)
+			threads.emplace_back([&, t]
+			{
+				DuelSeat* seat;
+				while (queue.pop(seat))
+					taken[t].push_back(seat);
+			});
+		for (std::thread& thread: threads)
+			thread.join();
+		std::vector<DuelSeat*> all;
+		for (std::vector<DuelSeat*>& part: taken)
+			all.insert(all.end(), part.begin(), part.end());
+		std::sort(all.begin(), all.end());
+		CHECK(all.size() == MatchQueue::capacity);
+		CHECK(std::adjacent_find(all.begin(), all.end()) == all.end());
+	}
+}
+
+// Все сессии закреплены за одним воркером, остальные воркеры их крадут. Команды каждой сессии должны
+// выполниться все и по порядку: сложности из вывода идут так же, как шли команды.
+static void testSchedulerStress()
+{
+	const unsigned int sessionCount = 64, rounds = 200;
+	SessionScheduler scheduler(4);
+	std::vector<std::unique_ptr<ChatSession>> sessions;
+	std::unordered_map<ChatSession*, unsigned int> indices;
+	std::vector<std::string> nicknames, expected(sessionCount), replies(sessionCount);
+	for (unsigned int i = 0; i < sessionCount; i++)
+		nicknames.push_back("зритель" + std::to_string(i));
+	for (unsigned int i = 0; i < sessionCount; i++)
+	{
+		sessions.push_back(std::make_unique<ChatSession>());
+		ChatSession& session = *sessions.back();
+		session.battle = std::make_unique<GreatBattle>(nicknames[i], session.output);
+		session.nickname = nicknames[i];
+		session.slot = SessionStore::noSlot;
+		session.worker = 0;
+		indices.emplace(&session, i);
+	}
+
+	unsigned int unfinished = 0;
+	std::vector<ChatSession*> completed;
+	auto collect = [&](int timeout)
+	{
+		pollfd descriptor = { scheduler.getEventFd(), POLLIN, 0 };
+		if (poll(&descriptor, 1, timeout) <= 0)
+			return;
+		scheduler.takeCompleted(completed);
+		for (ChatSession* session: completed)
+		{
+			std::lock_guard<std::mutex> lock(session->mutex);
+			session->isCompleted = false;
+			replies[indices.at(session)].append(session->result).append(" | ");
+			session->result.clear();
+		}
+		completed.clear();
+	};
+
+	Random::seed(7);
+	for (unsigned int round = 0; round < rounds; round++)
+	{
+		for (unsigned int i = 0; i < sessionCount; i++)
+		{
+			ChatSession& session = *sessions[i];
+			bool isHard = Random::next(2) == 0;
+			expected[i].push_back(isHard ? 'h' : 'e');
+			bool isIdle;
+			{
+				std::lock_guard<std::mutex> lock(session.mutex);
+				session.commands.append(isHard ? "!битва сложность сложная\n" : "!битва сложность лёгкая\n");
+				isIdle = !session.isScheduled;
+				session.isScheduled = true;
+			}
+			if (isIdle)
+				scheduler.submit(session);
+		}
+		collect(0);
+	}
+	auto start = std::chrono::steady_clock::now();
+	do
+	{
+		collect(50);
+		unfinished = 0;
+		for (std::unique_ptr<ChatSession>& session: sessions)
+		{
+			std::lock_guard<std::mutex> lock(session->mutex);
+			unfinished += session->isScheduled || session->isCompleted;
+		}
+	}
+	while (unfinished > 0 && std::chrono::steady_clock::now() - start < std::chrono::seconds(30));
+	scheduler.stop();
+	CHECK(unfinished == 0);
+
+	constexpr std::string_view prefix = "Сложность Botbder'а: ";
+	unsigned int ordered = 0;
+	for (unsigned int i = 0; i < sessionCount; i++)
+	{
+		std::string actual;
+		std::string_view reply = replies[i];
+		size_t pos;
+		while ((pos = reply.find(prefix)) != std::string_view::npos)
+		{
+			reply.remove_prefix(pos + prefix.size());
+			actual.push_back(reply.starts_with("сложная") ? 'h' : reply.starts_with("лёгкая") ? 'e' : '?');
+		}
+		ordered += actual == expected[i];
+	}
+	CHECK(ordered == sessionCount);
+	std::cout << "SessionScheduler: краж сессий " << scheduler.getStealCount() << std::endl;
+}
+
+int main()
+{
+	testMatchQueueStress();
+	testMatchQueueFull();
+	testSchedulerStress();
+	return finishChecks("MatchQueueTests");
+}
@@ -0,0 +1,223 @@
+#include "GreatBattle.cpp"
+#include "tests/Check.h"
+
+// Сохранение сессий: запись битвы в середине боя и обратно, файл сессий после перезапуска, отказ от
+// повреждённых и оборванных записей, повторное использование слотов.
+
+// Запись игрока с эффектами во всех ячейках колеса: по slotCapacity эффектов в каждой - карты с отложенным
+// эффектом и разное число оставшихся ходов.
+static void fillEffects(PlayerRecord& record)
+{
+	const unsigned char delayedCards[] = { 2, 6, 14, 31 };
+	record.effectCounts = 0;
+	unsigned int count = 0;
+	for (unsigned int delay = 0; delay < EffectWheel::size; delay++)
+	{
+		record.effectCounts |= EffectWheel::slotCapacity << (2 * delay);
+		for (unsigned int i = 0; i < EffectWheel::slotCapacity; i++, count++)
+			record.effects[count] = delayedCards[count % std::size(delayedCards)] | ((1 + (delay + i) % 3) << 6);
+	}
+}
+
+static void checkEffects(const Player& player, const PlayerRecord& record)
+{
+	unsigned int count = 0;
+	for (unsigned int delay = 0; delay < EffectWheel::size; delay++)
+	{
+		CHECK(player.getEffects().getCount(delay) == ((record.effectCounts >> (2 * delay)) & 3u));
+		for (unsigned int i = 0; i < player.getEffects().getCount(delay); i++, count++)
+		{
+			EffectWheel::Effect effect = player.getEffects().get(delay, i);
+			CHECK(effect.cardID == (record.effects[count] & 0x3F));
+			CHECK(effect.turns == (record.effects[count] >> 6));
+		}
+	}
+}
+
+// Битва, сыгранная на несколько ходов, сохраняется, восстанавливается в новой битве и сохраняется снова
+// той же записью - и с эффектами во всех ячейках колеса обоих игроков.
+static void testBattleRoundTrip()
+{
+	Random::seed(1);
+	std::ostringstream out;
+	GreatBattle battle("тестер", out);
+	battle.reset(12345);
+	battle.handleInput("!битва пересдать");
+	for (unsigned int i = 0; i < 4 && battle.handleInput("!битва 1"); i++);
+
+	SessionRecord record = {};
+	CHECK(battle.save(record));
+	CHECK(record.marker == SessionRecord::markerValue);
+	CHECK(record.isRetaked == 1);
+	CHECK(std::string_view(record.nickname, record.nicknameLength) == "тестер");
+	CHECK(record.players[0].cardCount == battle.getYou().getCardCount());
+	CHECK(record.players[1].cardCount == battle.getBotbder().getCardCount());
+
+	fillEffects(record.players[0]);
+	fillEffects(record.players[1]);
+	record.epicMask[0] &= ~0x6ull;
+	record.wins = 7;
+
+	std::ostringstream restoredOut;
+	GreatBattle restored("тестер", restoredOut);
+	restored.restore(record);
+	checkEffects(restored.getYou(), record.players[0]);
+	checkEffects(restored.getBotbder(), record.players[1]);
+	CHECK(restored.getYou().getHealth() == record.players[0].health);
+	CHECK(restored.getBotbder().getExtraMovesCount() == record.players[1].extraMoves);
+
+	SessionRecord saved = {};
+	CHECK(restored.save(saved));
+	CHECK(std::memcmp(&saved, &record, sizeof(record)) == 0);
+
+	// Восстановленная битва продолжается.
+	CHECK(restored.handleInput("!битва инфо"));
+}
+
+// Карты с ID вне каталога в записи не попадают в руку.
+static void testBadCards()
+{
+	EventLog events;
+	Deck deck;
+	Player player(false, events, deck);
+	PlayerRecord record = {};
+	record.health = 3;
+	record.cardCount = 4;
+	record.cards[0] = 1;
+	record.cards[1] = 0;
+	record.cards[2] = CardManager::getAllCardsCount() + 1;
+	record.cards[3] = CardManager::getAllCardsCount();
+	player.load(record);
+	CHECK(player.getCardCount() == 2);
+	CHECK(player.getCardID(0) == 1);
+	CHECK(player.getCardID(1) == CardManager::getAllCardsCount());
+}
+
+static SessionRecord makeRecord(std::string_view nickname, unsigned short wins)
+{
+	SessionRecord record = {};
+	record.marker = SessionRecord::markerValue;
+	record.difficulty = (unsigned char)Difficulty::Hard;
+	record.epicMask[0] = record.epicMask[1] = ~0ull;
+	record.players[0].health = 5;
+	record.players[1].health = 4;
+	fillEffects(record.players[0]);
+	record.wins = wins;
+	record.nicknameLength = nickname.size();
+	std::memcpy(record.nickname, nickname.data(), nickname.size());
+	return record;
+}
+
+static bool sameRecord(const SessionRecord& a, const SessionRecord& b)
+{
+	return std::memcmp((const char*)&a + sizeof(a.checksum), (const char*)&b + sizeof(b.checksum), sizeof(a) - sizeof(a.checksum)) == 0;
+}
+
+// Портит байт записи слота прямо в файле.
+static void corruptByte(const std::string& path, unsigned int slot, size_t offset)
+{
+	int file = ::open(path.c_str(), O_RDWR);
+	CHECK(file >= 0);
+	unsigned char byte = 0;
+	off_t pos = (off_t)slot * sizeof(SessionRecord) + offset;
+	CHECK(pread(file, &byte, 1, pos) == 1);
+	byte ^= 0x5A;
+	CHECK(pwrite(file, &byte, 1, pos) == 1);
+	close(file);
+}
+
+// Оборванная запись: начало слота - от новой записи, конец - от прежней, как при сбое посреди pwrite.
+static void tearRecord(const std::string& path, unsigned int slot, const SessionRecord& next)
+{
+	int file = ::open(path.c_str(), O_RDWR);
+	CHECK(file >= 0);
+	CHECK(pwrite(file, &next, sizeof(next) / 2, (off_t)slot * sizeof(SessionRecord)) == sizeof(next) / 2);
+	close(file);
+}
+
+static void testSessionFile()
+{
+	std::string path = "SessionStoreTests.dat";
+	unlink(path.c_str());
+
+	SessionRecord alice = makeRecord("alice", 1), bob = makeRecord("bob", 2), carol = makeRecord("carol", 3);
+	unsigned int aliceSlot, bobSlot, carolSlot;
+	{
+		SessionStore store;
+		CHECK(store.open(path));
+		SessionRecord record;
+		CHECK(!store.load("alice", aliceSlot, record));
+		CHECK(!store.load("bob", bobSlot, record));
+		CHECK(!store.load("carol", carolSlot, record));
+		CHECK(aliceSlot != bobSlot && bobSlot != carolSlot && aliceSlot != carolSlot);
+		store.save(aliceSlot, alice);
+		store.save(bobSlot, bob);
+		store.save(carolSlot, carol);
+		// До записи на диск сессия отдаётся из памяти.
+		CHECK(store.load("bob", bobSlot, record));
+		CHECK(sameRecord(record, bob));
+	}
+
+	// После перезапуска все записи на месте.
+	{
+		SessionStore store;
+		CHECK(store.open(path));
+		unsigned int slot;
+		SessionRecord record;
+		CHECK(store.load("alice", slot, record) && slot == aliceSlot && sameRecord(record, alice));
+		CHECK(store.load("bob", slot, record) && slot == bobSlot && sameRecord(record, bob));
+		CHECK(store.load("carol", slot, record) && slot == carolSlot && sameRecord(record, carol));
+	}
+
+	// Запись с неверной контрольной суммой и оборванная запись отбрасываются, их слоты свободны.
+	corruptByte(path, bobSlot, offsetof(SessionRecord, players) + 5);
+	tearRecord(path, carolSlot, makeRecord("dave", 4));
+	{
+		SessionStore store;
+		CHECK(store.open(path));
+		unsigned int slot;
+		SessionRecord record;
+		CHECK(store.load("alice", slot, record) && slot == aliceSlot && sameRecord(record, alice));
+		CHECK(!store.load("bob", slot, record));
+		CHECK(slot == bobSlot || slot == carolSlot);
+		CHECK(!store.load("carol", slot, record));
+		CHECK(slot == bobSlot || slot == carolSlot);
+		CHECK(!store.load("dave", slot, record));
+		CHECK(slot == 3);
+
+		// Освобождённый слот достаётся следующему новому зрителю.
+		store.release("alice", aliceSlot);
+		CHECK(!store.load("erin", slot, record));
+		CHECK(slot == aliceSlot);
+		store.save(slot, makeRecord("erin", 5));
+	}
+	{
+		SessionStore store;
+		CHECK(store.open(path));
+		unsigned int slot;
+		SessionRecord record;
+		CHECK(!store.load("alice", slot, record));
+		CHECK(store.load("erin", slot, record) && slot == aliceSlot && sameRecord(record, makeRecord("erin", 5)));
+	}
+
+	// Оборванный хвост файла (неполная последняя запись) не считается слотом.
+	CHECK(truncate(path.c_str(), (carolSlot + 1) * sizeof(SessionRecord) - 10) == 0);
+	{
+		SessionStore store;
+		CHECK(store.open(path));
+		unsigned int slot;
+		SessionRecord record;
+		CHECK(store.load("erin", slot, record) && slot == aliceSlot);
+		CHECK(!store.load("frank", slot, record));
+		CHECK(slot == bobSlot || slot == carolSlot);
+	}
+	unlink(path.c_str());
+}
+
+int main()
+{
+	testBattleRoundTrip();
+	testBadCards();
+	testSessionFile();
+	return finishChecks("SessionStoreTests");
+}
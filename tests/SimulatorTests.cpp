@@ -0,0 +1,68 @@
+#include "GreatBattle.cpp"
+#include "tests/Check.h"
+
+// Пакетный движок (--simulate-batch) должен играть по тем же правилам, что и обычный симулятор (--simulate).
+// Оба играют много битв с фиксированными зёрнами, и их сводки сравниваются с допусками на случайный разброс:
+// при таком числе битв разница между двумя прогонами одного движка в несколько раз меньше допусков.
+
+static bool sameStats(const SimulatorStats& a, const SimulatorStats& b)
+{
+	return a.games == b.games && a.moves == b.moves && a.aborted == b.aborted && std::equal(a.outcomes, a.outcomes + 3, b.outcomes)
+		&& a.plays == b.plays && a.gamesPlayed == b.gamesPlayed && a.gamesWon == b.gamesWon;
+}
+
+// С тем же зерном и числом потоков симуляция повторяется в точности.
+static void testDeterminism(bool isBatch)
+{
+	unsigned int cardCount = CardManager::getAllCardsCount();
+	SimulatorStats first(cardCount), second(cardCount);
+	Simulator::simulate(20000, 2, 42, isBatch, first);
+	Simulator::simulate(20000, 2, 42, isBatch, second);
+	CHECK(first.games == 20000);
+	CHECK(sameStats(first, second));
+}
+
+static void testBatchMatchesScalar()
+{
+	const unsigned long long games = 300000;
+	unsigned int cardCount = CardManager::getAllCardsCount();
+	SimulatorStats scalar(cardCount), batch(cardCount);
+	Simulator::simulate(games, 2, 1001, false, scalar);
+	Simulator::simulate(games, 2, 2002, true, batch);
+	CHECK(scalar.games == games && batch.games == games);
+	CHECK(scalar.aborted == 0 && batch.aborted == 0);
+
+	// Доли исходов битв - в пределах процентного пункта, средняя длина битвы - в пределах процента.
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		double a = (double)scalar.outcomes[i] / games, b = (double)batch.outcomes[i] / games;
+		std::cout << "Исход " << i << ": " << 100 * a << "% / " << 100 * b << "%" << std::endl;
+		CHECK(std::abs(a - b) < 0.01);
+	}
+	double scalarMoves = (double)scalar.moves / games, batchMoves = (double)batch.moves / games;
+	CHECK(std::abs(scalarMoves - batchMoves) < 0.01 * scalarMoves);
+
+	// Сколько раз за битву играют каждую карту и доля побед в битвах, где она сыграна: расхождение
+	// больше 6% от значения (или 2.5 п.п. доли побед) - уже не разброс, а разные правила.
+	for (unsigned int id = 1; id <= cardCount; id++)
+	{
+		double a = (double)scalar.plays[id] / games, b = (double)batch.plays[id] / games;
+		bool isPlaysClose = std::abs(a - b) <= 0.06 * std::max(a, b);
+		double winA = scalar.gamesPlayed[id] > 0 ? (double)scalar.gamesWon[id] / scalar.gamesPlayed[id] : 0;
+		double winB = batch.gamesPlayed[id] > 0 ? (double)batch.gamesWon[id] / batch.gamesPlayed[id] : 0;
+		bool isWinsClose = std::abs(winA - winB) < 0.025;
+		if (!isPlaysClose || !isWinsClose)
+			std::cerr << "Карта " << id << " (" << CardManager::getCardByID(id).getName() << "): сыграна за битву " << a << " / " << b
+				<< ", победы " << 100 * winA << "% / " << 100 * winB << "%" << std::endl;
+		CHECK(isPlaysClose);
+		CHECK(isWinsClose);
+	}
+}
+
+int main()
+{
+	testDeterminism(false);
+	testDeterminism(true);
+	testBatchMatchesScalar();
+	return finishChecks("SimulatorTests");
+}